@@ -0,0 +1,252 @@
+#include "backend.h"
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+
+LlamaBackend::LlamaBackend(llama_model *model, llama_context *ctx, llama_context_params params)
+	: model(model), ctx(ctx), params(params)
+{
+	vocab = llama_model_get_vocab(model);
+}
+
+LlamaBackend::~LlamaBackend()
+{
+	if(ctx) llama_free(ctx);
+	if(model) llama_model_free(model);
+}
+
+int LlamaBackend::n_vocab() { return llama_vocab_n_tokens(vocab); }
+llama_token LlamaBackend::bos() { return llama_vocab_bos(vocab); }
+
+int LlamaBackend::token_to_piece(llama_token t, char *buf, int len, bool special)
+{
+	return llama_token_to_piece(vocab, t, buf, len, 0, special);
+}
+
+int LlamaBackend::tokenize(const char *text, int len, llama_token *out, int n_max, bool add_special)
+{
+	return llama_tokenize(vocab, text, len, out, n_max, add_special, true);
+}
+
+// after a failed resize() there may be no context at all, until a later one gets one
+int LlamaBackend::n_ctx() { return ctx ? llama_n_ctx(ctx) : 0; }
+int LlamaBackend::n_ctx_train() { return llama_model_n_ctx_train(model); }
+bool LlamaBackend::can_shift() { return ctx && llama_kv_cache_can_shift(ctx); }
+
+/* snapshots carry over: a state saved from a smaller context restores into a larger one just fine */
+bool LlamaBackend::resize(int n)
+{
+	int n_old = params.n_ctx;
+	if(ctx) llama_free(ctx);
+	params.n_ctx = n;
+	params.n_batch = n;
+	ctx = llama_new_context_with_model(model, params);
+	if(!ctx) {
+		// most likely out of memory; stay where we were if that can still be had
+		fprintf(stderr, "%s: failed to grow the context to %d\n", __func__, n);
+		params.n_ctx = params.n_batch = n_old;
+		ctx = llama_new_context_with_model(model, params);
+		if(!ctx) fprintf(stderr, "%s: failed to get the context of %d back, now without one\n", __func__, n_old);
+		return false;
+	}
+	return true;
+}
+
+int LlamaBackend::decode(const llama_batch &b)
+{
+	if(!ctx) return -1;
+	int rc = llama_decode(ctx, b);
+	llama_synchronize(ctx);
+	return rc;
+}
+
+float *LlamaBackend::logits(int i) { return ctx ? llama_get_logits_ith(ctx, i) : NULL; }
+size_t LlamaBackend::state_size() { return ctx ? llama_get_state_size(ctx) : 0; }
+size_t LlamaBackend::get_state(uint8_t *dst) { return ctx ? llama_copy_state_data(ctx, dst) : 0; }
+void LlamaBackend::set_state(const uint8_t *src) { if(ctx) llama_set_state_data(ctx, src); }
+void LlamaBackend::clear() { if(ctx) llama_kv_cache_clear(ctx); }
+
+void LlamaBackend::shift(int n)
+{
+	if(!ctx) return;
+	llama_kv_cache_seq_rm(ctx, 0, 0, n);
+	llama_kv_cache_seq_add(ctx, 0, n, -1, -n);
+}
+
+/* fingerprint of a vocabulary: if two models agree on it, their token ids mean the same text */
+uint64_t vocab_fingerprint(LLMBackend *b)
+{
+	uint64_t h = 14695981039346656037ull; // FNV-1a
+	auto mix = [&h](const void *p, int n) {
+		for(int i=0; i<n; ++i) {
+			h ^= ((const unsigned char*)p)[i];
+			h *= 1099511628211ull;
+		}
+	};
+	
+	int n = b->n_vocab();
+	llama_token bos = b->bos();
+	mix(&n, sizeof(n));
+	mix(&bos, sizeof(bos));
+	char buf[256];
+	for(llama_token t=0; t<n; ++t) {
+		int len = b->token_to_piece(t, buf, sizeof(buf), true);
+		mix(&len, sizeof(len)); // also keeps neighbouring pieces apart
+		if(len > 0) mix(buf, len);
+	}
+	return h;
+}
+
+static uint64_t splitmix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+MockBackend::MockBackend(int vocab_size, int ctx_train, uint64_t seed)
+	: vocab_size(std::max(vocab_size, 257)), ctx_train(ctx_train), seed(seed)
+{
+	// BOS, then every byte, then words of two to six letters, most of them after a space
+	pieces.resize(this->vocab_size);
+	for(int b=0; b<256; ++b) pieces[1+b] = std::string(1, (char)b);
+	uint64_t r = seed;
+	for(int t=257; t<this->vocab_size; ++t) {
+		r = splitmix(r);
+		std::string w = (r % 10 < 7) ? " " : "";
+		int n = 2 + (r >> 8) % 5;
+		for(int i=0; i<n; ++i) w += 'a' + (splitmix(r+i) % 26);
+		pieces[t] = w;
+		piece_tok.emplace(w, t);
+		max_piece = std::max(max_piece, (int)w.size());
+	}
+	ctx_size = std::min(ctx_size, ctx_train);
+}
+
+int MockBackend::n_vocab() { return vocab_size; }
+llama_token MockBackend::bos() { return 0; }
+
+int MockBackend::token_to_piece(llama_token t, char *buf, int len, bool special)
+{
+	if(t < 0 || t >= vocab_size) return 0;
+	const std::string &p = pieces[t];
+	if((int)p.size() > len) return -(int)p.size();
+	memcpy(buf, p.data(), p.size());
+	return p.size();
+}
+
+int MockBackend::tokenize(const char *text, int len, llama_token *out, int n_max, bool add_special)
+{
+	std::vector<llama_token> toks;
+	if(add_special) toks.push_back(bos());
+	for(int i=0; i<len; ) {
+		int l = std::min(max_piece, len-i);
+		for(; l>1; --l) {
+			auto p = piece_tok.find(std::string(text+i, l));
+			if(p != piece_tok.end()) {
+				toks.push_back(p->second);
+				break;
+			}
+		}
+		if(l <= 1) toks.push_back(1 + (unsigned char)text[i]);
+		i += std::max(l, 1);
+	}
+	if((int)toks.size() > n_max) return -(int)toks.size();
+	std::copy(toks.begin(), toks.end(), out);
+	return toks.size();
+}
+
+int MockBackend::n_ctx() { return ctx_size; }
+int MockBackend::n_ctx_train() { return ctx_train; }
+bool MockBackend::can_shift() { return true; }
+
+bool MockBackend::resize(int n)
+{
+	if(n > ctx_train) return false;
+	ctx_size = n;
+	clear();
+	return true;
+}
+
+void MockBackend::rehash(int from)
+{
+	hashes.resize(cells.size());
+	for(int p=from; p<(int)cells.size(); ++p)
+		hashes[p] = splitmix((p ? hashes[p-1] : seed) ^ (uint64_t)cells[p]);
+}
+
+int MockBackend::decode(const llama_batch &b)
+{
+	if(us_per_decode || us_per_token)
+		std::this_thread::sleep_for(std::chrono::microseconds(us_per_decode + us_per_token*b.n_tokens));
+
+	int from = cells.size();
+	for(int i=0; i<b.n_tokens; ++i) {
+		if(b.pos[i] >= ctx_size) return 1; // no room, as llama_decode would say
+		if(b.pos[i] >= (int)cells.size()) cells.resize(b.pos[i]+1, bos());
+		cells[b.pos[i]] = b.token[i];
+		from = std::min(from, (int)b.pos[i]);
+	}
+	rehash(from);
+
+	// a few tokens stand out at every position, the rest trail off
+	int rows = 0;
+	out_row.assign(b.n_tokens, -1);
+	for(int i=0; i<b.n_tokens; ++i) if(b.logits[i]) out_row[i] = rows++;
+	out.resize((size_t)rows * vocab_size);
+	for(int i=0; i<b.n_tokens; ++i) {
+		if(out_row[i] < 0) continue;
+		float *l = &out[(size_t)out_row[i] * vocab_size];
+		uint64_t h = hashes[b.pos[i]];
+		for(int t=0; t<vocab_size; ++t) {
+			float u = (splitmix(h + t) >> 40) / (float)(1 << 24);
+			l[t] = 12.0f * u*u*u*u*u*u*u*u;
+		}
+	}
+	return 0;
+}
+
+/* like llama_get_logits_ith, NULL for entries that did not ask for logits */
+float *MockBackend::logits(int i)
+{
+	if(i < 0 || i >= (int)out_row.size() || out_row[i] < 0) return NULL;
+	return &out[(size_t)out_row[i] * vocab_size];
+}
+
+/* the positions in use, their tokens, then padding */
+size_t MockBackend::state_size()
+{
+	return sizeof(int32_t) + ctx_train*sizeof(llama_token) + state_pad;
+}
+
+size_t MockBackend::get_state(uint8_t *dst)
+{
+	int32_t n = cells.size();
+	memcpy(dst, &n, sizeof(n));
+	if(n) memcpy(dst + sizeof(n), cells.data(), n*sizeof(llama_token));
+	return state_size();
+}
+
+void MockBackend::set_state(const uint8_t *src)
+{
+	int32_t n;
+	memcpy(&n, src, sizeof(n));
+	cells.resize(n);
+	if(n) memcpy(cells.data(), src + sizeof(n), n*sizeof(llama_token));
+	rehash(0);
+}
+
+void MockBackend::clear()
+{
+	cells.clear();
+	hashes.clear();
+}
+
+void MockBackend::shift(int n)
+{
+	cells.erase(cells.begin(), cells.begin() + std::min(n, (int)cells.size()));
+	rehash(0);
+}
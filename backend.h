@@ -0,0 +1,108 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include "common.h"
+
+/* Everything LLMBuffer asks of a model once it is loaded: its vocabulary, one context to decode
+ * batches into, and that context's state. LlamaBackend is the real thing; MockBackend makes up
+ * deterministic logits with a given latency, so the token tree and work queue can be run and timed
+ * without a GGUF file. A backend is only used by one thread at a time. */
+struct LLMBackend {
+	virtual ~LLMBackend() {}
+
+	/* vocabulary */
+	virtual int n_vocab() = 0;
+	virtual llama_token bos() = 0;
+	virtual int token_to_piece(llama_token t, char *buf, int len, bool special) = 0; // as llama_token_to_piece
+	virtual int tokenize(const char *text, int len, llama_token *out, int n_max, bool add_special) = 0; // as llama_tokenize; may be called from several threads at once
+
+	/* context */
+	virtual int n_ctx() = 0;
+	virtual int n_ctx_train() = 0;
+	virtual bool resize(int n_ctx) = 0; // start over with an empty context of n_ctx positions; false if it can't be had, with the
+	                                    // old size back or, if even that failed, no context (n_ctx() 0) until a later resize
+	virtual bool can_shift() = 0;
+	virtual int decode(const llama_batch &b) = 0; // as llama_decode, but returns when it is done
+	virtual float *logits(int i) = 0; // of batch entry i of the last decode; NULL if it did not ask for them
+
+	/* state, as snapshots hold it */
+	virtual size_t state_size() = 0;
+	virtual size_t get_state(uint8_t *dst) = 0;
+	virtual void set_state(const uint8_t *src) = 0;
+	virtual void clear() = 0;
+	virtual void shift(int n) = 0; // forget the first n positions and move the rest down by n
+};
+
+uint64_t vocab_fingerprint(LLMBackend *b); // equal for two backends if their token ids mean the same text
+
+struct LlamaBackend : LLMBackend {
+	llama_model *model;
+	llama_context *ctx;
+	llama_context_params params;
+	const llama_vocab *vocab;
+
+	LlamaBackend(llama_model *model, llama_context *ctx, llama_context_params params);
+	~LlamaBackend();
+
+	int n_vocab();
+	llama_token bos();
+	int token_to_piece(llama_token t, char *buf, int len, bool special);
+	int tokenize(const char *text, int len, llama_token *out, int n_max, bool add_special);
+	int n_ctx();
+	int n_ctx_train();
+	bool resize(int n_ctx);
+	bool can_shift();
+	int decode(const llama_batch &b);
+	float *logits(int i);
+	size_t state_size();
+	size_t get_state(uint8_t *dst);
+	void set_state(const uint8_t *src);
+	void clear();
+	void shift(int n);
+};
+
+/* A made-up model. Tokens are bytes, BOS and a fixed set of random words, and are tokenized by longest
+ * match. The logits at a position are a hash of the tokens in the context up to it, so the same text
+ * always scores the same and a restored state picks up exactly where it left off. */
+struct MockBackend : LLMBackend {
+	int vocab_size = 4096; // at least 257: BOS and the bytes come first
+	int ctx_train = 8192;
+	int64_t us_per_decode = 0; // latency of every decode,
+	int64_t us_per_token = 0; // and of every token in it
+	size_t state_pad = 0; // bytes added to each state, to stand in for a real KV cache
+	uint64_t seed = 1;
+
+	MockBackend(int vocab_size = 4096, int ctx_train = 8192, uint64_t seed = 1);
+
+	int n_vocab();
+	llama_token bos();
+	int token_to_piece(llama_token t, char *buf, int len, bool special);
+	int tokenize(const char *text, int len, llama_token *out, int n_max, bool add_special);
+	int n_ctx();
+	int n_ctx_train();
+	bool resize(int n_ctx);
+	bool can_shift();
+	int decode(const llama_batch &b);
+	float *logits(int i);
+	size_t state_size();
+	size_t get_state(uint8_t *dst);
+	void set_state(const uint8_t *src);
+	void clear();
+	void shift(int n);
+
+	int ctx_size = 1024;
+	std::vector<std::string> pieces;
+	std::unordered_map<std::string, llama_token> piece_tok; // for tokenizing; bytes are not in here
+	int max_piece = 1;
+	std::vector<llama_token> cells; // token at each position: the whole of the mock's "KV cache"
+	std::vector<uint64_t> hashes; // of the tokens up to and including each position
+	std::vector<float> out; // logits of the last decode, a row per entry that asked for them
+	std::vector<int> out_row; // row of each entry of the last batch, or -1
+	void rehash(int from);
+};
+
+#endif
@@ -0,0 +1,295 @@
+/* autopen-bench: timings of the token tree operations whose cost grows with the document.
+ *
+ *   autopen-bench [-n sizes] [-b branching] [-k trees] [-r runs] [-t seconds] [-f tsv|jsonl] [-o out] [-v]
+ *
+ * For every document size in tokens (-n, 1000,10000,100000,1000000 by default) and branching factor (-b,
+ * 1,2,4: every token on the live path has that many children, the others being one-token predictions),
+ * builds -k trees (3) over a MockBackend and times on each of them:
+ *
+ *   build        inserting the whole document into an empty buffer: tokenizing it and a rebuild from the root
+ *   pos2ent      and pos2wordent, at random offsets
+ *   render       the whole live path to a string
+ *   index_live   walking the whole live path to index it, as after a change at the top of the document
+ *   frame        what the editor does per frame with a clean index: finding the cursor, then going over
+ *                one screenful of tokens from a random offset on
+ *   insert       and erase of one character at a random offset, each retokenizing the text around it and
+ *                moving everything after it along
+ *   reroot       moving the second half of the document one token and byte along
+ *   destroy      deleting the tree, from the root down
+ *
+ * Operations other than build, reroot and destroy run -r times (100) per tree, or for -t seconds (2) over
+ * all trees, whichever is less, but at least three times per tree. Each line of output is one operation at one size and
+ * branching factor: the number of tokens and tree nodes, how often it ran, and the mean, median, minimum
+ * and maximum time of one run in microseconds.
+ *
+ * The worker is kept from starting, so no decode ever gets in the way; what is measured is the tree alone. */
+
+#include "tokentree.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <random>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define fdopen _fdopen
+#define NULL_DEVICE "NUL"
+#else
+#include <unistd.h>
+#define NULL_DEVICE "/dev/null"
+#endif
+
+struct BenchConfig {
+	std::vector<int> sizes = { 1000, 10000, 100000, 1000000 };
+	std::vector<int> branching = { 1, 2, 4 };
+	int trees = 3;
+	int runs = 100;
+	double seconds = 2.0;
+	bool jsonl = false;
+	FILE *out;
+};
+
+/* times of one operation, gathered over all trees of a size and branching factor */
+struct Timing {
+	std::vector<double> us;
+	double total() { double s = 0; for(double u : us) s += u; return s; }
+};
+
+static double now_us()
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<int> parse_list(const char *s)
+{
+	std::vector<int> ret;
+	std::stringstream ss(s);
+	std::string item;
+	while(std::getline(ss, item, ','))
+		if(atoi(item.c_str()) > 0) ret.push_back(atoi(item.c_str()));
+	return ret;
+}
+
+/* text of about n tokens of the mock's vocabulary, with a line break every so often */
+static std::string make_text(MockBackend *mock, int n, std::mt19937 &rng)
+{
+	std::string text;
+	std::uniform_int_distribution<int> word(257, mock->vocab_size-1);
+	for(int i=1; i<n; ++i) {
+		if(rng() % 16 == 0) text += '\n';
+		else text += mock->pieces[word(rng)];
+	}
+	return text;
+}
+
+/* make the tree look like one the editor has been working on: scores on the live path, and next to
+ * every token on it, predictions to pick from instead */
+static void decorate(LLMBuffer &llm, int branching, std::mt19937 &rng)
+{
+	std::uniform_int_distribution<int> word(257, llm.n_vocab-1);
+	std::uniform_real_distribution<float> logit(0.0f, 12.0f);
+	for(TTE *t = &llm.root; t->children.size(); ) {
+		TTE *next = t->children[t->sel];
+		next->logit = logit(rng);
+		next->max_logit = 12.0f;
+		next->has_logit = true;
+		while((int)t->children.size() < branching) {
+			TTE *alt = new TTE(&llm);
+			alt->base_pos = t->base_pos + t->str_size;
+			alt->depth = t->depth + 1;
+			alt->parent = t;
+			alt->is_accepted = false;
+			alt->set_tok(word(rng));
+			alt->logit = logit(rng);
+			alt->max_logit = 12.0f;
+			alt->has_logit = true;
+			alt->sel = 0;
+			t->children.push_back(alt);
+		}
+		t = next;
+	}
+	llm.live_stale = 0;
+}
+
+static size_t count_nodes(TTE *root)
+{
+	size_t n = 0;
+	std::vector<TTE*> todo(1, root);
+	while(todo.size()) {
+		TTE *t = todo.back();
+		todo.pop_back();
+		++n;
+		todo.insert(todo.end(), t->children.begin(), t->children.end());
+	}
+	return n;
+}
+
+/* the editor's per-frame pass over the live path (see the highlighting in editor.cpp), less the drawing */
+static float frame(LLMBuffer &llm, int cursor, int view_from, int view_bytes)
+{
+	float sink = 0;
+	int ci = llm.live_find(cursor);
+	if(ci < (int)llm.live.size()) {
+		TTE *parent = llm.live[ci]->parent ? llm.live[ci]->parent : llm.live[ci];
+		sink += parent->sel;
+	}
+	for(int i = std::max(0, llm.live_find(view_from) - 1); i < (int)llm.live.size(); ++i) {
+		TTE *cur = llm.live[i];
+		if(llm.live_pos[i] > view_from + view_bytes) break;
+		if(cur->ctx_snapshot) sink += 1;
+		if(cur->parent && cur->parent->children.size() > 1) {
+			int cnt = 0;
+			for(auto &c : cur->parent->children) cnt += c->is_accepted;
+			sink += cnt;
+		}
+		if(!cur->is_accepted) break;
+		if(cur->has_logit) sink += cur->logit - cur->max_logit;
+		sink += cur->str.find('\n') != std::string::npos;
+	}
+	return sink;
+}
+
+static void put_result(BenchConfig &cfg, const char *op, int tokens, int branching, size_t nodes, Timing &t)
+{
+	if(!t.us.size()) return;
+	std::vector<double> us = t.us;
+	std::sort(us.begin(), us.end());
+	double mean = t.total() / us.size(), median = us[us.size()/2];
+	if(cfg.jsonl) {
+		fprintf(cfg.out, "{\"op\":\"%s\",\"tokens\":%d,\"branching\":%d,\"nodes\":%zu,\"runs\":%zu,\"mean_us\":%.3f,\"median_us\":%.3f,\"min_us\":%.3f,\"max_us\":%.3f}\n",
+			op, tokens, branching, nodes, us.size(), mean, median, us.front(), us.back());
+	} else {
+		fprintf(cfg.out, "%s\t%d\t%d\t%zu\t%zu\t%.3f\t%.3f\t%.3f\t%.3f\n",
+			op, tokens, branching, nodes, us.size(), mean, median, us.front(), us.back());
+	}
+	fflush(cfg.out);
+}
+
+static void bench(BenchConfig &cfg)
+{
+	LLMBuffer llm;
+	llm.init();
+	MockBackend *mock = new MockBackend();
+	llm.set_backend(mock, vocab_fingerprint(mock));
+	llm.is_working = true; // as if a decode never finished: work is queued, but nothing is run
+
+	std::mt19937 rng(1);
+	volatile float sink = 0;
+	const char *ops[] = { "build", "pos2ent", "pos2wordent", "render", "index_live", "frame", "insert", "erase", "reroot", "destroy" };
+	enum { BUILD, POS2ENT, POS2WORDENT, RENDER, INDEX_LIVE, FRAME, INSERT, ERASE, REROOT, DESTROY, N_OPS };
+
+	for(int size : cfg.sizes) {
+		std::string text = make_text(mock, size, rng);
+		for(int branching : cfg.branching) {
+			Timing t[N_OPS];
+			int tokens = 0;
+			size_t nodes = 0;
+			for(int k=0; k<cfg.trees; ++k) {
+				double t0 = now_us();
+				llm.insert(0, text);
+				t[BUILD].us.push_back(now_us() - t0);
+
+				decorate(llm, branching, rng);
+				llm.index_live();
+				tokens = llm.live.size();
+				nodes = count_nodes(&llm.root);
+
+				// runs an operation at random offsets until it has enough of them, or has had its time
+				std::uniform_int_distribution<int> pos(0, llm.doc.size());
+				auto repeat = [&](std::function<void(int)> f) {
+					double start = now_us();
+					for(int r=0; r<cfg.runs && (r<3 || now_us()-start < cfg.seconds*1e6 / cfg.trees); ++r) f(pos(rng));
+				};
+				auto timed = [&](int op, std::function<void(int)> f) {
+					repeat([&](int p) {
+						double t0 = now_us();
+						f(p);
+						t[op].us.push_back(now_us() - t0);
+					});
+				};
+				timed(POS2ENT, [&](int p) { sink = sink + llm.pos2ent(p)->depth; });
+				timed(POS2WORDENT, [&](int p) { sink = sink + llm.pos2wordent(p)->depth; });
+				timed(RENDER, [&](int) { sink = sink + llm.render(&llm.root, INT_MAX).size(); });
+				timed(INDEX_LIVE, [&](int) { llm.live_stale = 0; llm.index_live(); });
+				llm.index_live();
+				timed(FRAME, [&](int p) { sink = sink + frame(llm, p, p, 4096); });
+				// the same character goes in and out again, so the document stays as it was
+				repeat([&](int p) {
+					double t0 = now_us();
+					llm.insert(p, "x");
+					double t1 = now_us();
+					llm.erase(p, p+1);
+					t[ERASE].us.push_back(now_us() - t1);
+					t[INSERT].us.push_back(t1 - t0);
+				});
+
+				llm.index_live();
+				TTE *half = llm.live[llm.live.size()/2];
+				double t1 = now_us();
+				half->reroot(1, 1);
+				t[REROOT].us.push_back(now_us() - t1);
+				llm.live_stale = 0;
+
+				t1 = now_us();
+				llm.root.clear_children();
+				t[DESTROY].us.push_back(now_us() - t1);
+				llm.doc.erase(0, llm.doc.size());
+				llm.wq.clear();
+				llm.wq_head_invalid = false;
+			}
+			for(int op=0; op<N_OPS; ++op) put_result(cfg, ops[op], tokens, branching, nodes, t[op]);
+		}
+	}
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: autopen-bench [-n sizes] [-b branching] [-k trees] [-r runs] [-t seconds] [-f tsv|jsonl] [-o out] [-v]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	BenchConfig cfg;
+	std::string format = "tsv", out_fn;
+	bool verbose = false;
+	for(int i=1; i<argc; ++i) {
+		std::string a = argv[i];
+		bool has_val = i+1 < argc;
+		if((a == "-n" || a == "--sizes") && has_val) cfg.sizes = parse_list(argv[++i]);
+		else if((a == "-b" || a == "--branching") && has_val) cfg.branching = parse_list(argv[++i]);
+		else if((a == "-k" || a == "--trees") && has_val) cfg.trees = std::max(1, atoi(argv[++i]));
+		else if((a == "-r" || a == "--runs") && has_val) cfg.runs = std::max(1, atoi(argv[++i]));
+		else if((a == "-t" || a == "--time") && has_val) cfg.seconds = atof(argv[++i]);
+		else if((a == "-f" || a == "--format") && has_val) format = argv[++i];
+		else if((a == "-o" || a == "--output") && has_val) out_fn = argv[++i];
+		else if(a == "-v" || a == "--verbose") verbose = true;
+		else if(a == "-h" || a == "--help") { usage(); return 0; }
+		else { usage(); return 1; }
+	}
+	if(!cfg.sizes.size() || !cfg.branching.size() || (format != "tsv" && format != "jsonl")) {
+		usage();
+		return 1;
+	}
+	cfg.jsonl = (format == "jsonl");
+
+	// the buffer reports on every token it builds on stdout, so the results get their own stream
+	cfg.out = out_fn.size() ? fopen(out_fn.c_str(), "wb") : fdopen(dup(fileno(stdout)), "wb");
+	if(!cfg.out) {
+		fprintf(stderr, "cannot open %s\n", out_fn.size() ? out_fn.c_str() : "stdout");
+		return 1;
+	}
+	if(verbose) dup2(fileno(stderr), fileno(stdout));
+	else if(!freopen(NULL_DEVICE, "w", stdout)) return 1;
+	llama_log_set([](ggml_log_level, const char *, void *) {}, NULL);
+
+	if(!cfg.jsonl) fprintf(cfg.out, "op\ttokens\tbranching\tnodes\truns\tmean_us\tmedian_us\tmin_us\tmax_us\n");
+
+	bench(cfg);
+	fclose(cfg.out);
+	return 0;
+}
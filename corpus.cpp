@@ -0,0 +1,127 @@
+#include "corpus.h"
+#include <algorithm>
+#include <stdio.h>
+
+bool CorpusScorer::init(llama_model *model, llama_context_params params)
+{
+	n_ctx_seq = std::min(n_ctx_seq, llama_model_n_ctx_train(model));
+	stride = std::max(1, std::min(stride, n_ctx_seq-1));
+	n_batch = std::max(1, std::min(n_batch, n_seq*n_ctx_seq));
+
+	params.n_seq_max = n_seq;
+	params.n_ctx = n_seq * n_ctx_seq;
+	params.n_batch = n_batch;
+	params.n_ubatch = std::min(params.n_ubatch, params.n_batch);
+	ctx = llama_new_context_with_model(model, params);
+	if(!ctx) {
+		fprintf(stderr, "%s: failed to create a context for %d sequences of %d\n", __func__, n_seq, n_ctx_seq);
+		return false;
+	}
+	batch = llama_batch_init(n_batch, 0, 1);
+	return true;
+}
+
+CorpusScorer::~CorpusScorer()
+{
+	if(!ctx) return;
+	llama_batch_free(batch);
+	llama_free(ctx);
+}
+
+bool CorpusScorer::run(const std::vector<std::vector<llama_token>> &docs)
+{
+	struct Slot {
+		int doc = -1;
+		int next = 0; // index of the next token to decode
+		int pos = 0; // its position in the sequence
+	};
+	std::vector<Slot> slots(n_seq);
+	std::vector<int> out_doc(n_batch), out_i(n_batch); // what the logits at each batch index predict
+	bool can_shift = llama_kv_cache_can_shift(ctx);
+
+	n_tokens = 0;
+	n_docs = 0;
+	int64_t t0 = ggml_time_us();
+	size_t next_doc = 0;
+
+	auto finish = [&](int s) {
+		on_done(slots[s].doc);
+		++n_docs;
+		slots[s].doc = -1;
+		llama_kv_cache_seq_rm(ctx, s, -1, -1); // its cells are free for the next document
+	};
+
+	for(;;) {
+		// documents move into free sequences in order; ones with nothing to predict are done right away
+		int active = 0;
+		for(int s=0; s<n_seq; ++s) {
+			while(slots[s].doc < 0 && next_doc < docs.size()) {
+				slots[s] = Slot { (int)next_doc++, 0, 0 };
+				if(docs[slots[s].doc].size() < 2) finish(s);
+			}
+			if(slots[s].doc >= 0) ++active;
+		}
+		if(!active) break;
+
+		// a document that has filled its positions slides along, or stops if the cache can't be shifted
+		for(int s=0; s<n_seq; ++s) {
+			if(slots[s].doc < 0 || slots[s].pos < n_ctx_seq) continue;
+			if(!can_shift) {
+				fprintf(stderr, "%s: document %d is longer than %d tokens; the rest is not scored\n", __func__, slots[s].doc, n_ctx_seq);
+				finish(s);
+				--active;
+				continue;
+			}
+			llama_kv_cache_seq_rm(ctx, s, 0, stride);
+			llama_kv_cache_seq_add(ctx, s, stride, -1, -stride);
+			slots[s].pos -= stride;
+		}
+		if(!active) continue;
+
+		// every document gets a fair share of the batch, so one long document does not hold up the rest;
+		// whatever the short ones leave goes round again
+		common_batch_clear(batch);
+		int share = std::max(1, n_batch / active);
+		for(bool added = true; added && batch.n_tokens < n_batch; ) {
+			added = false;
+			for(int s=0; s<n_seq && batch.n_tokens < n_batch; ++s) {
+				Slot &sl = slots[s];
+				if(sl.doc < 0) continue;
+				const std::vector<llama_token> &d = docs[sl.doc];
+				int n = std::min({ share, (int)d.size() - sl.next, n_ctx_seq - sl.pos, n_batch - batch.n_tokens });
+				for(int k=0; k<n; ++k) {
+					int i = sl.next + k;
+					bool want = i+1 < (int)d.size(); // the last token predicts nothing we score
+					out_doc[batch.n_tokens] = sl.doc;
+					out_i[batch.n_tokens] = i+1;
+					common_batch_add(batch, d[i], sl.pos + k, { s }, want);
+				}
+				sl.next += n;
+				sl.pos += n;
+				if(n) added = true;
+			}
+		}
+
+		int rc = llama_decode(ctx, batch);
+		if(rc == 1) {
+			// the free cells may just be scattered between the documents still in flight
+			llama_kv_cache_defrag(ctx);
+			rc = llama_decode(ctx, batch);
+		}
+		if(rc) {
+			fprintf(stderr, "%s: decode of %d tokens failed (%d)\n", __func__, batch.n_tokens, rc);
+			seconds = (ggml_time_us() - t0) / 1e6;
+			return false;
+		}
+		n_tokens += batch.n_tokens;
+
+		for(int j=0; j<batch.n_tokens; ++j)
+			if(batch.logits[j]) on_logits(out_doc[j], out_i[j], llama_get_logits_ith(ctx, j));
+
+		for(int s=0; s<n_seq; ++s)
+			if(slots[s].doc >= 0 && slots[s].next == (int)docs[slots[s].doc].size()) finish(s);
+	}
+
+	seconds = (ggml_time_us() - t0) / 1e6;
+	return true;
+}
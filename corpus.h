@@ -0,0 +1,38 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include "common.h"
+
+/* Scores many short documents at once. A buffer decodes one sequence, so a short document leaves most
+ * of each batch empty; here every document in flight has its own sequence in one shared context, and
+ * their next tokens are packed into the same batch, each with its own positions. When a document is
+ * done, its cells are freed and the next one takes its sequence (continuous batching). */
+struct CorpusScorer {
+	int n_seq = 8; // documents in flight
+	int n_ctx_seq = 1024; // positions per document; longer ones slide along, as a buffer's window does
+	int stride = 256; // how far they slide at a time
+	int n_batch = 512; // tokens per decode; every one of them has its logits kept
+
+	/* logits that predict token i of document doc, i >= 1 */
+	std::function<void(int doc, int i, const float *logits)> on_logits = [](int, int, const float*) {};
+	std::function<void(int doc)> on_done = [](int) {}; // no more on_logits for doc after this
+
+	bool init(llama_model *model, llama_context_params params); // makes its own context, sized from the above
+	bool run(const std::vector<std::vector<llama_token>> &docs); // false if a decode failed; docs start with BOS
+	~CorpusScorer();
+
+	/* throughput of the last run */
+	int64_t n_tokens = 0;
+	int n_docs = 0;
+	double seconds = 0;
+	float tokens_per_s() { return seconds > 0 ? n_tokens / seconds : 0; }
+	float docs_per_s() { return seconds > 0 ? n_docs / seconds : 0; }
+
+	llama_context *ctx = NULL;
+	llama_batch batch;
+};
+
+#endif
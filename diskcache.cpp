@@ -0,0 +1,267 @@
+#include "diskcache.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <string.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+struct KVFileHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t n_tokens;
+	int32_t off;
+	uint64_t state_size;
+};
+
+static const char kv_magic[4] = { 'A', 'P', 'K', 'V' };
+static const uint32_t kv_version = 1;
+
+static uint64_t fnv(uint64_t h, const void *p, size_t n)
+{
+	for(size_t i=0; i<n; ++i) {
+		h ^= ((const unsigned char*)p)[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+const uint8_t *map_file(const std::string &fn, size_t &len, void *&handle)
+{
+#ifdef _WIN32
+	HANDLE f = CreateFileA(fn.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(f == INVALID_HANDLE_VALUE) return NULL;
+	LARGE_INTEGER sz;
+	GetFileSizeEx(f, &sz);
+	len = (size_t)sz.QuadPart;
+	HANDLE m = len ? CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	CloseHandle(f);
+	if(!m) return NULL;
+	const uint8_t *p = (const uint8_t*)MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+	if(!p) {
+		CloseHandle(m);
+		return NULL;
+	}
+	handle = m;
+	return p;
+#else
+	int fd = ::open(fn.c_str(), O_RDONLY);
+	if(fd < 0) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	len = st.st_size;
+	void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) return NULL;
+	handle = NULL;
+	return (const uint8_t*)p;
+#endif
+}
+
+void unmap_file(const uint8_t *p, size_t len, void *handle)
+{
+#ifdef _WIN32
+	(void)len;
+	UnmapViewOfFile(p);
+	CloseHandle((HANDLE)handle);
+#else
+	(void)handle;
+	munmap((void*)p, len);
+#endif
+}
+
+std::string DiskKVCache::model_key(const std::string &model_fn, const llama_context_params &p)
+{
+	// the file's size, date and first megabyte tell models apart well enough, without reading gigabytes.
+	// The first megabyte is mostly metadata, which a re-quantized or re-uploaded file may share; it gets
+	// a new date, so size and date go in as they do in tuning_key()
+	uint64_t h = 14695981039346656037ull;
+	std::error_code ec;
+	uint64_t size = fs::file_size(model_fn, ec);
+	long long mtime = fs::last_write_time(model_fn, ec).time_since_epoch().count();
+	h = fnv(h, &size, sizeof(size));
+	h = fnv(h, &mtime, sizeof(mtime));
+	{
+		std::ifstream f(model_fn, std::ios::binary);
+		std::vector<char> head(1<<20);
+		f.read(head.data(), head.size());
+		h = fnv(h, head.data(), f.gcount());
+	}
+	// states only restore into contexts that lay the cache out the same way
+	int layout[] = { (int)p.type_k, (int)p.type_v, (int)p.flash_attn };
+	h = fnv(h, layout, sizeof(layout));
+
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+	return buf;
+}
+
+std::string DiskKVCache::path(uint64_t prefix)
+{
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)prefix);
+	return dir + "/" + key + "-" + buf + ".kv";
+}
+
+void DiskKVCache::open(const std::string &k)
+{
+	if(writer) {
+		writer->join();
+		delete writer;
+		writer = NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(mtx);
+	key = k;
+	known.clear();
+	if(!key.size()) return;
+
+	std::error_code ec;
+	for(fs::directory_iterator i(dir, ec), end; !ec && i != end; i.increment(ec)) {
+		std::string name = i->path().filename().string();
+		if(name.size() != key.size() + 1 + 16 + 3 || name.compare(0, key.size(), key) || name.compare(name.size()-3, 3, ".kv")) continue;
+		known.insert(strtoull(name.substr(key.size()+1, 16).c_str(), NULL, 16));
+	}
+	printf("disk cache: %zu checkpoints for this model\n", known.size());
+}
+
+bool DiskKVCache::has(uint64_t prefix)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return known.count(prefix);
+}
+
+void DiskKVCache::store(uint64_t prefix, std::vector<llama_token> toks, std::vector<float> scores, std::shared_ptr<uint8_t[]> state, size_t size, int off)
+{
+	if(!key.size() || writing) return;
+	if(writer) {
+		writer->join();
+		delete writer;
+	}
+
+	writing = true;
+	std::string fn = path(prefix);
+	writer = new std::thread([this, fn, prefix, toks, scores, state, size, off]() {
+		std::error_code ec;
+		fs::create_directories(dir, ec);
+
+		// written under another name first, so a crash never leaves a torn file to be mapped later
+		std::string tmp = fn + ".tmp";
+		FILE *f = fopen(tmp.c_str(), "wb");
+		bool ok = f != NULL;
+		if(ok) {
+			KVFileHeader h;
+			memcpy(h.magic, kv_magic, 4);
+			h.version = kv_version;
+			h.n_tokens = toks.size();
+			h.off = off;
+			h.state_size = size;
+			ok = fwrite(&h, sizeof(h), 1, f) == 1
+			  && fwrite(toks.data(), sizeof(llama_token), toks.size(), f) == toks.size()
+			  && fwrite(scores.data(), sizeof(float), scores.size(), f) == scores.size()
+			  && fwrite(state.get(), 1, size, f) == size;
+			ok = !fclose(f) && ok;
+		}
+		if(ok) fs::rename(tmp, fn, ec);
+		if(!ok || ec) {
+			fprintf(stderr, "disk cache: could not write %s\n", fn.c_str());
+			fs::remove(tmp, ec);
+		} else {
+			std::lock_guard<std::mutex> lock(mtx);
+			known.insert(prefix);
+		}
+		trim();
+		writing = false;
+	});
+}
+
+std::shared_ptr<uint8_t[]> DiskKVCache::load(uint64_t prefix, const std::vector<llama_token> &toks, std::vector<float> &scores, size_t &size, int &off)
+{
+	std::string fn = path(prefix);
+	size_t len = 0;
+	void *handle = NULL;
+	const uint8_t *p = map_file(fn, len, handle);
+	if(!p) return NULL;
+
+	KVFileHeader h;
+	size_t n = toks.size();
+	size_t need = sizeof(h) + n*sizeof(llama_token) + 2*n*sizeof(float);
+	bool ok = len >= sizeof(h);
+	if(ok) {
+		memcpy(&h, p, sizeof(h));
+		ok = !memcmp(h.magic, kv_magic, 4) && h.version == kv_version && h.n_tokens == n && len == need + h.state_size
+		  && !memcmp(p + sizeof(h), toks.data(), n*sizeof(llama_token)); // the hash could collide; the tokens do not
+	}
+	if(!ok) {
+		unmap_file(p, len, handle);
+		return NULL;
+	}
+
+	scores.resize(2*n);
+	memcpy(scores.data(), p + sizeof(h) + n*sizeof(llama_token), 2*n*sizeof(float));
+	size = h.state_size;
+	off = h.off;
+
+	// recently used files are the last to be trimmed
+	std::error_code ec;
+	fs::last_write_time(fn, fs::file_time_type::clock::now(), ec);
+
+	// the state is used straight from the mapping, and unmapped along with the last snapshot sharing it
+	return std::shared_ptr<uint8_t[]>((uint8_t*)p + need, [p, len, handle](uint8_t*) { unmap_file(p, len, handle); });
+}
+
+void DiskKVCache::trim()
+{
+	struct File {
+		fs::path path;
+		fs::file_time_type mtime;
+		uintmax_t size;
+	};
+	std::vector<File> files;
+	uintmax_t total = 0;
+	std::error_code ec;
+	for(fs::directory_iterator i(dir, ec), end; !ec && i != end; i.increment(ec)) {
+		if(i->path().extension() != ".kv") continue;
+		// a file that can't be looked at is skipped, rather than ending the listing
+		std::error_code time_ec, size_ec;
+		File f = { i->path(), i->last_write_time(time_ec), i->file_size(size_ec) };
+		if(time_ec || size_ec) continue;
+		files.push_back(f);
+		total += f.size;
+	}
+	if(total <= budget) return;
+
+	std::sort(files.begin(), files.end(), [](const File &a, const File &b) { return a.mtime < b.mtime; });
+	for(auto &f : files) {
+		if(total <= budget) break;
+		// mappings of a removed file stay valid where the system allows it; on Windows the removal fails and it is tried again next time
+		if(!fs::remove(f.path, ec)) continue;
+		total -= f.size;
+
+		std::string name = f.path.filename().string();
+		if(!name.compare(0, key.size(), key) && name.size() == key.size() + 1 + 16 + 3) {
+			std::lock_guard<std::mutex> lock(mtx);
+			known.erase(strtoull(name.substr(key.size()+1, 16).c_str(), NULL, 16));
+		}
+	}
+}
+
+DiskKVCache::~DiskKVCache()
+{
+	if(writer) {
+		writer->join();
+		delete writer;
+	}
+}
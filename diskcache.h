@@ -0,0 +1,52 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include "llama.h"
+
+#define KVCACHE_DIR "autopen-kvcache"
+
+/* a read-only mapping of a whole file; the returned pointer stays valid until unmap_file */
+const uint8_t *map_file(const std::string &fn, size_t &len, void *&handle);
+void unmap_file(const uint8_t *p, size_t len, void *handle);
+
+/* Context states on disk, so a document scored in an earlier session does not have to be decoded
+ * again. A file holds the state after some token prefix, the prefix itself and the scores of its
+ * tokens; it is named after the model and context parameters and the prefix hash, and the state is
+ * mapped in rather than read. Files are written on a background thread, at most one at a time, and
+ * the least recently used go once the directory outgrows budget. */
+struct DiskKVCache {
+	std::string dir = KVCACHE_DIR;
+	size_t budget = (size_t)4<<30; // bytes
+	int stride = 256; // tokens of scoring between checkpoints written
+
+	static std::string model_key(const std::string &model_fn, const llama_context_params &p);
+	void open(const std::string &key); // use the files for this key; "" closes
+	bool has(uint64_t prefix);
+
+	/* toks are the prefix; scores hold logit and max logit for each of them (the first is unused), and
+	 * state is the context after all but the last, so decoding can pick up there. Skipped if a write is
+	 * still going on. */
+	void store(uint64_t prefix, std::vector<llama_token> toks, std::vector<float> scores, std::shared_ptr<uint8_t[]> state, size_t size, int off);
+	/* NULL if there is no file for prefix or it was made from other tokens */
+	std::shared_ptr<uint8_t[]> load(uint64_t prefix, const std::vector<llama_token> &toks, std::vector<float> &scores, size_t &size, int &off);
+
+	~DiskKVCache();
+
+	std::string key;
+	std::mutex mtx; // guards known
+	std::set<uint64_t> known; // prefixes we have files for, under key
+	std::thread *writer = NULL;
+	std::atomic<bool> writing{false};
+	std::string path(uint64_t prefix);
+	void trim();
+};
+
+#endif
@@ -6,13 +6,15 @@
 #include "imgui_internal.h"
 
 #include "editor.h"
+#include "tuning.h"
 
 #include <algorithm>
+#include <time.h>
 
-#include "imfilebrowser/imfilebrowser.h"
+#include <filesystem>
 
 namespace LLMStb {
-static bool ReplaceTail(LLMTextState* obj, int pos, const char* new_text, int new_text_len);
+static void ApplyEdit(LLMTextState* obj, int pos, int removed, int inserted);
 }
 
 void CEditor::Init()
@@ -20,10 +22,50 @@ void CEditor::Init()
 	llmst.llm.init();
 	llmst.Ctx = ImGui::GetCurrentContext();
 	llmst.llm.notify_new_predictions = [this]() { llmst.invalidate_predictions=true; };
-	llmst.llm.notify_change_tail = [this](int n, std::string u) { LLMStb::ReplaceTail(&llmst, n, u.c_str(), u.length() ); };
-	
-	buf = new char[40960];
-	buf[0]=0;
+	llmst.llm.notify_edit = [this](int pos, int removed, int inserted) { LLMStb::ApplyEdit(&llmst, pos, removed, inserted); };
+	models.notify = [this]() { llmst.llm.notify_work_done_async(); }; // wake the UI up when the scanner finds something
+	llmst.llm.notify_model_loaded = [this]() { llmst.current_tok = llmst.last_tok = NULL; llmst.invalidate_predictions = true; };
+}
+
+void CEditor::SessionWindow()
+{
+    if(!p_session) return;
+
+    ImGui::SetNextWindowSize(ImVec2(480, 0), ImGuiCond_FirstUseEver);
+    if(ImGui::Begin(session_save ? "Save buffer##sn" : "Load buffer##sn", &p_session)) {
+        ImGui::SetNextItemWidth(-FLT_MIN);
+        bool go = ImGui::InputText("##fn", session_fn, sizeof(session_fn), ImGuiInputTextFlags_EnterReturnsTrue);
+
+        if(session_save) {
+            ImGui::Checkbox("Include snapshots", &session_snapshots);
+            ImGui::SetItemTooltip("Makes the file much larger, but predictions and edits are quick right after loading it with the same model");
+        }
+
+        if(llmst.llm.session_pending.size()) {
+            ImGui::TextDisabled("Waiting for the model to finish...");
+        } else if(llmst.llm.session_error.size()) {
+            ImGui::TextColored(ImVec4(0.8f, 0.0f, 0.0f, 1.0f), "%s", llmst.llm.session_error.c_str());
+        }
+
+        ImGui::BeginDisabled(!session_fn[0] || llmst.llm.is_loading() || llmst.llm.session_pending.size());
+        go |= ImGui::Button(session_save ? "Save" : "Load");
+        ImGui::EndDisabled();
+        if(go && session_fn[0] && !llmst.llm.is_loading() && !llmst.llm.session_pending.size()) {
+            if(session_save) {
+                if(llmst.llm.save_session(session_fn, session_snapshots)) p_session = false;
+            } else {
+                llmst.llm.session_error = "";
+                llmst.llm.open_session(session_fn);
+                session_waiting = true;
+            }
+        }
+        // loads happen once the worker is idle; the window goes when one went through
+        if(session_waiting && !llmst.llm.session_pending.size()) {
+            session_waiting = false;
+            if(!llmst.llm.session_error.size()) p_session = false;
+        }
+    }
+    ImGui::End();
 }
 
 void CEditor::SettingsWindow()
@@ -41,6 +83,41 @@ void CEditor::SettingsWindow()
             ImGui::InputInt("Side prediction depth", &llmst.llm.predict_alt);
             ImGui::SetItemTooltip("How many tokens to predict for alternative branches");
 
+            if(ImGui::InputInt("Window", &llmst.llm.window)) llmst.llm.window = std::max(0, llmst.llm.window);
+            ImGui::SetItemTooltip("How many tokens of the document the model sees at once. 0 uses the model's trained context length.");
+
+            if(ImGui::InputInt("Window stride", &llmst.llm.window_stride)) llmst.llm.window_stride = std::max(1, llmst.llm.window_stride);
+            if(llmst.llm.backend) {
+                int w = llmst.llm.window_size();
+                ImGui::SetItemTooltip("How far the window moves once the document outgrows it. Every token still sees at least %d tokens before it.", w - ImClamp(llmst.llm.window_stride, 1, w-1));
+            } else {
+                ImGui::SetItemTooltip("How far the window moves once the document outgrows it");
+            }
+
+            int n_threads = llmst.llm.n_threads, n_threads_batch = llmst.llm.n_threads_batch, ui_core = llmst.llm.ui_core;
+            bool pin = llmst.llm.pin_threads, changed = false;
+            changed |= ImGui::InputInt("Threads", &n_threads);
+            ImGui::SetItemTooltip("Threads used when the model processes one token at a time (predictions, scoring as you type)");
+            ImGui::SameLine(); ImGui::TextDisabled("%.1f tok/s", llmst.llm.tps_single);
+
+            changed |= ImGui::InputInt("Batch threads", &n_threads_batch);
+            ImGui::SetItemTooltip("Threads used when the model catches up on many tokens at once");
+            ImGui::SameLine(); ImGui::TextDisabled("%.1f tok/s", llmst.llm.tps_batch);
+
+            changed |= ImGui::Checkbox("Pin threads", &pin);
+            ImGui::SetItemTooltip("Give each worker thread its own core, and keep one core free for the user interface");
+            if(pin) {
+                ImGui::SameLine();
+                changed |= ImGui::InputInt("UI core", &ui_core);
+            }
+            if(changed) {
+                llmst.llm.ui_core = ImClamp(ui_core, 0, (int)std::thread::hardware_concurrency()-1);
+                llmst.llm.set_threads(n_threads, n_threads_batch, pin);
+            }
+
+            ImGui::Text("NUMA: %s", numa_name(llmst.llm.numa));
+            ImGui::SetItemTooltip("Set with --numa disabled|distribute|isolate|numactl|mirror on the command line");
+
             ImGui::PopItemWidth();
 
             ImGui::ColorEdit3("Logit color", &c_highlight.Value.x);
@@ -48,52 +125,218 @@ void CEditor::SettingsWindow()
 
             ImGui::Separator();
 
-            static ImGui::FileBrowser fileDialog;
-
-            fileDialog.SetTitle("Select GGUF model");
-            fileDialog.SetTypeFilters({".gguf"});
-
             ImGui::Text("Loaded model: "); ImGui::SameLine();
-            if(llmst.llm.model) {
-                if(ImGui::Button(llmst.llm.model_fn.c_str())) 
-                    fileDialog.Open();
-
-                fileDialog.Display();
-            
-                if(fileDialog.HasSelected()) {
-                    llmst.llm.load_model(fileDialog.GetSelected().string().c_str());
-                    fileDialog.ClearSelected();
+            if(ImGui::Button(llmst.llm.backend ? llmst.llm.model_fn.c_str() : "None. Please select.") && !llmst.llm.is_loading()) {
+                p_models = true;
+                if(models.dir().empty()) {
+                    // start where the current model lives
+                    std::filesystem::path dir = llmst.llm.model_fn.size() ? std::filesystem::absolute(llmst.llm.model_fn).parent_path() : std::filesystem::current_path();
+                    models.scan(dir.string());
                 }
+            }
 
+            if(llmst.llm.is_loading()) {
+                ImGui::Text("%s %s...", llmst.llm.load_stage.load(), llmst.llm.load_fn.c_str());
+                ImGui::ProgressBar(llmst.llm.load_progress, ImVec2(-FLT_MIN, 0));
+            } else if(llmst.llm.load_error.size()) {
+                ImGui::TextColored(ImVec4(0.8f, 0.0f, 0.0f, 1.0f), "%s", llmst.llm.load_error.c_str());
+            }
+
+            if(llmst.llm.backend) {
                 ImGui::Text("Type: %s %s",llmst.llm.model_arch.c_str(), llmst.llm.model_size.c_str());
 
-                ImGui::Text("Params: %lld   Layers: %d   Heads: %d", llama_model_n_params(llmst.llm.model), llama_model_n_layer(llmst.llm.model), llama_model_n_head(llmst.llm.model));
+                if(llmst.llm.llama)
+                    ImGui::Text("Params: %lld   Layers: %d   Heads: %d", llama_model_n_params(llmst.llm.llama->model), llama_model_n_layer(llmst.llm.llama->model), llama_model_n_head(llmst.llm.llama->model));
 
-                bool open = ImGui::CollapsingHeader("Model metadata");
+                int n_ctx = llmst.llm.backend->n_ctx(), n_train = llmst.llm.backend->n_ctx_train();
+                ImGui::Text("Context: %d of %d trained positions (%.0f%%)", n_ctx, n_train, 100.0f * n_ctx / n_train);
+                ImGui::SetItemTooltip("The context grows as the document does, so short documents use less memory");
+                if(llmst.llm.snapshot_size)
+                    ImGui::Text("Snapshot size: %.1f MB", llmst.llm.snapshot_size / 1e6);
+                ImGui::Text("Logit memo: %zu positions, %d hits, %d misses", llmst.llm.memo.lru.size(), llmst.llm.memo.hits, llmst.llm.memo.misses);
+                ImGui::SetItemTooltip("Scores of token prefixes seen before, reused when text is retyped or an edit is undone");
+                ImGui::Text("Prefix cache: %.1f MB of its own, %d hits", llmst.llm.kv_cache->unshared_bytes() / 1e6, llmst.llm.kv_cache->hits);
+                ImGui::SetItemTooltip("Context states by token prefix, which rebuilt branches and other documents with the same beginning start from");
+
+                bool open = llmst.llm.llama && ImGui::CollapsingHeader("Model metadata");
                 if(open) {
-                    for(int i=0; i<llama_model_meta_count(llmst.llm.model); i++) {
+                    for(int i=0; i<llama_model_meta_count(llmst.llm.llama->model); i++) {
                         char k_buf[256], v_buf[256];
-                        llama_model_meta_key_by_index(llmst.llm.model, i, k_buf, 256);
-                        llama_model_meta_val_str_by_index(llmst.llm.model, i, v_buf, 256);
+                        llama_model_meta_key_by_index(llmst.llm.llama->model, i, k_buf, 256);
+                        llama_model_meta_val_str_by_index(llmst.llm.llama->model, i, v_buf, 256);
                 
                         ImGui::Text("%s = %s", k_buf, v_buf);
                     }
                 }
-            } else {
-                if(ImGui::Button("None. Please select.")) 
-                    fileDialog.Open();
+            }
+            
+        }
+        ImGui::End();
+    }
+}
 
-                fileDialog.Display();
+void CEditor::ModelsWindow()
+{
+    if(!p_models) return;
+
+    ImGui::SetNextWindowSize(ImVec2(720, 400), ImGuiCond_FirstUseEver);
+    if(ImGui::Begin("Select GGUF model##mw", &p_models)) {
+        // the listing and the headers come in from the scanner thread; we just show what is there so far
+        std::string dir = models.dir();
+        std::string go_to;
+        if(ImGui::Button("Up"))
+            go_to = std::filesystem::path(dir).parent_path().string();
+        ImGui::SameLine();
+        ImGui::TextUnformatted(dir.c_str());
+        if(models.scanning()) {
+            ImGui::SameLine();
+            ImGui::TextDisabled("(scanning...)");
+        }
 
-                if(fileDialog.HasSelected()) {
-                    llmst.llm.load_model(fileDialog.GetSelected().string().c_str());
-                    fileDialog.ClearSelected();
+        ImGuiTableFlags tflags = ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY | ImGuiTableFlags_Resizable | ImGuiTableFlags_BordersInnerV;
+        if(ImGui::BeginTable("##models", 7, tflags, ImVec2(0, -ImGui::GetFrameHeightWithSpacing()))) {
+            ImGui::TableSetupScrollFreeze(0, 1);
+            ImGui::TableSetupColumn("File", ImGuiTableColumnFlags_WidthStretch);
+            ImGui::TableSetupColumn("Arch");
+            ImGui::TableSetupColumn("Size");
+            ImGui::TableSetupColumn("Quant");
+            ImGui::TableSetupColumn("Params");
+            ImGui::TableSetupColumn("Context");
+            ImGui::TableSetupColumn("On disk");
+            ImGui::TableHeadersRow();
+
+            for(auto &e : models.entries()) {
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                if(e.is_dir) {
+                    if(ImGui::Selectable((e.name + "/").c_str(), false, ImGuiSelectableFlags_SpanAllColumns))
+                        go_to = e.path;
+                    continue;
+                }
+                if(ImGui::Selectable(e.name.c_str(), models_sel == e.path, ImGuiSelectableFlags_SpanAllColumns | ImGuiSelectableFlags_AllowDoubleClick)) {
+                    models_sel = e.path;
+                    if(ImGui::IsMouseDoubleClicked(ImGuiMouseButton_Left) && !llmst.llm.is_loading()) {
+                        llmst.llm.load_model_async(e.path.c_str());
+                        p_models = false;
+                    }
                 }
+                if(e.have_info && e.info.error.size()) {
+                    ImGui::TableNextColumn();
+                    ImGui::TextDisabled("%s", e.info.error.c_str());
+                } else if(e.have_info) {
+                    ImGui::TableNextColumn(); ImGui::TextUnformatted(e.info.arch.c_str());
+                    ImGui::TableNextColumn(); ImGui::TextUnformatted(e.info.size_label.c_str());
+                    ImGui::TableNextColumn(); ImGui::TextUnformatted(e.info.file_type.c_str());
+                    ImGui::TableNextColumn(); ImGui::Text("%.2fB", e.info.n_params * 1e-9);
+                    ImGui::TableNextColumn(); ImGui::Text("%u", e.info.n_ctx_train);
+                } else {
+                    ImGui::TableNextColumn(); ImGui::TextDisabled("...");
+                }
+                ImGui::TableSetColumnIndex(6);
+                ImGui::Text("%.2f GB", e.info.file_size / 1e9);
             }
-            
+            ImGui::EndTable();
         }
-        ImGui::End();
+
+        ImGui::BeginDisabled(models_sel.empty() || llmst.llm.is_loading());
+        if(ImGui::Button("Load")) {
+            llmst.llm.load_model_async(models_sel.c_str());
+            p_models = false;
+        }
+        ImGui::EndDisabled();
+
+        if(go_to.size()) models.scan(go_to);
+    }
+    ImGui::End();
+}
+
+/* where the time of recent decodes went, how fast the model is going, and what the tree holds on to */
+void CEditor::ProfilerWindow()
+{
+    if(!p_profiler) return;
+
+    LLMBuffer &llm = llmst.llm;
+    Profiler &prof = llm.prof;
+    int64_t now = ggml_time_us();
+
+    ImGui::SetNextWindowSize(ImVec2(460, 560), ImGuiCond_FirstUseEver);
+    if(ImGui::Begin("Profiler##pw", &p_profiler)) {
+        // a point per second over the last minute
+        std::vector<float> tps = prof.tokens_per_s_history(now, 60, 1.0f);
+        char overlay[64];
+        snprintf(overlay, sizeof(overlay), "%.1f tok/s", prof.tokens_per_s(now, 5.0f));
+        ImGui::PlotLines("##tps", tps.data(), tps.size(), 0, overlay, 0.0f, FLT_MAX, ImVec2(-FLT_MIN, 60));
+        ImGui::SetItemTooltip("Tokens decoded per second over the last minute; the number is the last five seconds");
+
+        const char *types[] = { "All", "Score", "Predict", "Branch" };
+        ImGui::SetNextItemWidth(120);
+        ImGui::Combo("Workloads", &prof_type, types, IM_ARRAYSIZE(types));
+        int type = prof_type - 1;
+
+        int n = 0, failed = 0;
+        double tokens = 0, catchup = 0;
+        for(const WorkRecord &r : prof.log) {
+            if(type >= 0 && r.type != type) continue;
+            ++n;
+            failed += r.failed;
+            tokens += r.n_tokens;
+            catchup += r.catchup;
+        }
+        ImGui::SameLine();
+        ImGui::TextDisabled("%d decodes, %.1f tokens each, %.1f of them catch-up", n, n ? tokens/n : 0.0, n ? catchup/n : 0.0);
+        if(failed) ImGui::TextColored(ImVec4(0.8f, 0.0f, 0.0f, 1.0f), "%d failed", failed);
+
+        // latency of each stage; clicking one shows its histogram below
+        struct { const char *name, *tip; float WorkRecord::*stage; } stages[] = {
+            { "Queue wait", "Queued until it was started, behind other work", &WorkRecord::wait_ms },
+            { "Prepare", "Finding a snapshot to start from and building the batch", &WorkRecord::prepare_ms },
+            { "Restore", "Loading the snapshot into the context", &WorkRecord::restore_ms },
+            { "Decode", "The model itself", &WorkRecord::decode_ms },
+            { "Pickup", "Until the editor came round to the result", &WorkRecord::pickup_ms },
+            { "Capture", "Taking a snapshot afterwards", &WorkRecord::capture_ms },
+            { "Post", "Putting the results into the token tree", &WorkRecord::post_ms },
+            { "Total", "Queued until the results were in the tree", NULL },
+        };
+        if(ImGui::BeginTable("##stages", 5, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersInnerV)) {
+            ImGui::TableSetupColumn("ms", ImGuiTableColumnFlags_WidthStretch);
+            ImGui::TableSetupColumn("p50");
+            ImGui::TableSetupColumn("p90");
+            ImGui::TableSetupColumn("p99");
+            ImGui::TableSetupColumn("max");
+            ImGui::TableHeadersRow();
+            for(int i=0; i<IM_ARRAYSIZE(stages); ++i) {
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                if(ImGui::Selectable(stages[i].name, prof_stage == i, ImGuiSelectableFlags_SpanAllColumns)) prof_stage = i;
+                ImGui::SetItemTooltip("%s", stages[i].tip);
+                for(float q : { 0.5f, 0.9f, 0.99f, 1.0f }) {
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%.2f", prof.quantile(type, stages[i].stage, q));
+                }
+            }
+            ImGui::EndTable();
+        }
+
+        std::vector<float> hist = prof.histogram(type, stages[prof_stage].stage, 40, 10000.0f);
+        snprintf(overlay, sizeof(overlay), "%s, 0.1ms to 10s", stages[prof_stage].name);
+        ImGui::PlotHistogram("##hist", hist.data(), hist.size(), 0, overlay, 0.0f, FLT_MAX, ImVec2(-FLT_MIN, 80));
+
+        ImGui::SeparatorText("Memory");
+        ImGui::Text("Tree: %d nodes", llm.n_nodes);
+        ImGui::Text("Snapshots: %d, %.1f MB", snapshot_count.load(), snapshot_bytes.load() / 1e6);
+        ImGui::SetItemTooltip("Context states in memory, for all buffers; %.1f MB each", llm.snapshot_size / 1e6);
+        if(llm.kv_cache) {
+            ImGui::Text("Prefix cache: %.1f MB of its own", llm.kv_cache->unshared_bytes() / 1e6);
+            ImGui::SetItemTooltip("States that only the prefix cache still holds on to");
+        }
+        ImGui::Text("Score memo: %zu positions, %d hits, %d misses", llm.memo.index.size(), llm.memo.hits, llm.memo.misses);
+
+        if(ImGui::Button("Clear")) prof.clear();
     }
+    ImGui::End();
+
+    // the rates roll on without input
+    wake_in = ImMin(wake_in, 0.5f);
 }
 
 void CEditor::AboutWindow()
@@ -117,15 +360,34 @@ void CEditor::AboutWindow()
 void CEditor::Render()
 {
 	llmst.llm.CheckWork();
+	wake_in = FLT_MAX;
 
-	ImGui::PushFont(font_ui);
+	ImGui::PushFont(fonts.font_ui);
 	
     if (ImGui::BeginMainMenuBar())
     {
         if (ImGui::BeginMenu("File"))
         {
-            ImGui::MenuItem("Load buffer", NULL, false, false);
-            ImGui::MenuItem("Save buffer", NULL, false, false);
+            if(ImGui::MenuItem("Load buffer...")) {
+                p_session = true;
+                session_save = false;
+            }
+            if(ImGui::MenuItem("Save buffer...")) {
+                p_session = true;
+                session_save = true;
+            }
+            // everything typed from here on goes into a trace that autopen-replay can play back
+            TraceRecorder &trace = llmst.llm.trace;
+            if(ImGui::MenuItem("Record trace", trace.active() ? trace.fn.c_str() : NULL, trace.active())) {
+                if(trace.active()) trace.stop();
+                else {
+                    char fn[64];
+                    time_t now = time(NULL);
+                    strftime(fn, sizeof(fn), "trace-%Y%m%d-%H%M%S" TRACE_EXT, localtime(&now));
+                    trace.start(fn, llmst.llm.model_fn, llmst.llm.doc.str());
+                }
+            }
+            ImGui::SetItemTooltip("Log every edit and branch navigation with its time, to measure latencies with autopen-replay");
             ImGui::Separator();
             if(ImGui::MenuItem("Settings", NULL, false, true))
                 p_settings = true;
@@ -134,6 +396,7 @@ void CEditor::Render()
         if (ImGui::BeginMenu("Windows"))
         {
             ImGui::MenuItem("Work queue", NULL, &p_wqueue);
+            ImGui::MenuItem("Profiler", NULL, &p_profiler);
             ImGui::Separator();
             if(ImGui::MenuItem("About", NULL, false, true)) {
                 ImGui::PushOverrideID(ImHashStr("A"));
@@ -155,18 +418,25 @@ void CEditor::Render()
 	bool p_open = true;
 	ImGui::Begin("Editor", &p_open, flags);
 	
-    if(llmst.llm.model) {
-	    ImGui::PushFont(font_editor);
-	    EditorWidget("##source", "", buf, 40960, ImVec2(-FLT_MIN, -20.0), ImGuiInputTextFlags_Multiline | ImGuiInputTextFlags_NoUndoRedo);
-	    ImGui::PopFont();
-	
-	    if(llmst.current_tok) {
-		    ImGui::Text("DEPTH: %3d (+%3d) -- CHILDREN: %d/%d -- LOG.L: %2.3f -- TOP: %2.3f -- TOK: %d '%s'",
-			    llmst.current_tok->depth, llmst.current_tok->base_pos, llmst.current_tok->sel, llmst.current_tok->children.size(), llmst.current_tok->logit, llmst.current_tok->max_logit, llmst.current_tok->tok, llmst.current_tok->str.c_str());
-	    }
-	
-	    ImGui::End();
-	
+    // the editor stays usable while a model loads; without one it is a plain text editor
+    ImGui::PushFont(fonts.font_editor);
+    EditorWidget("##source", "", ImVec2(-FLT_MIN, -20.0), ImGuiInputTextFlags_Multiline | ImGuiInputTextFlags_NoUndoRedo);
+    ImGui::PopFont();
+
+    if(llmst.llm.work_error.size()) {
+	    ImGui::TextColored(ImVec4(0.8f, 0.0f, 0.0f, 1.0f), "%s Some work was skipped; free up memory or lower the settings.", llmst.llm.work_error.c_str());
+    } else if(llmst.llm.backend && llmst.current_tok) {
+	    ImGui::Text("DEPTH: %3d (+%3d) -- CHILDREN: %d/%d -- LOG.L: %2.3f -- TOP: %2.3f -- TOK: %d '%s'",
+		    llmst.current_tok->depth, llmst.current_tok->base_pos, llmst.current_tok->sel, llmst.current_tok->children.size(), llmst.current_tok->logit, llmst.current_tok->max_logit, llmst.current_tok->tok, llmst.current_tok->str.c_str());
+    } else if(llmst.llm.is_loading()) {
+	    ImGui::Text("%s model... %d%%", llmst.llm.load_stage.load(), (int)(llmst.llm.load_progress*100));
+    } else if(!llmst.llm.backend) {
+	    ImGui::Text("No model loaded.");
+    }
+
+    ImGui::End();
+
+    if(llmst.llm.backend) {
 	    //ImGui::ShowDemoWindow();
 	    if(p_wqueue) {
             ImGui::SetNextWindowSize(ImVec2(300, 300), ImGuiCond_FirstUseEver);
@@ -183,25 +453,37 @@ void CEditor::Render()
 		    ImGui::End();
 	    }
     } else {
-        ImGui::End();
-
+        // keep the settings (and load progress) up until there is a model, but let it be moved out of the way of the text
         p_settings=true;
-        ImGui::SetNextWindowSize(ImVec2(300, 300), ImGuiCond_Always);
-        ImGui::SetNextWindowPos(ImVec2(30, 30), ImGuiCond_Always);
+        ImGui::SetNextWindowSize(ImVec2(300, 300), ImGuiCond_Appearing);
+        ImGui::SetNextWindowPos(ImVec2(30, 30), ImGuiCond_Appearing);
     }
 
     SettingsWindow();
+    ModelsWindow();
+    SessionWindow();
+    ProfilerWindow();
+	
+	// some other text field has focus; we do not know its blink phase, so just tick often enough to show it
+	if(ImGui::GetIO().WantTextInput && wake_in == FLT_MAX)
+		wake_in = 0.4f;
 	
 	ImGui::PopFont();
 }
 
+/* how long the main loop may sleep waiting for events before the next frame is due, in ms (-1 = indefinitely) */
+int CEditor::IdleTimeout()
+{
+	if(wake_in == FLT_MAX) return -1;
+	return (int)ImCeil(wake_in * 1000.0f) + 1;
+}
+
 /* editor widget */
 
 using namespace ImGui;
 
 static bool     InputTextFilterCharacter(ImGuiContext* ctx, unsigned int* p_char, ImGuiInputTextFlags flags, ImGuiInputTextCallback callback, void* user_data, bool input_source_is_clipboard = false);
-static int      InputTextCalcTextLenAndLineCount(const char* text_begin, const char** out_text_end);
-static ImVec2   InputTextCalcTextSize(ImGuiContext* ctx, const char* text_begin, const char* text_end, const char** remaining = NULL, ImVec2* out_offset = NULL, bool stop_on_new_line = false);
+static ImVec2   InputTextCalcTextSize(ImGuiContext* ctx, const TextStore& text, int text_begin, int text_end, int* remaining = NULL, ImVec2* out_offset = NULL, bool stop_on_new_line = false);
 
 namespace LLMStb
 {
@@ -209,28 +491,16 @@ namespace LLMStb
 #include "imstb_textedit.h"
 }
 
-// This is only used in the path where the multiline widget is inactivate.
-static int InputTextCalcTextLenAndLineCount(const char* text_begin, const char** out_text_end)
+// Decode the UTF-8 character at idx, returning its length in bytes. Past the end, behaves as if reading a zero terminator.
+static int TextCharFromStore(const TextStore& text, int idx, int text_len, unsigned int* out_char)
 {
-    int line_count = 0;
-    const char* s = text_begin;
-    while (true)
-    {
-        const char* s_eol = strchr(s, '\n');
-        line_count++;
-        if (s_eol == NULL)
-        {
-            s = s + strlen(s);
-            break;
-        }
-        s = s_eol + 1;
-    }
-    *out_text_end = s;
-    return line_count;
+    char tmp[4] = { 0 };
+    int n = ImMax(1, text.reader(idx).peek(tmp, ImMin(4, text_len - idx)));
+    return ImTextCharFromUtf8(out_char, tmp, tmp + n);
 }
 
 // FIXME: Ideally we'd share code with ImFont::CalcTextSizeA()
-static ImVec2 InputTextCalcTextSize(ImGuiContext* ctx, const char* text_begin, const char* text_end, const char** remaining, ImVec2* out_offset, bool stop_on_new_line)
+static ImVec2 InputTextCalcTextSize(ImGuiContext* ctx, const TextStore& text, int text_begin, int text_end, int* remaining, ImVec2* out_offset, bool stop_on_new_line)
 {
     ImGuiContext& g = *ctx;
     ImFont* font = g.Font;
@@ -240,14 +510,20 @@ static ImVec2 InputTextCalcTextSize(ImGuiContext* ctx, const char* text_begin, c
     ImVec2 text_size = ImVec2(0, 0);
     float line_width = 0.0f;
 
-    const char* s = text_begin;
+    int s = text_begin;
+    TextStore::Reader r = text.reader(text_begin);
     while (s < text_end)
     {
-        unsigned int c = (unsigned int)*s;
-        if (c < 0x80)
-            s += 1;
-        else
-            s += ImTextCharFromUtf8(&c, s, text_end);
+        unsigned int c = (unsigned char)r.get();
+        int n = 1;
+        if (c >= 0x80)
+        {
+            char tmp[4];
+            int avail = r.peek(tmp, ImMin(4, text_end - s));
+            n = ImTextCharFromUtf8(&c, tmp, tmp + avail);
+        }
+        s += n;
+        r.advance(n);
 
         if (c == '\n')
         {
@@ -287,20 +563,19 @@ namespace LLMStb
 #define IMSTB_TEXTEDIT_STRING             LLMTextState
 
 static int     STB_TEXTEDIT_STRINGLEN(const LLMTextState* obj)                             { return obj->TextLen; }
-static char    STB_TEXTEDIT_GETCHAR(const LLMTextState* obj, int idx)                      { IM_ASSERT(idx <= obj->TextLen); return obj->TextSrc[idx]; }
-static float   STB_TEXTEDIT_GETWIDTH(LLMTextState* obj, int line_start_idx, int char_idx)  { unsigned int c; ImTextCharFromUtf8(&c, obj->TextSrc + line_start_idx + char_idx, obj->TextSrc + obj->TextLen); if ((ImWchar)c == '\n') return IMSTB_TEXTEDIT_GETWIDTH_NEWLINE; ImGuiContext& g = *obj->Ctx; return g.Font->GetCharAdvance((ImWchar)c) * g.FontScale; }
+static char    STB_TEXTEDIT_GETCHAR(const LLMTextState* obj, int idx)                      { IM_ASSERT(idx <= obj->TextLen); return obj->Text->at(idx); }
+static float   STB_TEXTEDIT_GETWIDTH(LLMTextState* obj, int line_start_idx, int char_idx)  { unsigned int c; TextCharFromStore(*obj->Text, line_start_idx + char_idx, obj->TextLen, &c); if ((ImWchar)c == '\n') return IMSTB_TEXTEDIT_GETWIDTH_NEWLINE; ImGuiContext& g = *obj->Ctx; return g.Font->GetCharAdvance((ImWchar)c) * g.FontScale; }
 static char    STB_TEXTEDIT_NEWLINE = '\n';
 static void    STB_TEXTEDIT_LAYOUTROW(StbTexteditRow* r, LLMTextState* obj, int line_start_idx)
 {
-    const char* text = obj->TextSrc;
-    const char* text_remaining = NULL;
-    const ImVec2 size = InputTextCalcTextSize(obj->Ctx, text + line_start_idx, text + obj->TextLen, &text_remaining, NULL, true);
+    int text_remaining = line_start_idx;
+    const ImVec2 size = InputTextCalcTextSize(obj->Ctx, *obj->Text, line_start_idx, obj->TextLen, &text_remaining, NULL, true);
     r->x0 = 0.0f;
     r->x1 = size.x;
     r->baseline_y_delta = size.y;
     r->ymin = 0.0f;
     r->ymax = size.y;
-    r->num_chars = (int)(text_remaining - (text + line_start_idx));
+    r->num_chars = text_remaining - line_start_idx;
 }
 
 #define IMSTB_TEXTEDIT_GETNEXTCHARINDEX  IMSTB_TEXTEDIT_GETNEXTCHARINDEX_IMPL
@@ -311,15 +586,18 @@ static int IMSTB_TEXTEDIT_GETNEXTCHARINDEX_IMPL(LLMTextState* obj, int idx)
     if (idx >= obj->TextLen)
         return obj->TextLen + 1;
     unsigned int c;
-    return idx + ImTextCharFromUtf8(&c, obj->TextSrc + idx, obj->TextSrc + obj->TextLen);
+    return idx + TextCharFromStore(*obj->Text, idx, obj->TextLen, &c);
 }
 
 static int IMSTB_TEXTEDIT_GETPREVCHARINDEX_IMPL(LLMTextState* obj, int idx)
 {
     if (idx <= 0)
         return -1;
-    const char* p = ImTextFindPreviousUtf8Codepoint(obj->TextSrc, obj->TextSrc + idx);
-    return (int)(p - obj->TextSrc);
+    // same as ImTextFindPreviousUtf8Codepoint(): step back over continuation bytes
+    int p = idx - 1;
+    while (p > 0 && (obj->Text->at(p) & 0xC0) == 0x80)
+        p--;
+    return p;
 }
 
 static bool ImCharIsSeparatorW(unsigned int c)
@@ -342,10 +620,10 @@ static int is_word_boundary_from_right(LLMTextState* obj, int idx)
     if ((obj->Flags & ImGuiInputTextFlags_Password) || idx <= 0)
         return 0;
 
-    const char* curr_p = obj->TextSrc + idx;
-    const char* prev_p = ImTextFindPreviousUtf8Codepoint(obj->TextSrc, curr_p);
-    unsigned int curr_c; ImTextCharFromUtf8(&curr_c, curr_p, obj->TextSrc + obj->TextLen);
-    unsigned int prev_c; ImTextCharFromUtf8(&prev_c, prev_p, obj->TextSrc + obj->TextLen);
+    const int curr_p = idx;
+    const int prev_p = IMSTB_TEXTEDIT_GETPREVCHARINDEX_IMPL(obj, curr_p);
+    unsigned int curr_c; TextCharFromStore(*obj->Text, curr_p, obj->TextLen, &curr_c);
+    unsigned int prev_c; TextCharFromStore(*obj->Text, prev_p, obj->TextLen, &prev_c);
 
     bool prev_white = ImCharIsBlankW(prev_c);
     bool prev_separ = ImCharIsSeparatorW(prev_c);
@@ -358,10 +636,10 @@ static int is_word_boundary_from_left(LLMTextState* obj, int idx)
     if ((obj->Flags & ImGuiInputTextFlags_Password) || idx <= 0)
         return 0;
 
-    const char* curr_p = obj->TextSrc + idx;
-    const char* prev_p = ImTextFindPreviousUtf8Codepoint(obj->TextSrc, curr_p);
-    unsigned int prev_c; ImTextCharFromUtf8(&prev_c, curr_p, obj->TextSrc + obj->TextLen);
-    unsigned int curr_c; ImTextCharFromUtf8(&curr_c, prev_p, obj->TextSrc + obj->TextLen);
+    const int curr_p = idx;
+    const int prev_p = IMSTB_TEXTEDIT_GETPREVCHARINDEX_IMPL(obj, curr_p);
+    unsigned int prev_c; TextCharFromStore(*obj->Text, curr_p, obj->TextLen, &prev_c);
+    unsigned int curr_c; TextCharFromStore(*obj->Text, prev_p, obj->TextLen, &curr_c);
 
     bool prev_white = ImCharIsBlankW(prev_c);
     bool prev_separ = ImCharIsSeparatorW(prev_c);
@@ -398,83 +676,53 @@ static int  STB_TEXTEDIT_MOVEWORDRIGHT_IMPL(LLMTextState* obj, int idx)  { ImGui
 
 static void STB_TEXTEDIT_DELETECHARS(LLMTextState* obj, int pos, int n)
 {
-    // Offset remaining text (+ copy zero terminator)
-    IM_ASSERT(obj->TextSrc == obj->TextA.Data);
-    char* dst = obj->TextA.Data + pos;
-    char* src = obj->TextA.Data + pos + n;
-    memmove(dst, src, obj->TextLen - n - pos + 1);
+	int line = obj->Text->line_of(pos);
+	int lines_removed = obj->Text->line_of(pos + n) - line;
 	
-	// notify LLM
+	// notify LLM, which owns the text
 	obj->llm.erase(pos, pos+n);
+	obj->LayoutEdited(line, lines_removed, 0);
 	obj->llm.req_alts_at_pos(pos);
 	obj->last_tok = NULL; 
 	
     obj->Edited = true;
-    obj->TextLen -= n;
+    obj->TextLen = obj->Text->size();
 }
 
 static bool STB_TEXTEDIT_INSERTCHARS(LLMTextState* obj, int pos, const char* new_text, int new_text_len)
 {
-    const bool is_resizable = (obj->Flags & ImGuiInputTextFlags_CallbackResize) != 0;
-    const int text_len = obj->TextLen;
-    IM_ASSERT(pos <= text_len);
-
-    if (!is_resizable && (new_text_len + obj->TextLen + 1 > obj->BufCapacity))
-        return false;
-
-    // Grow internal buffer if needed
-    IM_ASSERT(obj->TextSrc == obj->TextA.Data);
-    if (new_text_len + text_len + 1 > obj->TextA.Size)
-    {
-        if (!is_resizable)
-            return false;
-        obj->TextA.resize(text_len + ImClamp(new_text_len, 32, ImMax(256, new_text_len)) + 1);
-        obj->TextSrc = obj->TextA.Data;
-    }
-
-    char* text = obj->TextA.Data;
-    if (pos != text_len)
-        memmove(text + pos + new_text_len, text + pos, (size_t)(text_len - pos));
-    memcpy(text + pos, new_text, (size_t)new_text_len);
+    IM_ASSERT(pos <= obj->TextLen);
 	
-	// notify LLM
-	obj->llm.insert(pos, new_text);
+	// notify LLM, which owns the text
+	obj->llm.insert(pos, std::string(new_text, new_text_len));
+	obj->LayoutEdited(obj->Text->line_of(pos), 0, (int)std::count(new_text, new_text + new_text_len, '\n'));
 	obj->llm.req_alts_at_pos(pos + new_text_len);
 
     obj->Edited = true;
-    obj->TextLen += new_text_len;
-    obj->TextA[obj->TextLen] = '\0';
+    obj->TextLen = obj->Text->size();
 
     return true;
 }
 
-static bool ReplaceTail(LLMTextState* obj, int pos, const char* new_text, int new_text_len)
+static void ApplyEdit(LLMTextState* obj, int pos, int removed, int inserted)
 {
-	const bool is_resizable = (obj->Flags & ImGuiInputTextFlags_CallbackResize) != 0;
-    const int text_len = obj->TextLen;
-    IM_ASSERT(pos <= text_len);
+    // the LLM has already applied the edit to the text store, we just need to catch up
+    IM_ASSERT(obj->TextLen - removed + inserted == obj->Text->size());
 
-    if (!is_resizable && (new_text_len + obj->TextLen + 1 > obj->BufCapacity))
-        return false;
+    // the edit replaced the removed lines with those now spanned by the inserted bytes
+    int line = obj->Text->line_of(pos);
+    int lines_inserted = obj->Text->line_of(pos + inserted) - line;
+    obj->LayoutEdited(line, lines_inserted + (int)obj->Layout.size() - obj->Text->line_count(), lines_inserted);
 
-    // Grow internal buffer if needed
-    IM_ASSERT(obj->TextSrc == obj->TextA.Data);
-    if (new_text_len + pos + 1 > obj->TextA.Size)
-    {
-        if (!is_resizable)
-            return false;
-        obj->TextA.resize(pos + ImMin(new_text_len, 32) + 1);
-        obj->TextSrc = obj->TextA.Data;
-    }
+    // keep positions past the edit on the same text; positions up to its start stay put
+    auto shift = [=](int& p) { if (p > pos) p = (p >= pos + removed) ? p + inserted - removed : ImMin(p, pos + inserted); };
+    shift(obj->Stb->cursor);
+    shift(obj->Stb->select_start);
+    shift(obj->Stb->select_end);
 
-    char* text = obj->TextA.Data;
-    memcpy(text + pos, new_text, (size_t)new_text_len);
-	
     obj->Edited = true;
-    obj->TextLen = pos + new_text_len;
-    obj->TextA[obj->TextLen] = '\0';
-
-    return true;
+    obj->TextLen = obj->Text->size();
+    obj->CursorClamp();
 }
 
 // We don't use an enum so we can build even with conflicting symbols (if another user of stb_textedit.h leak their STB_TEXTEDIT_K_* symbols)
@@ -525,6 +773,10 @@ LLMTextState::LLMTextState()
     //memset(this, 0, sizeof(*this));  // -- this destroys our root node, so let's not
     Stb = IM_NEW(LLMStbTexteditState);
     memset(Stb, 0, sizeof(*Stb));
+    Text = &llm.doc;
+    TextLen = 0;
+    LayoutFont = NULL;
+    LayoutFontSize = 0.0f;
 }
 
 LLMTextState::~LLMTextState()
@@ -563,28 +815,60 @@ void LLMTextState::ReloadUserBufAndSelectAll()       { WantReloadUserBuf = true;
 void LLMTextState::ReloadUserBufAndKeepSelection()   { WantReloadUserBuf = true; ReloadSelectionStart = Stb->select_start; ReloadSelectionEnd = Stb->select_end; }
 void LLMTextState::ReloadUserBufAndMoveToEnd()       { WantReloadUserBuf = true; ReloadSelectionStart = ReloadSelectionEnd = INT_MAX; }
 
-static void InputTextReconcileUndoState(LLMTextState* state, const char* old_buf, int old_length, const char* new_buf, int new_length)
+float LLMTextState::LayoutX(int line, int line_start, int pos)
 {
-    const int shorter_length = ImMin(old_length, new_length);
-    int first_diff;
-    for (first_diff = 0; first_diff < shorter_length; first_diff++)
-        if (old_buf[first_diff] != new_buf[first_diff])
-            break;
-    if (first_diff == old_length && first_diff == new_length)
-        return;
+    // start over if the font changed or the cache lost track of the text
+    ImGuiContext& g = *Ctx;
+    if ((int)Layout.size() != Text->line_count() || LayoutFont != g.Font || LayoutFontSize != g.FontSize)
+    {
+        Layout.clear();
+        Layout.resize(Text->line_count());
+        LayoutFont = g.Font;
+        LayoutFontSize = g.FontSize;
+    }
+
+    LLMLineLayout& ll = Layout[line];
+    if (!ll.Valid)
+    {
+        // same measure as InputTextCalcTextSize(), bytes inside a multi-byte character sit at its start
+        ImFont* font = g.Font;
+        const float scale = g.FontSize / font->FontSize;
+        float w = 0.0f;
+        ll.X.clear();
+        for (TextStore::Reader r = Text->reader(line_start); ; )
+        {
+            ll.X.push_back(w);
+            if (r.done() || r.get() == '\n')
+                break;
+            unsigned int c = (unsigned char)r.get();
+            int n = 1;
+            if (c >= 0x80)
+            {
+                char tmp[4];
+                int avail = r.peek(tmp, 4);
+                n = ImTextCharFromUtf8(&c, tmp, tmp + avail);
+            }
+            for (int k = 1; k < n; k++)
+                ll.X.push_back(w);
+            r.advance(n);
+            if (c != '\r')
+                w += ((int)c < font->IndexAdvanceX.Size ? font->IndexAdvanceX.Data[c] : font->FallbackAdvanceX) * scale;
+        }
+        ll.Valid = true;
+    }
+    return ll.X[ImClamp(pos - line_start, 0, (int)ll.X.size() - 1)];
+}
 
-    int old_last_diff = old_length   - 1;
-    int new_last_diff = new_length - 1;
-    for (; old_last_diff >= first_diff && new_last_diff >= first_diff; old_last_diff--, new_last_diff--)
-        if (old_buf[old_last_diff] != new_buf[new_last_diff])
-            break;
-
-    const int insert_len = new_last_diff - first_diff + 1;
-    const int delete_len = old_last_diff - first_diff + 1;
-    if (insert_len > 0 || delete_len > 0)
-        if (IMSTB_TEXTEDIT_CHARTYPE* p = LLMStb::stb_text_createundo(&state->Stb->undostate, first_diff, delete_len, insert_len))
-            for (int i = 0; i < delete_len; i++)
-                p[i] = old_buf[first_diff + i];
+void LLMTextState::LayoutEdited(int line, int lines_removed, int lines_inserted)
+{
+    if (lines_removed < 0 || line >= (int)Layout.size() || line + lines_removed >= (int)Layout.size())
+    {
+        Layout.clear(); // out of sync, will be rebuilt on next use
+        return;
+    }
+    Layout.erase(Layout.begin() + line + 1, Layout.begin() + line + 1 + lines_removed);
+    Layout.insert(Layout.begin() + line + 1, lines_inserted, LLMLineLayout());
+    Layout[line].Valid = false;
 }
 
 // Return false to discard a character.
@@ -688,7 +972,7 @@ static bool InputTextFilterCharacter(ImGuiContext* ctx, unsigned int* p_char, Im
     return true;
 }
 
-bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int buf_size, const ImVec2& size_arg, ImGuiInputTextFlags flags)
+bool CEditor::EditorWidget(const char* label, const char* hint, const ImVec2& size_arg, ImGuiInputTextFlags flags)
 {
 	ImGuiInputTextCallback callback = NULL;
 	void *callback_user_data = NULL;
@@ -697,7 +981,6 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
     if (window->SkipItems)
         return false;
 
-    IM_ASSERT(buf != NULL && buf_size >= 0);
     IM_ASSERT(!((flags & ImGuiInputTextFlags_CallbackHistory) && (flags & ImGuiInputTextFlags_Multiline)));        // Can't use both together (they both use up/down keys)
     IM_ASSERT(!((flags & ImGuiInputTextFlags_CallbackCompletion) && (flags & ImGuiInputTextFlags_AllowTabInput))); // Can't use both together (they both use tab key)
     IM_ASSERT(!((flags & ImGuiInputTextFlags_ElideLeft) && (flags & ImGuiInputTextFlags_Multiline)));               // Multiline will not work with left-trimming
@@ -807,24 +1090,10 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
 
     float scroll_y = is_multiline ? draw_window->Scroll.y : FLT_MAX;
 
-    const bool init_reload_from_user_buf = (state != NULL && state->WantReloadUserBuf);
     const bool init_changed_specs = (state != NULL && state->Stb->single_line != !is_multiline); // state != NULL means its our state.
     const bool init_make_active = (user_clicked || user_scroll_finish || input_requested_by_nav);
     const bool init_state = (init_make_active || user_scroll_active);
-    if (false && init_reload_from_user_buf)
-    {
-        int new_len = (int)strlen(buf);
-        IM_ASSERT(new_len + 1 <= buf_size && "Is your input buffer properly zero-terminated?");
-        state->WantReloadUserBuf = false;
-        InputTextReconcileUndoState(state, state->TextA.Data, state->TextLen, buf, new_len);
-        state->TextA.resize(buf_size + 1); // we use +1 to make sure that .Data is always pointing to at least an empty string.
-        state->TextLen = new_len;
-        memcpy(state->TextA.Data, buf, state->TextLen + 1);
-        state->Stb->select_start = state->ReloadSelectionStart;
-        state->Stb->cursor = state->Stb->select_end = state->ReloadSelectionEnd;
-        state->CursorClamp();
-    }
-    else if ((init_state && g.ActiveId != id) || init_changed_specs)
+    if ((init_state && g.ActiveId != id) || init_changed_specs)
     {
         // Access state even if we don't own it yet.
         state = &llmst;
@@ -833,32 +1102,18 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
         // Backup state of deactivating item so they'll have a chance to do a write to output buffer on the same frame they report IsItemDeactivatedAfterEdit (#4714)
         InputTextDeactivateHook(state->ID);
 
-        // Take a copy of the initial buffer value.
-        // From the moment we focused we are normally ignoring the content of 'buf' (unless we are in read-only mode)
-        const int buf_len = (int)strlen(buf);
-        IM_ASSERT(buf_len + 1 <= buf_size && "Is your input buffer properly zero-terminated?");
-        state->TextToRevertTo.resize(buf_len + 1);    // UTF-8. we use +1 to make sure that .Data is always pointing to at least an empty string.
-        memcpy(state->TextToRevertTo.Data, buf, buf_len + 1);
+        // Take a copy of the initial text, to revert to on Escape.
+        // The text itself lives in the LLM's text store, so there is no user buffer to pick up.
+        state->TextToRevertTo = state->Text->str();
 
         // Preserve cursor position and undo/redo stack if we come back to same widget
         // FIXME: Since we reworked this on 2022/06, may want to differentiate recycle_cursor vs recycle_undostate?
         bool recycle_state = (state->ID == id && !init_changed_specs);
-        if (recycle_state && (state->TextLen != buf_len || (state->TextA.Data == NULL || strncmp(state->TextA.Data, buf, buf_len) != 0)))
-            recycle_state = false;
 
         // Start edition
         state->ID = id;
-        state->TextLen = buf_len;
-        if (!is_readonly)
-        {
-            state->TextA.resize(buf_size + 1); // we use +1 to make sure that .Data is always pointing to at least an empty string.
-            memcpy(state->TextA.Data, buf, state->TextLen + 1);
-        }
-
-        // Find initial scroll position for right alignment
+        state->TextLen = state->Text->size();
         state->Scroll = ImVec2(0.0f, 0.0f);
-        if (flags & ImGuiInputTextFlags_ElideLeft)
-            state->Scroll.x += ImMax(0.0f, CalcTextSize(buf).x - frame_size.x + style.FramePadding.x * 2.0f);
 
         // Recycle existing cursor/selection/undo stack but clamp position
         // Note a single mouse click will override the cursor/position immediately by calling stb_textedit_click handler.
@@ -915,15 +1170,7 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
         // Expose scroll in a manner that is agnostic to us using a child window
         if (is_multiline && state != NULL)
             state->Scroll.y = draw_window->Scroll.y;
-
-        // Read-only mode always ever read from source buffer. Refresh TextLen when active.
-        if (is_readonly && state != NULL)
-            state->TextLen = (int)strlen(buf);
-        //if (is_readonly && state != NULL)
-        //    state->TextA.clear(); // Uncomment to facilitate debugging, but we otherwise prefer to keep/amortize th allocation.
     }
-    if (state != NULL)
-        state->TextSrc = is_readonly ? buf : state->TextA.Data;
 
     // We have an edge case if ActiveId was set through another widget (e.g. widget being swapped), clear id immediately (don't wait until the end of the function)
     if (g.ActiveId == id && state == NULL)
@@ -939,16 +1186,14 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
     bool value_changed = false;
     bool validated = false;
 
-    // Select the buffer to render.
-    const bool buf_display_from_state = (render_cursor || render_selection || g.ActiveId == id) && !is_readonly && state;
-    const bool is_displaying_hint = (hint != NULL && (buf_display_from_state ? state->TextA.Data : buf)[0] == 0);
+    // Show the hint instead of the text when empty.
+    const bool is_displaying_hint = (hint != NULL && hint[0] != 0 && state->TextLen == 0);
 
     // Process mouse inputs and character inputs
     if (g.ActiveId == id)
     {
         IM_ASSERT(state != NULL);
         state->Edited = false;
-        state->BufCapacity = buf_size;
         state->Flags = flags;
 
         // Although we are active we don't prevent mouse from hovering other elements unless we are interacting right now with the widget.
@@ -1087,19 +1332,20 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
         const bool is_gamepad_validate = nav_gamepad_active && (IsKeyPressed(ImGuiKey_NavGamepadActivate, false) || IsKeyPressed(ImGuiKey_NavGamepadInput, false));
         const bool is_cancel = Shortcut(ImGuiKey_Escape, f_repeat, id) || (nav_gamepad_active && Shortcut(ImGuiKey_NavGamepadCancel, f_repeat, id));
 
-		if(Shortcut(ImGuiMod_Alt | ImGuiKey_LeftArrow, f_repeat, id)) {
+		// branch navigation, only while a model is loaded (otherwise this is a plain text editor)
+		if(state->llm.backend && Shortcut(ImGuiMod_Alt | ImGuiKey_LeftArrow, f_repeat, id)) {
 			state->Stb->cursor = state->llm.alt_back(state->Stb->cursor);
 			state->CursorFollow = true;
 		} else
-		if(Shortcut(ImGuiMod_Alt | ImGuiKey_RightArrow, f_repeat, id)) {
+		if(state->llm.backend && Shortcut(ImGuiMod_Alt | ImGuiKey_RightArrow, f_repeat, id)) {
 			state->Stb->cursor = state->llm.alt_commit(state->Stb->cursor);
 			state->CursorFollow = true;
 		} else
-		if(Shortcut(ImGuiMod_Alt | ImGuiKey_UpArrow, f_repeat, id)) {
+		if(state->llm.backend && Shortcut(ImGuiMod_Alt | ImGuiKey_UpArrow, f_repeat, id)) {
 			state->llm.alt_prev(state->Stb->cursor);
 			state->invalidate_predictions = true;
 		} else
-		if(Shortcut(ImGuiMod_Alt | ImGuiKey_DownArrow, f_repeat, id)) {
+		if(state->llm.backend && Shortcut(ImGuiMod_Alt | ImGuiKey_DownArrow, f_repeat, id)) {
 			state->llm.alt_next(state->Stb->cursor);
 			state->invalidate_predictions = true;
 		} else
@@ -1157,7 +1403,7 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
         {
             if (flags & ImGuiInputTextFlags_EscapeClearsAll)
             {
-                if (buf[0] != 0)
+                if (state->TextLen != 0)
                 {
                     revert_edit = true;
                 }
@@ -1188,11 +1434,11 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
             // Cut, Copy
             if (g.PlatformIO.Platform_SetClipboardTextFn != NULL)
             {
-                // SetClipboardText() only takes null terminated strings + state->TextSrc may point to read-only user buffer, so we need to make a copy.
+                // SetClipboardText() only takes null terminated strings, and the text store is not contiguous, so we need to make a copy.
                 const int ib = state->HasSelection() ? ImMin(state->Stb->select_start, state->Stb->select_end) : 0;
                 const int ie = state->HasSelection() ? ImMax(state->Stb->select_start, state->Stb->select_end) : state->TextLen;
                 g.TempBuffer.reserve(ie - ib + 1);
-                memcpy(g.TempBuffer.Data, state->TextSrc + ib, ie - ib);
+                state->Text->copy(ib, ie - ib, g.TempBuffer.Data);
                 g.TempBuffer.Data[ie - ib] = 0;
                 SetClipboardText(g.TempBuffer.Data);
             }
@@ -1238,9 +1484,7 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
         render_selection |= state->HasSelection() && (RENDER_SELECTION_WHEN_INACTIVE || render_cursor);
     }
 
-    // Process callbacks and apply result back to user's buffer.
-    const char* apply_new_text = NULL;
-    int apply_new_text_length = 0;
+    // Handle reverting. There is no user buffer to apply the result back to, as the text store is the only copy of the text.
     if (g.ActiveId == id)
     {
         IM_ASSERT(state != NULL);
@@ -1249,166 +1493,21 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
             if (flags & ImGuiInputTextFlags_EscapeClearsAll)
             {
                 // Clear input
-                IM_ASSERT(buf[0] != 0);
-                apply_new_text = "";
-                apply_new_text_length = 0;
+                IM_ASSERT(state->TextLen != 0);
                 value_changed = true;
                 IMSTB_TEXTEDIT_CHARTYPE empty_string;
                 stb_textedit_replace(state, state->Stb, &empty_string, 0);
             }
-            else if (strcmp(buf, state->TextToRevertTo.Data) != 0)
+            else if (state->TextLen != (int)state->TextToRevertTo.size() || state->Text->str() != state->TextToRevertTo)
             {
-                apply_new_text = state->TextToRevertTo.Data;
-                apply_new_text_length = state->TextToRevertTo.Size - 1;
-
                 // Restore initial value. Only return true if restoring to the initial value changes the current buffer contents.
                 // Push records into the undo stack so we can CTRL+Z the revert operation itself
                 value_changed = true;
-                stb_textedit_replace(state, state->Stb, state->TextToRevertTo.Data, state->TextToRevertTo.Size - 1);
+                stb_textedit_replace(state, state->Stb, state->TextToRevertTo.c_str(), (int)state->TextToRevertTo.size());
             }
         }
-
-        // FIXME-OPT: We always reapply the live buffer back to the input buffer before clearing ActiveId,
-        // even though strictly speaking it wasn't modified on this frame. Should mark dirty state from the stb_textedit callbacks.
-        // If we do that, need to ensure that as special case, 'validated == true' also writes back.
-        // This also allows the user to use InputText() without maintaining any user-side storage.
-        // (please note that if you use this property along ImGuiInputTextFlags_CallbackResize you can end up with your temporary string object
-        // unnecessarily allocating once a frame, either store your string data, either if you don't then don't use ImGuiInputTextFlags_CallbackResize).
-        const bool apply_edit_back_to_user_buffer = true;// !revert_edit || (validated && (flags & ImGuiInputTextFlags_EnterReturnsTrue) != 0);
-        if (apply_edit_back_to_user_buffer)
-        {
-            // Apply current edited text immediately.
-            // Note that as soon as the input box is active, the in-widget value gets priority over any underlying modification of the input buffer
-
-            // User callback
-            if ((flags & (ImGuiInputTextFlags_CallbackCompletion | ImGuiInputTextFlags_CallbackHistory | ImGuiInputTextFlags_CallbackEdit | ImGuiInputTextFlags_CallbackAlways)) != 0)
-            {
-                IM_ASSERT(callback != NULL);
-
-                // The reason we specify the usage semantic (Completion/History) is that Completion needs to disable keyboard TABBING at the moment.
-                ImGuiInputTextFlags event_flag = 0;
-                ImGuiKey event_key = ImGuiKey_None;
-                if ((flags & ImGuiInputTextFlags_CallbackCompletion) != 0 && Shortcut(ImGuiKey_Tab, 0, id))
-                {
-                    event_flag = ImGuiInputTextFlags_CallbackCompletion;
-                    event_key = ImGuiKey_Tab;
-                }
-                else if ((flags & ImGuiInputTextFlags_CallbackHistory) != 0 && IsKeyPressed(ImGuiKey_UpArrow))
-                {
-                    event_flag = ImGuiInputTextFlags_CallbackHistory;
-                    event_key = ImGuiKey_UpArrow;
-                }
-                else if ((flags & ImGuiInputTextFlags_CallbackHistory) != 0 && IsKeyPressed(ImGuiKey_DownArrow))
-                {
-                    event_flag = ImGuiInputTextFlags_CallbackHistory;
-                    event_key = ImGuiKey_DownArrow;
-                }
-                else if ((flags & ImGuiInputTextFlags_CallbackEdit) && state->Edited)
-                {
-                    event_flag = ImGuiInputTextFlags_CallbackEdit;
-                }
-                else if (flags & ImGuiInputTextFlags_CallbackAlways)
-                {
-                    event_flag = ImGuiInputTextFlags_CallbackAlways;
-                }
-
-                if (event_flag)
-                {
-                    ImGuiInputTextCallbackData callback_data;
-                    callback_data.Ctx = &g;
-                    callback_data.EventFlag = event_flag;
-                    callback_data.Flags = flags;
-                    callback_data.UserData = callback_user_data;
-
-                    // FIXME-OPT: Undo stack reconcile needs a backup of the data until we rework API, see #7925
-                    char* callback_buf = is_readonly ? buf : state->TextA.Data;
-                    IM_ASSERT(callback_buf == state->TextSrc);
-                    state->CallbackTextBackup.resize(state->TextLen + 1);
-                    memcpy(state->CallbackTextBackup.Data, callback_buf, state->TextLen + 1);
-
-                    callback_data.EventKey = event_key;
-                    callback_data.Buf = callback_buf;
-                    callback_data.BufTextLen = state->TextLen;
-                    callback_data.BufSize = state->BufCapacity;
-                    callback_data.BufDirty = false;
-
-                    const int utf8_cursor_pos = callback_data.CursorPos = state->Stb->cursor;
-                    const int utf8_selection_start = callback_data.SelectionStart = state->Stb->select_start;
-                    const int utf8_selection_end = callback_data.SelectionEnd = state->Stb->select_end;
-
-                    // Call user code
-                    callback(&callback_data);
-
-                    // Read back what user may have modified
-                    callback_buf = is_readonly ? buf : state->TextA.Data; // Pointer may have been invalidated by a resize callback
-                    IM_ASSERT(callback_data.Buf == callback_buf);         // Invalid to modify those fields
-                    IM_ASSERT(callback_data.BufSize == state->BufCapacity);
-                    IM_ASSERT(callback_data.Flags == flags);
-                    const bool buf_dirty = callback_data.BufDirty;
-                    if (callback_data.CursorPos != utf8_cursor_pos || buf_dirty)            { state->Stb->cursor = callback_data.CursorPos; state->CursorFollow = true; }
-                    if (callback_data.SelectionStart != utf8_selection_start || buf_dirty)  { state->Stb->select_start = (callback_data.SelectionStart == callback_data.CursorPos) ? state->Stb->cursor : callback_data.SelectionStart; }
-                    if (callback_data.SelectionEnd != utf8_selection_end || buf_dirty)      { state->Stb->select_end = (callback_data.SelectionEnd == callback_data.SelectionStart) ? state->Stb->select_start : callback_data.SelectionEnd; }
-                    if (buf_dirty)
-                    {
-                        // Callback may update buffer and thus set buf_dirty even in read-only mode.
-                        IM_ASSERT(callback_data.BufTextLen == (int)strlen(callback_data.Buf)); // You need to maintain BufTextLen if you change the text!
-                        InputTextReconcileUndoState(state, state->CallbackTextBackup.Data, state->CallbackTextBackup.Size - 1, callback_data.Buf, callback_data.BufTextLen);
-                        state->TextLen = callback_data.BufTextLen;  // Assume correct length and valid UTF-8 from user, saves us an extra strlen()
-                        state->CursorAnimReset();
-                    }
-                }
-            }
-
-            // Will copy result string if modified
-            if (!is_readonly && strcmp(state->TextSrc, buf) != 0)
-            {
-                apply_new_text = state->TextSrc;
-                apply_new_text_length = state->TextLen;
-                value_changed = true;
-            }
-        }
-    }
-
-    // Handle reapplying final data on deactivation (see InputTextDeactivateHook() for details)
-    if (g.InputTextDeactivatedState.ID == id)
-    {
-        if (g.ActiveId != id && IsItemDeactivatedAfterEdit() && !is_readonly && strcmp(g.InputTextDeactivatedState.TextA.Data, buf) != 0)
-        {
-            apply_new_text = g.InputTextDeactivatedState.TextA.Data;
-            apply_new_text_length = g.InputTextDeactivatedState.TextA.Size - 1;
+        if (state->Edited)
             value_changed = true;
-            //IMGUI_DEBUG_LOG("InputText(): apply Deactivated data for 0x%08X: \"%.*s\".\n", id, apply_new_text_length, apply_new_text);
-        }
-        g.InputTextDeactivatedState.ID = 0;
-    }
-
-    // Copy result to user buffer. This can currently only happen when (g.ActiveId == id)
-    if (apply_new_text != NULL)
-    {
-        //// We cannot test for 'backup_current_text_length != apply_new_text_length' here because we have no guarantee that the size
-        //// of our owned buffer matches the size of the string object held by the user, and by design we allow InputText() to be used
-        //// without any storage on user's side.
-        IM_ASSERT(apply_new_text_length >= 0);
-        if (is_resizable)
-        {
-            ImGuiInputTextCallbackData callback_data;
-            callback_data.Ctx = &g;
-            callback_data.EventFlag = ImGuiInputTextFlags_CallbackResize;
-            callback_data.Flags = flags;
-            callback_data.Buf = buf;
-            callback_data.BufTextLen = apply_new_text_length;
-            callback_data.BufSize = ImMax(buf_size, apply_new_text_length + 1);
-            callback_data.UserData = callback_user_data;
-            callback(&callback_data);
-            buf = callback_data.Buf;
-            buf_size = callback_data.BufSize;
-            apply_new_text_length = ImMin(callback_data.BufTextLen, buf_size - 1);
-            IM_ASSERT(apply_new_text_length <= buf_size);
-        }
-        //IMGUI_DEBUG_PRINT("InputText(\"%s\"): apply_new_text length %d\n", label, apply_new_text_length);
-
-        // If the underlying buffer resize was denied or not carried to the next frame, apply_new_text_length+1 may be >= buf_size.
-        ImStrncpy(buf, apply_new_text, ImMin(apply_new_text_length + 1, buf_size));
     }
 
     // Release active ID at the end of the function (so e.g. pressing Return still does a final application of the value)
@@ -1429,66 +1528,36 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
     ImVec2 draw_pos = is_multiline ? draw_window->DC.CursorPos : frame_bb.Min + style.FramePadding;
     ImVec2 text_size(0.0f, 0.0f);
 
-    // Set upper limit of single-line InputTextEx() at 2 million characters strings. The current pathological worst case is a long line
-    // without any carriage return, which would makes ImFont::RenderText() reserve too many vertices and probably crash. Avoid it altogether.
-    // Note that we only use this limit on single-line InputText(), so a pathologically large line on a InputTextMultiline() would still crash.
-    const int buf_display_max_length = 2 * 1024 * 1024;
-    const char* buf_display = buf_display_from_state ? state->TextA.Data : buf; //-V595
-    const char* buf_display_end = NULL; // We have specialized paths below for setting the length
-    if (is_displaying_hint)
-    {
-        buf_display = hint;
-        buf_display_end = hint + strlen(hint);
-    }
+    // The text lives in the rope owned by the LLM buffer; lines are pulled out of it one at a time as they are drawn,
+    // so there is no contiguous display buffer and no pathological single-line case to guard against here.
+    IM_ASSERT(state != NULL);
+    const TextStore& text = *state->Text;
 
     // Render text. We currently only render selection when the widget is active or while scrolling.
-    // FIXME: We could remove the '&& render_cursor' to keep rendering selection when inactive.
-    if (true || render_cursor || render_selection)
     {
-        IM_ASSERT(state != NULL);
-        if (!is_displaying_hint)
-            buf_display_end = buf_display + state->TextLen;
-
         // Render text (with cursor and selection)
         // This is going to be messy. We need to:
         // - Display the text (this alone can be more easily clipped)
         // - Handle scrolling, highlight selection, display cursor (those all requires some form of 1d->2d cursor position calculation)
         // - Measure text height (for scrollbar)
-        // We are attempting to do most of that in **one main pass** to minimize the computation cost (non-negligible for large amount of text) + 2nd pass for selection rendering (we could merge them by an extra refactoring effort)
-        // FIXME: This should occur on buf_display but we'd need to maintain cursor/select_start/select_end for UTF-8.
-        const char* text_begin = buf_display;
-        const char* text_end = text_begin + state->TextLen;
+        // Line numbers and line starts come from the rope in O(log n), so none of this needs a pass over the whole text.
         ImVec2 cursor_offset, select_start_offset;
 
         {
             // Find lines numbers straddling cursor and selection min position
-            int cursor_line_no = render_cursor ? -1 : -1000;
-            int selmin_line_no = render_selection ? -1 : -1000;
-            const char* cursor_ptr = render_cursor ? text_begin + state->Stb->cursor : NULL;
-            const char* selmin_ptr = render_selection ? text_begin + ImMin(state->Stb->select_start, state->Stb->select_end) : NULL;
-
-            // Count lines and find line number for cursor and selection ends
-            int line_count = 1;
-            if (is_multiline)
-            {
-                for (const char* s = text_begin; (s = (const char*)memchr(s, '\n', (size_t)(text_end - s))) != NULL; s++)
-                {
-                    if (cursor_line_no == -1 && s >= cursor_ptr) { cursor_line_no = line_count; }
-                    if (selmin_line_no == -1 && s >= selmin_ptr) { selmin_line_no = line_count; }
-                    line_count++;
-                }
-            }
-            if (cursor_line_no == -1)
-                cursor_line_no = line_count;
-            if (selmin_line_no == -1)
-                selmin_line_no = line_count;
+            int cursor_pos = state->Stb->cursor;
+            int selmin_pos = ImMin(state->Stb->select_start, state->Stb->select_end);
+            int cursor_line_no = render_cursor ? text.line_of(cursor_pos) + 1 : -1000;
+            int selmin_line_no = render_selection ? text.line_of(selmin_pos) + 1 : -1000;
+            int line_count = is_multiline ? text.line_count() : 1;
 
             // Calculate 2d position by finding the beginning of the line and measuring distance
-            cursor_offset.x = InputTextCalcTextSize(&g, ImStrbol(cursor_ptr, text_begin), cursor_ptr).x;
+            if (render_cursor)
+                cursor_offset.x = state->LayoutX(cursor_line_no - 1, text.line_start(cursor_line_no - 1), cursor_pos);
             cursor_offset.y = cursor_line_no * line_size;
             if (selmin_line_no >= 0)
             {
-                select_start_offset.x = InputTextCalcTextSize(&g, ImStrbol(selmin_ptr, text_begin), selmin_ptr).x;
+                select_start_offset.x = state->LayoutX(selmin_line_no - 1, text.line_start(selmin_line_no - 1), selmin_pos);
                 select_start_offset.y = selmin_line_no * line_size;
             }
 
@@ -1536,25 +1605,24 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
         const ImVec2 draw_scroll = ImVec2(state->Scroll.x, 0.0f);
         if (render_selection)
         {
-            const char* text_selected_begin = text_begin + ImMin(state->Stb->select_start, state->Stb->select_end);
-            const char* text_selected_end = text_begin + ImMax(state->Stb->select_start, state->Stb->select_end);
+            int text_selected_begin = ImMin(state->Stb->select_start, state->Stb->select_end);
+            int text_selected_end = ImMax(state->Stb->select_start, state->Stb->select_end);
 
             ImU32 bg_color = GetColorU32(ImGuiCol_TextSelectedBg, render_cursor ? 1.0f : 0.6f); // FIXME: current code flow mandate that render_cursor is always true here, we are leaving the transparent one for tests.
             float bg_offy_up = is_multiline ? 0.0f : -1.0f;    // FIXME: those offsets should be part of the style? they don't play so well with multi-line selection.
             float bg_offy_dn = is_multiline ? 0.0f : 2.0f;
             ImVec2 rect_pos = draw_pos + select_start_offset - draw_scroll;
-            for (const char* p = text_selected_begin; p < text_selected_end; )
+            for (int p = text_selected_begin; p < text_selected_end; )
             {
                 if (rect_pos.y > clip_rect.w + g.FontSize)
                     break;
                 if (rect_pos.y < clip_rect.y)
                 {
-                    p = (const char*)memchr((void*)p, '\n', text_selected_end - p);
-                    p = p ? p + 1 : text_selected_end;
+                    p = ImMin(text.line_end(text.line_of(p)) + 1, text_selected_end);
                 }
                 else
                 {
-                    ImVec2 rect_size = InputTextCalcTextSize(&g, p, text_selected_end, &p, NULL, true);
+                    ImVec2 rect_size = InputTextCalcTextSize(&g, text, p, text_selected_end, &p, NULL, true);
                     if (rect_size.x <= 0.0f) rect_size.x = IM_TRUNC(g.Font->GetCharAdvance((ImWchar)' ') * 0.50f); // So we can see selected empty lines
                     ImRect rect(rect_pos + ImVec2(0.0f, bg_offy_up - g.FontSize), rect_pos + ImVec2(rect_size.x, bg_offy_dn));
                     rect.ClipWith(clip_rect);
@@ -1566,18 +1634,73 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
             }
         }
 		
-		// Mark background up with LLM tree state
+		// Mark background up with LLM tree state. Tokens are looked up through the live path index, so only the token
+		// under the cursor and those from the first visible line down are visited, however long the document is.
+		if(state->llm.backend)
 		{
-			TTE *cur = &state->llm.root;
-			int offs = 0;
-			int line_offs = 1;
-			ImVec2 pos;
-			bool cursor_found = false;
-			while(cur) {
-				pos.x = InputTextCalcTextSize(&g, ImStrbol(text_begin + offs, text_begin), text_begin + offs).x;
-                pos.y = line_offs * line_size;
+			LLMBuffer &llm = state->llm;
+			
+			// the first token at or after the cursor gets the predictions, even when scrolled out of view
+			int ci = llm.live_find(state->Stb->cursor);
+			if(ci < (int)llm.live.size()) {
+				TTE *cur = llm.live[ci];
+				int offs = llm.live_pos[ci];
+				int line = text.line_of(offs);
+				ImVec2 rect_pos = draw_pos + ImVec2(state->LayoutX(line, text.line_start(line), offs), (line + 1) * line_size) - draw_scroll;
+				TTE *parent = cur->parent; if(!parent) parent=cur;
+				
+				// maybe request new alternative predictions here
+				if(state->last_tok != parent) {
+					state->llm.req_alts_at_pos(offs);
+					state->invalidate_predictions = true;
+				}
+				state->current_tok = state->last_tok = parent;
+				
+				// render predictions
+				if(state->invalidate_predictions) {
+					if(parent->sel>0) {
+						state->above = state->llm.render(parent->children[parent->sel-1], state->llm.predict_alt,true);
+						std::replace( state->above.begin(), state->above.end(), '\n', '\\');
+					} else state->above = "";
+					if(parent->children.size()>(parent->sel)) {
+						state->selected = state->llm.render(parent->children[parent->sel], state->llm.predict_main,true);
+						std::replace( state->selected.begin(), state->selected.end(), '\n', '\\');
+					} else state->selected = "";
+					if(parent->children.size()>(parent->sel+1)) {
+						state->below = state->llm.render(parent->children[parent->sel+1], state->llm.predict_alt,true);
+						std::replace( state->below.begin(), state->below.end(), '\n', '\\');
+					} else {
+						state->below = "";
+					}
+					state->invalidate_predictions = false;
+				}
+				//int delta;
+				//state->llm.get_alts_at_pos(offs, state->above, state->selected, state->below, delta);
+				
+				ImU32 clr_pred = GetColorU32(ImGuiCol_TextDisabled);
+				fonts.Note(state->above.c_str());
+				fonts.Note(state->selected.c_str());
+				fonts.Note(state->below.c_str());
+				draw_window->DrawList->AddText(g.Font, g.FontSize, rect_pos + ImVec2(0, -2*g.FontSize), clr_pred, state->above.c_str(), NULL, 0.0f, NULL);
+				draw_window->DrawList->AddText(g.Font, g.FontSize, rect_pos + ImVec2(0, -g.FontSize), clr_pred, state->selected.c_str(), NULL, 0.0f, NULL);
+				draw_window->DrawList->AddText(g.Font, g.FontSize, rect_pos, clr_pred, state->below.c_str(), NULL, 0.0f, NULL);
+			}
+			
+			// walk the visible tokens, keeping track of the line we are on as we cross newlines
+			int first_line = ImMax(0, (int)((clip_rect.y - draw_pos.y) / line_size) - 1);
+			int last_line = ImMin(text.line_count() - 1, (int)((clip_rect.w - draw_pos.y) / line_size) + 1);
+			llm.view_from = text.line_start(first_line); // so rescoring after a model swap can start here
+			llm.view_to = text.line_end(ImMax(first_line, last_line));
+			int i = ImMax(0, llm.live_find(text.line_start(first_line)) - 1);
+			int line = (i < (int)llm.live.size()) ? text.line_of(llm.live_pos[i]) : 0;
+			int ls = text.line_start(line);
+			for(; i < (int)llm.live.size(); ++i) {
+				TTE *cur = llm.live[i];
+				int offs = llm.live_pos[i];
+				ImVec2 rect_pos = draw_pos + ImVec2(state->LayoutX(line, ls, offs), (line + 1) * line_size) - draw_scroll;
+				if (rect_pos.y > clip_rect.w + g.FontSize)
+					break;
 				
-				ImVec2 rect_pos = draw_pos + pos - draw_scroll;
 				// mark positions that have a snapshot, for debug purposes
 				if(cur->ctx_snapshot) {
 					draw_window->DrawList->AddCircleFilled(rect_pos + ImVec2(0.0, -g.FontSize), 2.5, ImColor(0.0f, 0.8f, 0.0f, 1.0f), 4);
@@ -1590,109 +1713,73 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
                         draw_window->DrawList->AddCircle(rect_pos + ImVec2(0.0, -g.FontSize), 5.0, ImColor(0.0f, 0.0f, 1.0f, 0.5f), 3);
                 }
 				
-				const char *tok_begin = text_begin + offs;
-				const char *tok_end = tok_begin + cur->str_size;
-				
-				if(!cursor_found && state->Stb->cursor <= offs) {
-					cursor_found = true;
-					TTE *parent = cur->parent; if(!parent) parent=cur;
-					
-					// maybe request new alternative predictions here
-					if(state->last_tok != parent) {
-						state->llm.req_alts_at_pos(offs);
-						state->invalidate_predictions = true;
-					}
-					state->current_tok = state->last_tok = parent;
-					
-					// render predictions
-					if(state->invalidate_predictions) {
-						if(parent->sel>0) {
-							state->above = state->llm.render(parent->children[parent->sel-1], state->llm.predict_alt,true);
-							std::replace( state->above.begin(), state->above.end(), '\n', '\\');
-						} else state->above = "";
-						if(parent->children.size()>(parent->sel)) {
-							state->selected = state->llm.render(parent->children[parent->sel], state->llm.predict_main,true);
-							std::replace( state->selected.begin(), state->selected.end(), '\n', '\\');
-						} else state->selected = "";
-						if(parent->children.size()>(parent->sel+1)) {
-							state->below = state->llm.render(parent->children[parent->sel+1], state->llm.predict_alt,true);
-							std::replace( state->below.begin(), state->below.end(), '\n', '\\');
-						} else {
-							state->below = "";
-						}
-						state->invalidate_predictions = false;
-					}
-					//int delta;
-					//state->llm.get_alts_at_pos(offs, state->above, state->selected, state->below, delta);
-					
-					ImU32 clr_pred = GetColorU32(ImGuiCol_TextDisabled);
-					draw_window->DrawList->AddText(g.Font, g.FontSize, rect_pos + ImVec2(0, -2*g.FontSize), clr_pred, state->above.c_str(), NULL, 0.0f, NULL);
-					draw_window->DrawList->AddText(g.Font, g.FontSize, rect_pos + ImVec2(0, -g.FontSize), clr_pred, state->selected.c_str(), NULL, 0.0f, NULL);
-					draw_window->DrawList->AddText(g.Font, g.FontSize, rect_pos, clr_pred, state->below.c_str(), NULL, 0.0f, NULL);
-				}
-				
 				// go no further if this token is only predicted
 				if(!cur->is_accepted) break;
 				
-				for (const char* p = tok_begin; p < tok_end; )
+				ImColor logit_c;
+				if(cur->has_logit) {
+					float logit_diff = cur->logit - cur->max_logit;
+					float logit_scaled = -((logit_diff)/1.6);
+					logit_c = c_highlight;
+                    logit_c.Value.w = 0.1f*logit_scaled;
+				} else if(cur->stale) {
+					// score from the previous model: same shading, but grey until the new one has caught up
+					float logit_scaled = -((cur->logit - cur->max_logit)/1.6);
+					logit_c = ImColor(0.5f,0.5f,0.5f,0.1f*logit_scaled);
+				} else {
+					logit_c = ImColor(0.5f,0.5f,0.5f,0.5f);
+				}
+				
+				// one rectangle for each line the token touches, measured from the cached layout
+				int tok_end = offs + cur->str_size;
+				for (int p = offs; p < tok_end; )
 				{
-					if (rect_pos.y > clip_rect.w + g.FontSize)
-						break;
-					if (rect_pos.y < clip_rect.y)
+					size_t nl = cur->str.find('\n', p - offs);
+					int seg_end = (nl != std::string::npos) ? offs + nl : tok_end;
+					if (rect_pos.y >= clip_rect.y && rect_pos.y <= clip_rect.w + g.FontSize)
 					{
-						p = (const char*)memchr((void*)p, '\n', tok_end - p);
-						p = p ? p + 1 : tok_end;
-					}
-					else
-					{
-						ImVec2 rect_size = InputTextCalcTextSize(&g, p, tok_end, &p, NULL, true);
-						if (rect_size.x <= 0.0f) rect_size.x = IM_TRUNC(g.Font->GetCharAdvance((ImWchar)' ') * 0.50f); // So we can see selected empty lines
-						ImRect rect(rect_pos + ImVec2(0.0f, 0.0f - g.FontSize), rect_pos + ImVec2(rect_size.x, 0.0f));
+						float w = state->LayoutX(line, ls, seg_end) - state->LayoutX(line, ls, p);
+						if (w <= 0.0f) w = IM_TRUNC(g.Font->GetCharAdvance((ImWchar)' ') * 0.50f); // So we can see selected empty lines
+						ImRect rect(rect_pos + ImVec2(0.0f, 0.0f - g.FontSize), rect_pos + ImVec2(w, 0.0f));
 						rect.ClipWith(clip_rect);
-						if (rect.Overlaps(clip_rect)) {
-							ImColor logit_c;
-							if(cur->has_logit) {
-								float logit_diff = cur->logit - cur->max_logit;
-								float logit_scaled = -((logit_diff)/1.6);
-								logit_c = c_highlight;
-                                logit_c.Value.w = 0.1f*logit_scaled;
-							} else {
-								logit_c = ImColor(0.5f,0.5f,0.5f,0.5f);
-							}
+						if (rect.Overlaps(clip_rect))
 							draw_window->DrawList->AddRectFilled(rect.Min, rect.Max, logit_c);
-						}
-						rect_pos.x = draw_pos.x - draw_scroll.x;
 					}
+					if (nl == std::string::npos)
+						break;
+					p = seg_end + 1;
+					++line;
+					ls = p;
+					rect_pos.x = draw_pos.x - draw_scroll.x;
 					rect_pos.y += line_size;
 				}
-				
-				// advance line count by #lines in token
-				line_offs += count(cur->str.begin(), cur->str.end(), '\n');
-				// next token
-				if(!cur->children.size()) cur=NULL;
-				else {
-					offs += cur->str_size;
-					cur=cur->children[cur->sel];
-				}
 			}
 		}
 
-        // We test for 'buf_display_max_length' as a way to avoid some pathological cases (e.g. single-line 1 MB string) which would make ImDrawList crash.
-        // FIXME-OPT: Multiline could submit a smaller amount of contents to AddText() since we already iterated through it.
-        if (is_multiline || (buf_display_end - buf_display) < buf_display_max_length)
+        // Draw the text line by line, skipping lines that are scrolled out of view.
         {
             ImU32 col = GetColorU32(is_displaying_hint ? ImGuiCol_TextDisabled : ImGuiCol_Text);
-			int offs = 0;
-			for (const char* s = buf_display, *snext; s != NULL && s < buf_display_end; s = snext)
-			{
-				snext = (const char*)memchr(s, '\n', (size_t)(text_end - s));
-				
-				draw_window->DrawList->AddText(g.Font, g.FontSize, draw_pos - draw_scroll + ImVec2(0, g.FontSize + offs * line_size), col, s, snext, 0.0f, is_multiline ? NULL : &clip_rect);
-				
-				if(snext!=NULL) snext++; // advance past \n
-				
-				++offs;
-			}
+            if (is_displaying_hint)
+            {
+                draw_window->DrawList->AddText(g.Font, g.FontSize, draw_pos - draw_scroll + ImVec2(0, g.FontSize), col, hint, NULL, 0.0f, is_multiline ? NULL : &clip_rect);
+            }
+            else
+            {
+                int first_line = 0, last_line = text.line_count() - 1;
+                if (is_multiline)
+                {
+                    first_line = ImMax(0, (int)((clip_rect.y - draw_pos.y) / line_size) - 1);
+                    last_line = ImMin(last_line, (int)((clip_rect.w - draw_pos.y) / line_size) + 1);
+                }
+                std::string line;
+                for (int l = first_line; l <= last_line; ++l)
+                {
+                    int ls = text.line_start(l);
+                    line = text.substr(ls, text.line_end(l) - ls);
+                    fonts.Note(line.data(), line.data() + line.size());
+                    draw_window->DrawList->AddText(g.Font, g.FontSize, draw_pos - draw_scroll + ImVec2(0, g.FontSize + l * line_size), col, line.data(), line.data() + line.size(), 0.0f, is_multiline ? NULL : &clip_rect);
+                }
+            }
         }
 
         // Draw blinking cursor
@@ -1705,6 +1792,13 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
             if (cursor_is_visible && cursor_screen_rect.Overlaps(clip_rect))
                 draw_window->DrawList->AddLine(cursor_screen_rect.Min, cursor_screen_rect.GetBL(), GetColorU32(ImGuiCol_Text));
 
+            // Let the main loop know when the cursor next turns on or off, so it can sleep until then
+            if (g.IO.ConfigInputTextCursorBlink)
+            {
+                float t = ImFmod(state->CursorAnim, 1.20f);
+                wake_in = ImMin(wake_in, state->CursorAnim <= 0.0f ? -state->CursorAnim : (t <= 0.80f ? 0.80f - t : 1.20f - t));
+            }
+
             // Notify OS of text input position for advanced IME (-1 x offset so that Windows IME can cover our cursor. Bit of an extra nicety.)
             if (!is_readonly)
             {
@@ -1715,38 +1809,6 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
             }
         }
     }
-    else
-    {
-        // Render text only (no selection, no cursor)
-        if (is_multiline)
-            text_size = ImVec2(inner_size.x, InputTextCalcTextLenAndLineCount(buf_display, &buf_display_end) * line_size); // We don't need width
-        else if (!is_displaying_hint && g.ActiveId == id)
-            buf_display_end = buf_display + state->TextLen;
-        else if (!is_displaying_hint)
-            buf_display_end = buf_display + strlen(buf_display);
-
-        if (is_multiline || (buf_display_end - buf_display) < buf_display_max_length)
-        {
-            // Find render position for right alignment
-            if (flags & ImGuiInputTextFlags_ElideLeft)
-                draw_pos.x = ImMin(draw_pos.x, frame_bb.Max.x - CalcTextSize(buf_display, NULL).x - style.FramePadding.x);
-
-            const ImVec2 draw_scroll = /*state ? ImVec2(state->Scroll.x, 0.0f) :*/ ImVec2(0.0f, 0.0f); // Preserve scroll when inactive?
-            ImU32 col = GetColorU32(is_displaying_hint ? ImGuiCol_TextDisabled : ImGuiCol_Text);
-            
-			int offs = 0;
-			for (const char* s = buf_display, *snext; s != NULL && s < buf_display_end; s = snext)
-			{
-				snext = (const char*)memchr(s, '\n', (size_t)(buf_display_end - s));
-				
-				draw_window->DrawList->AddText(g.Font, g.FontSize, draw_pos - draw_scroll + ImVec2(0, g.FontSize + offs * line_size), col, s, snext, 0.0f, is_multiline ? NULL : &clip_rect);
-				
-				if(snext!=NULL) snext++; // advance past \n
-				
-				++offs;
-			}
-        }
-    }
 
     if (is_password && !is_displaying_hint)
         PopFont();
@@ -1769,14 +1831,18 @@ bool CEditor::EditorWidget(const char* label, const char* hint, char* buf, int b
             g.LastItemData.StatusFlags = item_data_backup.StatusFlags;
         }
     }
-    if (state)
-        state->TextSrc = NULL;
 
     // Log as text
     if (g.LogEnabled && (!is_password || is_displaying_hint))
     {
         LogSetNextTextDecoration("{", "}");
-        LogRenderedText(&draw_pos, buf_display, buf_display_end);
+        if (is_displaying_hint)
+            LogRenderedText(&draw_pos, hint, NULL);
+        else
+        {
+            std::string log_text = text.str();
+            LogRenderedText(&draw_pos, log_text.data(), log_text.data() + log_text.size());
+        }
     }
 
     if (label_size.x > 0)
@@ -3,6 +3,8 @@
 #include "imgui.h"
 #include "imgui_internal.h"
 #include "tokentree.h"
+#include "fontatlas.h"
+#include "modelscan.h"
 
 #undef IMSTB_TEXTEDIT_STRING
 #undef IMSTB_TEXTEDIT_CHARTYPE
@@ -14,6 +16,13 @@
 namespace LLMStb { struct STB_TexteditState; }
 typedef LLMStb::STB_TexteditState LLMStbTexteditState;
 
+// Cached layout of one line: x offset of every byte from the start of the line, plus one past the end
+struct LLMLineLayout
+{
+    bool                    Valid = false;
+    std::vector<float>      X;
+};
+
 // Internal state of the currently focused/edited text input box
 // For a given item ID, access with ImGui::GetInputTextState()
 struct LLMTextState
@@ -28,12 +37,9 @@ struct LLMTextState
     LLMStbTexteditState*    Stb;                    // State for stb_textedit.h
     ImGuiInputTextFlags     Flags;                  // copy of InputText() flags. may be used to check if e.g. ImGuiInputTextFlags_Password is set.
     ImGuiID                 ID;                     // widget id owning the text state
-    int                     TextLen;                // UTF-8 length of the string in TextA (in bytes)
-    const char*             TextSrc;                // == TextA.Data unless read-only, in which case == buf passed to InputText(). Field only set and valid _inside_ the call InputText() call.
-    ImVector<char>          TextA;                  // main UTF8 buffer. TextA.Size is a buffer size! Should always be >= buf_size passed by user (and of course >= CurLenA + 1).
-    ImVector<char>          TextToRevertTo;         // value to revert to when pressing Escape = backup of end-user buffer at the time of focus (in UTF-8, unaltered)
-    ImVector<char>          CallbackTextBackup;     // temporary storage for callback to support automatic reconcile of undo-stack
-    int                     BufCapacity;            // end-user buffer capacity (include zero terminator)
+    int                     TextLen;                // UTF-8 length of the text in Text (in bytes)
+    TextStore*              Text;                   // main UTF8 text, owned by llm (which keeps it in sync with the token tree)
+    std::string             TextToRevertTo;         // value to revert to when pressing Escape = backup of the text at the time of focus (in UTF-8, unaltered)
     ImVec2                  Scroll;                 // horizontal offset (managed manually) + vertical scrolling (pulled from child window's own Scroll.y)
     float                   CursorAnim;             // timer for cursor blink, reset on every user action so the cursor reappears immediately
     bool                    CursorFollow;           // set when we want scrolling to follow the current cursor position (not always!)
@@ -42,11 +48,14 @@ struct LLMTextState
     bool                    WantReloadUserBuf;      // force a reload of user buf so it may be modified externally. may be automatic in future version.
     int                     ReloadSelectionStart;
     int                     ReloadSelectionEnd;
+    std::vector<LLMLineLayout> Layout;              // per-line glyph layout, measured on demand and invalidated by edits
+    ImFont*                 LayoutFont;             // font the layout was measured with
+    float                   LayoutFontSize;
 
     LLMTextState();
     ~LLMTextState();
-    void        ClearText()                 { TextLen = 0; TextA[0] = 0; CursorClamp(); }
-    void        ClearFreeMemory()           { TextA.clear(); TextToRevertTo.clear(); }
+    void        ClearText()                 { Text->clear(); TextLen = 0; Layout.clear(); CursorClamp(); }
+    void        ClearFreeMemory()           { TextToRevertTo.clear(); }
     void        OnKeyPressed(int key);      // Cannot be inline because we call in code in stb_textedit.h implementation
     void        OnCharPressed(unsigned int c);
 
@@ -60,6 +69,10 @@ struct LLMTextState
     int         GetSelectionEnd() const;
     void        SelectAll();
 
+    // Layout cache
+    float       LayoutX(int line, int line_start, int pos);                 // x offset of pos from the start of its line
+    void        LayoutEdited(int line, int lines_removed, int lines_inserted); // lines [line, line+lines_removed] were replaced by lines_inserted+1 new ones
+
     // Reload user buf (WIP #2890)
     // If you modify underlying user-passed const char* while active you need to call this (InputText V2 may lift this)
     //   strcpy(my_buf, "hello");
@@ -73,17 +86,32 @@ struct LLMTextState
 struct CEditor {
 	LLMTextState llmst;
 	
-	ImFont *font_editor, *font_ui;
+	LazyFontAtlas fonts;
 
     ImColor c_highlight = ImColor(1.0f, 0.0f, 0.0f, 1.0f);
 	
-	bool p_wqueue = true, p_settings = false;
+	bool p_wqueue = true, p_settings = false, p_models = false, p_session = false, p_profiler = false;
+	
+	int prof_type = 0; // workload type the profiler shows, less one; 0 is all of them
+	int prof_stage = 7; // stage whose histogram it shows; 7 is the total
+	
+	bool session_save = false; // what the session window does
+	bool session_snapshots = false;
+	bool session_waiting = false; // for a load to go through
+	char session_fn[1024] = "document" SESSION_EXT;
+	
+	ModelScanner models;
+	std::string models_sel; // path of the model selected in the models window
 	
-	char *buf;
+	float wake_in = FLT_MAX; // seconds until the next frame needs drawing even without input (e.g. cursor blink)
 	
 	void Init();
 	void Render();
     void SettingsWindow();
+    void ModelsWindow();
+    void SessionWindow();
+    void ProfilerWindow();
     void AboutWindow();
-	bool EditorWidget(const char* label, const char* hint, char* buf, int buf_size, const ImVec2& size_arg, ImGuiInputTextFlags flags);
+    int IdleTimeout();
+	bool EditorWidget(const char* label, const char* hint, const ImVec2& size_arg, ImGuiInputTextFlags flags);
 };
\ No newline at end of file
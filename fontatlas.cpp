@@ -0,0 +1,79 @@
+#include "fontatlas.h"
+#include "imgui_internal.h"
+#include <stdio.h>
+#include <string.h>
+
+void LazyFontAtlas::Init(const char *main_fn, const char *fallback_fn, float size)
+{
+	this->main_fn = main_fn;
+	this->fallback_fn = fallback_fn;
+	this->size = size;
+	main_data = ImFileLoadToMemory(main_fn, "rb", &main_size);
+	if(!main_data) printf("font atlas: cannot read %s\n", main_fn);
+	
+	// the main font's ranges never need the fallback
+	seen.assign(IM_UNICODE_CODEPOINT_MAX+1, false);
+	for(const ImWchar *r = ImGui::GetIO().Fonts->GetGlyphRangesDefault(); r[0]; r += 2)
+		for(unsigned c = r[0]; c <= r[1]; ++c) seen[c] = true;
+	
+	dirty = true;
+	Rebuild();
+}
+
+void LazyFontAtlas::Note(const char *text, const char *text_end)
+{
+	if(!text_end) text_end = text + strlen(text);
+	while(text < text_end) {
+		unsigned int c;
+		int len = ImTextCharFromUtf8(&c, text, text_end);
+		if(!len) break;
+		text += len;
+		
+		if(c <= IM_UNICODE_CODEPOINT_MAX && !seen[c]) {
+			seen[c] = true;
+			fallback.push_back((ImWchar)c);
+			dirty = true;
+		}
+	}
+}
+
+bool LazyFontAtlas::Rebuild()
+{
+	if(!dirty) return false;
+	dirty = false;
+	
+	ImFontAtlas *atlas = ImGui::GetIO().Fonts;
+	atlas->Clear();
+	
+	atlas->AddFontDefault();
+	ImFontConfig maincfg = ImFontConfig();
+	maincfg.FontDataOwnedByAtlas = false;
+	font_editor = main_data ? atlas->AddFontFromMemoryTTF(main_data, (int)main_size, size, &maincfg, atlas->GetGlyphRangesDefault()) : NULL;
+	if(fallback.size() && !fallback_data) {
+		// large, so only read once something outside the main font's ranges turns up
+		fallback_data = ImFileLoadToMemory(fallback_fn.c_str(), "rb", &fallback_size);
+		if(!fallback_data) printf("font atlas: cannot read %s\n", fallback_fn.c_str());
+	}
+	if(fallback.size() && fallback_data) {
+		ImFontGlyphRangesBuilder builder;
+		for(ImWchar c : fallback) builder.AddChar(c);
+		ranges.clear();
+		builder.BuildRanges(&ranges);
+		
+		ImFontConfig mergecfg = ImFontConfig();
+		mergecfg.MergeMode = true;
+		mergecfg.FontDataOwnedByAtlas = false;
+		atlas->AddFontFromMemoryTTF(fallback_data, (int)fallback_size, size, &mergecfg, ranges.Data);
+	}
+	font_ui = atlas->AddFontDefault();
+	atlas->Build();
+	
+	printf("font atlas: %zu fallback glyphs, %dx%d\n", fallback.size(), atlas->TexWidth, atlas->TexHeight);
+	return true;
+}
+
+LazyFontAtlas::~LazyFontAtlas()
+{
+	IM_FREE(main_data);
+	IM_FREE(fallback_data);
+}
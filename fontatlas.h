@@ -0,0 +1,33 @@
+#ifndef FONTATLAS_H
+#define FONTATLAS_H
+
+#include <string>
+#include <vector>
+#include "imgui.h"
+
+/* Font atlas that rasterises the editor's fallback font (CJK, Cyrillic, ...) only for the characters
+ * that actually get drawn. Text is passed through Note() before drawing; codepoints the atlas lacks
+ * are collected, and Rebuild() bakes a new atlas with them between frames. Startup only pays for
+ * the Latin ranges of the main fonts. */
+struct LazyFontAtlas {
+	std::string main_fn, fallback_fn;
+	float size;
+	
+	/* both font files, read once; the atlas only borrows them, so a rebuild is just rasterising */
+	void *main_data = NULL, *fallback_data = NULL;
+	size_t main_size = 0, fallback_size = 0;
+	
+	ImFont *font_editor = NULL, *font_ui = NULL;
+	
+	std::vector<bool> seen;        // by codepoint: already in the atlas, or known to be covered by the main font
+	std::vector<ImWchar> fallback; // codepoints to bake from the fallback font
+	ImVector<ImWchar> ranges;      // the same as glyph ranges, which the atlas refers to until it is rebuilt
+	bool dirty = false;            // fallback has grown since the last Rebuild()
+	
+	void Init(const char *main_fn, const char *fallback_fn, float size);
+	void Note(const char *text, const char *text_end = NULL);
+	bool Rebuild(); // only between frames; true if the atlas changed, so the renderer needs to reupload its texture
+	~LazyFontAtlas();
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "kvcache.h"
+#include <algorithm>
+
+KVPrefixCache::Node::~Node()
+{
+	for(auto &c : children) delete c.second;
+}
+
+void KVPrefixCache::put(const std::string &model, const llama_token *toks, int n, std::shared_ptr<uint8_t[]> state, size_t size, int off)
+{
+	// walk down as far as the tokens match, splitting the edge we stop in
+	Node *at = &roots[model];
+	int i = 0;
+	while(i < n) {
+		auto c = at->children.find(toks[i]);
+		if(c == at->children.end()) {
+			Node *leaf = new Node();
+			leaf->edge.assign(toks+i, toks+n);
+			leaf->parent = at;
+			leaf->len = n;
+			at->children[toks[i]] = leaf;
+			at = leaf;
+			i = n;
+			break;
+		}
+
+		Node *next = c->second;
+		int k = 0;
+		while(k < (int)next->edge.size() && i+k < n && next->edge[k] == toks[i+k]) ++k;
+		if(k < (int)next->edge.size()) {
+			Node *mid = new Node();
+			mid->edge.assign(next->edge.begin(), next->edge.begin()+k);
+			mid->parent = at;
+			mid->len = at->len + k;
+			next->edge.erase(next->edge.begin(), next->edge.begin()+k);
+			next->parent = mid;
+			mid->children[next->edge[0]] = next;
+			c->second = mid;
+			next = mid;
+		}
+		at = next;
+		i += k;
+	}
+
+	at->state = state;
+	at->size = size;
+	at->off = off;
+	at->used = ++tick;
+
+	evict(budget);
+}
+
+int KVPrefixCache::find(const std::string &model, const llama_token *toks, int n, int min_len, int max_off, std::shared_ptr<uint8_t[]> &state, int &off, size_t *size)
+{
+	auto r = roots.find(model);
+	if(r == roots.end()) return 0;
+
+	Node *at = &r->second, *best = NULL;
+	int i = 0;
+	while(i < n) {
+		auto c = at->children.find(toks[i]);
+		if(c == at->children.end()) break;
+		Node *next = c->second;
+		if(i + (int)next->edge.size() > n || !std::equal(next->edge.begin(), next->edge.end(), toks+i)) break;
+		at = next;
+		i += next->edge.size();
+		if(at->state && at->len > min_len && at->off <= max_off) best = at;
+	}
+	if(!best) return 0;
+
+	best->used = ++tick;
+	state = best->state;
+	off = best->off;
+	if(size) *size = best->size;
+	++hits;
+	return best->len;
+}
+
+size_t KVPrefixCache::unshared_bytes()
+{
+	size_t total = 0;
+	std::vector<Node*> todo;
+	for(auto &r : roots) todo.push_back(&r.second);
+	while(todo.size()) {
+		Node *n = todo.back();
+		todo.pop_back();
+		if(n->state && n->state.use_count() == 1) total += n->size;
+		for(auto &c : n->children) todo.push_back(c.second);
+	}
+	return total;
+}
+
+int KVPrefixCache::evict(size_t keep)
+{
+	// states that snapshots still share cost nothing extra, so only the others are candidates
+	std::vector<Node*> cand, todo;
+	for(auto &r : roots) todo.push_back(&r.second);
+	size_t total = 0;
+	while(todo.size()) {
+		Node *n = todo.back();
+		todo.pop_back();
+		if(n->state && n->state.use_count() == 1) {
+			cand.push_back(n);
+			total += n->size;
+		}
+		for(auto &c : n->children) todo.push_back(c.second);
+	}
+	if(total <= keep) return 0;
+
+	std::sort(cand.begin(), cand.end(), [](Node *a, Node *b) { return a->used < b->used; });
+	int dropped = 0;
+	for(Node *n : cand) {
+		if(total <= keep) break;
+		total -= n->size;
+		n->state.reset();
+		++dropped;
+		prune(n);
+	}
+	return dropped;
+}
+
+/* remove n, and its parents, for as long as they lead nowhere */
+void KVPrefixCache::prune(Node *n)
+{
+	while(n->parent && !n->state && !n->children.size()) {
+		Node *p = n->parent;
+		p->children.erase(n->edge[0]);
+		delete n;
+		n = p;
+	}
+}
+
+void KVPrefixCache::drop(const uint8_t *from, const uint8_t *to)
+{
+	std::vector<Node*> hit, todo;
+	for(auto &r : roots) todo.push_back(&r.second);
+	while(todo.size()) {
+		Node *n = todo.back();
+		todo.pop_back();
+		if(n->state && n->state.get() >= from && n->state.get() < to) hit.push_back(n);
+		for(auto &c : n->children) todo.push_back(c.second);
+	}
+	for(Node *n : hit) {
+		n->state.reset();
+		prune(n);
+	}
+}
+
+void KVPrefixCache::clear(const std::string &model)
+{
+	roots.erase(model);
+}
+
+void KVPrefixCache::clear()
+{
+	roots.clear();
+	hits = 0;
+}
+
+KVPrefixCache &kvcache_shared()
+{
+	static KVPrefixCache cache;
+	return cache;
+}
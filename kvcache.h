@@ -0,0 +1,53 @@
+#ifndef KVCACHE_H
+#define KVCACHE_H
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <string>
+#include <stdint.h>
+#include "llama.h"
+
+/* Radix tree of context states, keyed by the tokens that went into them. Snapshots belong to tree
+ * nodes, so a branch that was rebuilt, or another buffer that starts with the same text, would
+ * otherwise have to decode its prefix again. There is a tree per model, keyed by what identifies the
+ * model and its cache layout (see LLMBuffer::kv_key), so buffers on the same model share one. States
+ * are shared with the snapshots they came from; the ones only the cache still holds count against
+ * budget and are evicted least recently used first, whichever model they are for. */
+struct KVPrefixCache {
+	struct Node {
+		std::vector<llama_token> edge; // tokens from the parent to here
+		std::map<llama_token, Node*> children; // by first token of their edge
+		Node *parent = NULL;
+		int len = 0; // tokens from the root to here
+
+		std::shared_ptr<uint8_t[]> state; // context state after len tokens, if we have one
+		size_t size = 0;
+		int off = 0; // window start its positions are relative to
+		uint64_t used = 0;
+
+		~Node();
+	};
+
+	size_t budget = (size_t)1<<30; // bytes of states held by nothing but the cache
+	int hits = 0;
+
+	/* state after the n tokens in toks */
+	void put(const std::string &model, const llama_token *toks, int n, std::shared_ptr<uint8_t[]> state, size_t size, int off);
+	/* the longest cached prefix of the n tokens in toks that is longer than min_len and starts its window at
+	 * or before max_off; returns its length, or 0 if there is none */
+	int find(const std::string &model, const llama_token *toks, int n, int min_len, int max_off, std::shared_ptr<uint8_t[]> &state, int &off, size_t *size = NULL);
+	int evict(size_t keep); // drop states nobody else holds until they fit in keep bytes; returns how many
+	size_t unshared_bytes();
+	void drop(const uint8_t *from, const uint8_t *to); // states stored between from and to, such as in a mapping that is about to go
+	void clear(const std::string &model); // states are only good for the model that made them
+	void clear();
+
+	std::map<std::string, Node> roots; // by model
+	uint64_t tick = 0;
+	void prune(Node *n);
+};
+
+KVPrefixCache &kvcache_shared(); // one for the process, so buffers can share prefixes
+
+#endif
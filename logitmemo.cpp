@@ -0,0 +1,88 @@
+#include "logitmemo.h"
+#include <algorithm>
+
+uint64_t logitmemo_hash(uint64_t h, const void *p, int n)
+{
+	// FNV-1a
+	for(int i=0; i<n; ++i) {
+		h ^= ((const unsigned char*)p)[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+LogitMemo::Entry &LogitMemo::slot(uint64_t prefix, bool &fresh)
+{
+	auto i = index.find(prefix);
+	if(i != index.end()) {
+		lru.splice(lru.begin(), lru, i->second);
+		fresh = false;
+		return i->second->second;
+	}
+
+	if(lru.size() >= capacity && lru.size()) {
+		index.erase(lru.back().first);
+		lru.pop_back();
+	}
+	lru.emplace_front(prefix, Entry());
+	index[prefix] = lru.begin();
+	fresh = true;
+	return lru.front().second;
+}
+
+void LogitMemo::put(uint64_t prefix, const float *logits, int n_vocab, const std::vector<llama_token> &also)
+{
+	bool fresh;
+	Entry &e = slot(prefix, fresh);
+
+	std::vector<llama_token> best;
+	if(fresh) {
+		// the top_k in one pass, as this runs for every logit row of a catchup
+		int k = std::max(1, std::min(top_k, n_vocab));
+		for(int i=0; i<n_vocab; ++i) {
+			if((int)best.size() == k && logits[i] <= logits[best.back()]) continue;
+			if((int)best.size() == k) best.pop_back();
+			auto at = std::upper_bound(best.begin(), best.end(), logits[i], [logits](float l, llama_token b) { return l > logits[b]; });
+			best.insert(at, i);
+		}
+		e.max_logit = logits[best[0]];
+	}
+	best.insert(best.end(), also.begin(), also.end());
+
+	for(llama_token t : best) {
+		if(t < 0 || t >= n_vocab) continue;
+		auto have = std::find_if(e.logits.begin(), e.logits.end(), [t](const std::pair<llama_token,float> &l) { return l.first == t; });
+		if(have == e.logits.end()) e.logits.push_back(std::make_pair(t, logits[t]));
+	}
+}
+
+LogitMemo::Entry *LogitMemo::get(uint64_t prefix)
+{
+	auto i = index.find(prefix);
+	if(i == index.end()) return NULL;
+	lru.splice(lru.begin(), lru, i->second);
+	return &i->second->second;
+}
+
+bool LogitMemo::get(uint64_t prefix, llama_token tok, float &logit, float &max_logit)
+{
+	Entry *e = get(prefix);
+	if(e) {
+		for(auto &l : e->logits) {
+			if(l.first != tok) continue;
+			logit = l.second;
+			max_logit = e->max_logit;
+			++hits;
+			return true;
+		}
+	}
+	++misses;
+	return false;
+}
+
+void LogitMemo::clear()
+{
+	lru.clear();
+	index.clear();
+	hits = misses = 0;
+}
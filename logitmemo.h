@@ -0,0 +1,39 @@
+#ifndef LOGITMEMO_H
+#define LOGITMEMO_H
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include "llama.h"
+
+/* hash of a token prefix, extended one token (or, for foreign tokens, one piece of text) at a time */
+#define LOGITMEMO_SEED 14695981039346656037ull
+uint64_t logitmemo_hash(uint64_t h, const void *p, int n);
+
+/* Bounded memo of what the model said at each position it has seen, keyed by the hash of the token
+ * prefix before it. Deleting a word and typing it back, or undoing an edit, produces the same prefixes
+ * again; their scores come from here instead of the model. Least recently used positions are evicted. */
+struct LogitMemo {
+	struct Entry {
+		float max_logit;
+		std::vector<std::pair<llama_token,float>> logits; // the top_k best, then any other tokens scored here
+	};
+
+	size_t capacity = 1<<16; // positions
+	int top_k = 8;
+	int hits = 0, misses = 0;
+
+	/* a position's logits, of which the top_k and the tokens in also are kept */
+	void put(uint64_t prefix, const float *logits, int n_vocab, const std::vector<llama_token> &also);
+	Entry *get(uint64_t prefix); // NULL if not memoized
+	bool get(uint64_t prefix, llama_token tok, float &logit, float &max_logit);
+	void clear();
+
+	std::list<std::pair<uint64_t,Entry>> lru; // most recently used first
+	std::unordered_map<uint64_t, std::list<std::pair<uint64_t,Entry>>::iterator> index;
+	Entry &slot(uint64_t prefix, bool &fresh);
+};
+
+#endif
@@ -1,11 +1,13 @@
 #include "editor.h"
 
 #include "common.h"
+#include "tuning.h"
 
 #include "imgui.h"
 #include "imgui_impl_sdl2.h"
 #include "imgui_impl_opengl3.h"
 #include <stdio.h>
+#include <string.h>
 
 
 #ifdef _WIN32
@@ -128,7 +130,30 @@ int main (int argc, char *argv[])
     ImGui_ImplOpenGL3_Init(glsl_version);
 	
 	CEditor *e = new CEditor();
+	
+	// the NUMA strategy has to be known before the llama.cpp backend starts up
+#ifdef _WIN32
+	int argc = __argc;
+	char **argv = __argv;
+#endif
+	for(int i=1; i+1<argc; ++i)
+		if(!strcmp(argv[i], "--numa")) e->llmst.llm.numa = numa_strategy(argv[i+1]);
+	
 	e->Init();
+	
+	// the inference worker posts this event when a decode finishes (and the model loader when it makes progress),
+	// so an idle main loop wakes up to collect it
+	Uint32 work_done_event = SDL_RegisterEvents(1);
+	e->llmst.llm.notify_work_done_async = [work_done_event]() {
+		SDL_Event ev;
+		SDL_zero(ev);
+		ev.type = work_done_event;
+		SDL_PushEvent(&ev);
+	};
+	
+	// start loading the default model; until it is in, the editor works on plain text
+	e->llmst.llm.load_model_async("Qwen2.5-3B.Q4_K_M.gguf");
+	//e->llmst.llm.load_model_async("Phi-3.5-mini-instruct-Q4_K_M.gguf");
 
     // Load Fonts
     // - If no fonts are loaded, dear imgui will use the default font. You can also load multiple fonts and use ImGui::PushFont()/PopFont() to select them.
@@ -139,20 +164,12 @@ int main (int argc, char *argv[])
     // - Read 'docs/FONTS.md' for more instructions and details.
     // - Remember that in C/C++ if you want to include a backslash \ in a string literal you need to write a double backslash \\ !
     // - Our Emscripten build process allows embedding fonts to be accessible at runtime from the "fonts/" folder. See Makefile.emscripten for details.
-    io.Fonts->AddFontDefault();
     //io.Fonts->AddFontFromFileTTF("c:\\Windows\\Fonts\\segoeui.ttf", 18.0f);
     //io.Fonts->AddFontFromFileTTF("../../misc/fonts/DroidSans.ttf", 16.0f);
     //io.Fonts->AddFontFromFileTTF("../../misc/fonts/Roboto-Medium.ttf", 16.0f);
     //io.Fonts->AddFontFromFileTTF("../../misc/fonts/Cousine-Regular.ttf", 15.0f);
-	e->font_editor = io.Fonts->AddFontFromFileTTF("Charter.otf", 20.0f, nullptr, io.Fonts->GetGlyphRangesDefault());
-	ImFontConfig mergecfg = ImFontConfig();
-	mergecfg.MergeMode = true;
-	e->font_editor = io.Fonts->AddFontFromFileTTF("NotoSerifCJK-Regular.ttc", 20.0f, &mergecfg, io.Fonts->GetGlyphRangesChineseFull());
-    e->font_editor = io.Fonts->AddFontFromFileTTF("NotoSerifCJK-Regular.ttc", 20.0f, &mergecfg, io.Fonts->GetGlyphRangesJapanese());
-    e->font_editor = io.Fonts->AddFontFromFileTTF("NotoSerifCJK-Regular.ttc", 20.0f, &mergecfg, io.Fonts->GetGlyphRangesKorean());
-    e->font_editor = io.Fonts->AddFontFromFileTTF("NotoSerifCJK-Regular.ttc", 20.0f, &mergecfg, io.Fonts->GetGlyphRangesCyrillic());
-	e->font_ui = io.Fonts->AddFontDefault();
-	io.Fonts->Build();
+	// CJK and other scripts outside Charter come from Noto, but only for the characters that actually turn up
+	e->fonts.Init("Charter.otf", "NotoSerifCJK-Regular.ttc", 20.0f);
     //ImFont* font = io.Fonts->AddFontFromFileTTF("c:\\Windows\\Fonts\\ArialUni.ttf", 18.0f, nullptr, io.Fonts->GetGlyphRangesJapanese());
     //IM_ASSERT(font != nullptr);
 
@@ -166,7 +183,10 @@ int main (int argc, char *argv[])
 	
 
     // Main loop
+    // We only draw when something may have changed: on input, when the worker finishes a decode, at the next cursor
+    // blink, and for a few frames after each event so that imgui can settle hover/active state. Otherwise we sleep.
     bool done = false;
+    int idle_frames = 0;
 #ifdef __EMSCRIPTEN__
     // For an Emscripten build we are disabling file-system access, so let's not attempt to do a fopen() of the imgui.ini file.
     // You may manually call LoadIniSettingsFromMemory() to load settings from your own storage.
@@ -182,26 +202,43 @@ int main (int argc, char *argv[])
         // - When io.WantCaptureKeyboard is true, do not dispatch keyboard input data to your main application, or clear/overwrite your copy of the keyboard data.
         // Generally you may always pass all inputs to dear imgui, and hide them from your application based on those two flags.
         SDL_Event event;
-        while (SDL_PollEvent(&event))
+        bool woken = (idle_frames < 3) ? SDL_PollEvent(&event) : SDL_WaitEventTimeout(&event, e->IdleTimeout());
+        if (woken)
         {
-            ImGui_ImplSDL2_ProcessEvent(&event);
-            if (event.type == SDL_QUIT)
-                done = true;
-            if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID(window))
-                done = true;
+            idle_frames = 0;
+            do
+            {
+                ImGui_ImplSDL2_ProcessEvent(&event);
+                if (event.type == SDL_QUIT)
+                    done = true;
+                if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID(window))
+                    done = true;
+            } while (SDL_PollEvent(&event));
         }
+        else
+            ++idle_frames;
         if (SDL_GetWindowFlags(window) & SDL_WINDOW_MINIMIZED)
         {
             SDL_Delay(10);
             continue;
         }
 
+        // Bake characters that were drawn for the first time last frame into the font atlas
+        if (e->fonts.Rebuild())
+        {
+            ImGui_ImplOpenGL3_DestroyFontsTexture();
+            ImGui_ImplOpenGL3_CreateFontsTexture();
+            e->llmst.Layout.clear(); // glyph widths have changed
+        }
+
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplSDL2_NewFrame();
         ImGui::NewFrame();
 
         e->Render();
+        if (e->fonts.dirty)
+            idle_frames = 0; // draw again once the new glyphs are in
 
         // Rendering
         ImGui::Render();
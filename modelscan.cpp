@@ -0,0 +1,256 @@
+#include "modelscan.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <ctype.h>
+#include <stdlib.h>
+#include "gguf.h"
+
+namespace fs = std::filesystem;
+
+/* general.file_type, as in llama_ftype */
+static const char *ftype_name(uint32_t ft)
+{
+	static const char *names[] = {
+		"F32", "F16", "Q4_0", "Q4_1", NULL, NULL, NULL, "Q8_0", "Q5_0", "Q5_1",
+		"Q2_K", "Q3_K_S", "Q3_K_M", "Q3_K_L", "Q4_K_S", "Q4_K_M", "Q5_K_S", "Q5_K_M", "Q6_K", "IQ2_XXS",
+		"IQ2_XS", "Q2_K_S", "IQ3_XS", "IQ3_XXS", "IQ1_S", "IQ4_NL", "IQ3_S", "IQ3_M", "IQ2_S", "IQ2_M",
+		"IQ4_XS", "IQ1_M", "BF16", NULL, NULL, NULL, "TQ1_0", "TQ2_0",
+	};
+	ft &= ~1024u; // LLAMA_FTYPE_GUESSED
+	if(ft < sizeof(names)/sizeof(names[0]) && names[ft]) return names[ft];
+	return "?";
+}
+
+static uint64_t gguf_uint(gguf_context *g, const char *key)
+{
+	int64_t k = gguf_find_key(g, key);
+	if(k < 0) return 0;
+	switch(gguf_get_kv_type(g, k)) {
+	case GGUF_TYPE_UINT32: return gguf_get_val_u32(g, k);
+	case GGUF_TYPE_INT32: return std::max(0, gguf_get_val_i32(g, k));
+	case GGUF_TYPE_UINT64: return gguf_get_val_u64(g, k);
+	default: return 0;
+	}
+}
+
+static std::string gguf_str(gguf_context *g, const char *key)
+{
+	int64_t k = gguf_find_key(g, key);
+	if(k < 0 || gguf_get_kv_type(g, k) != GGUF_TYPE_STRING) return "";
+	return gguf_get_val_str(g, k);
+}
+
+bool gguf_info(const std::string &path, GGUFInfo &out)
+{
+	// no_alloc: only the key-value section and the tensor descriptions are read, not the weights
+	ggml_context *meta = NULL;
+	gguf_init_params params = { true, &meta };
+	gguf_context *g = gguf_init_from_file(path.c_str(), params);
+	if(!g) {
+		out.error = "not a readable GGUF file";
+		return false;
+	}
+
+	out.arch = gguf_str(g, "general.architecture");
+	out.name = gguf_str(g, "general.name");
+	out.size_label = gguf_str(g, "general.size_label");
+	out.file_type = (gguf_find_key(g, "general.file_type") >= 0) ? ftype_name(gguf_uint(g, "general.file_type")) : "";
+	out.n_ctx_train = gguf_uint(g, (out.arch + ".context_length").c_str());
+	out.n_params = 0;
+	for(ggml_tensor *t = ggml_get_first_tensor(meta); t; t = ggml_get_next_tensor(meta, t))
+		out.n_params += ggml_nelements(t);
+	out.error = "";
+
+	ggml_free(meta);
+	gguf_free(g);
+	return true;
+}
+
+ModelScanner::ModelScanner()
+{
+	load_cache();
+}
+
+ModelScanner::~ModelScanner()
+{
+	++generation;
+	for(auto &t : threads) {
+		t.second->join();
+		delete t.second;
+	}
+}
+
+void ModelScanner::scan(const std::string &dir)
+{
+	// the previous scan stops at the next file it would have read. It may be in the middle of a slow
+	// header read, so it is left to finish on its own and joined by a later scan once it has
+	int gen = ++generation;
+	std::vector<int> done;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		done.swap(finished);
+		cur_dir = dir;
+		cur_entries.clear();
+		busy = true;
+	}
+	for(int g : done) {
+		threads[g]->join();
+		delete threads[g];
+		threads.erase(g);
+	}
+	threads[gen] = new std::thread(&ModelScanner::run, this, dir, gen);
+}
+
+std::string ModelScanner::dir()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return cur_dir;
+}
+
+bool ModelScanner::scanning()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return busy;
+}
+
+std::vector<ModelScanner::Entry> ModelScanner::entries()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return cur_entries;
+}
+
+void ModelScanner::run(std::string dir, int gen)
+{
+	auto cancel = [&]() { return gen != generation; };
+
+	// first the listing, so the dialog has something to show while headers are read
+	std::vector<Entry> found;
+	std::error_code ec;
+	for(fs::directory_iterator i(dir, ec), end; !ec && i != end && !cancel(); i.increment(ec)) {
+		// a dangling link or unreadable file only loses its own details, not the rest of the listing
+		std::error_code dir_ec, size_ec, time_ec;
+		Entry e;
+		e.name = i->path().filename().string();
+		e.path = i->path().string();
+		e.is_dir = i->is_directory(dir_ec);
+		e.have_info = false;
+		if(!e.is_dir) {
+			std::string ext = i->path().extension().string();
+			std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return tolower(c); });
+			if(ext != ".gguf") continue;
+			uintmax_t size = i->file_size(size_ec);
+			auto mtime = i->last_write_time(time_ec);
+			e.info.file_size = size_ec ? 0 : size;
+			e.info.mtime = time_ec ? 0 : mtime.time_since_epoch().count();
+		}
+		found.push_back(e);
+	}
+	std::sort(found.begin(), found.end(), [](const Entry &a, const Entry &b) {
+		if(a.is_dir != b.is_dir) return a.is_dir;
+		return a.name < b.name;
+	});
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if(cancel()) {
+			finished.push_back(gen);
+			return;
+		}
+		cur_entries = found;
+		for(auto &e : cur_entries) {
+			auto c = cache.find(e.path);
+			if(!e.is_dir && c != cache.end() && c->second.file_size == e.info.file_size && c->second.mtime == e.info.mtime) {
+				e.info = c->second;
+				e.have_info = true;
+			}
+		}
+		found = cur_entries;
+	}
+	if(notify) notify();
+
+	// then the headers we don't know yet, one at a time
+	for(size_t i=0; i<found.size() && !cancel(); ++i) {
+		if(found[i].is_dir || found[i].have_info) continue;
+
+		GGUFInfo info = found[i].info;
+		gguf_info(found[i].path, info);
+
+		// what was read is worth keeping even if the scan has been called off meanwhile; a file that could
+		// not be read may be one still being downloaded or copied, so that is tried again next time
+		std::lock_guard<std::mutex> lock(mtx);
+		if(info.error.empty()) {
+			cache[found[i].path] = info;
+			cache_dirty = true;
+		} else if(cache.erase(found[i].path)) {
+			cache_dirty = true;
+		}
+		if(cancel()) break;
+		cur_entries[i].info = info;
+		cur_entries[i].have_info = true;
+		if(notify) notify();
+	}
+
+	// the program may never get round to it otherwise, so the headers just read are saved right away
+	save_cache();
+	std::lock_guard<std::mutex> lock(mtx);
+	finished.push_back(gen);
+	if(cancel()) return;
+	busy = false;
+	if(notify) notify();
+}
+
+/* one line per file: path, size, mtime, arch, name, size label, file type, params, context length, error; tab-separated */
+void ModelScanner::load_cache()
+{
+	std::ifstream f(MODELS_FILE);
+	std::string line;
+	while(std::getline(f, line)) {
+		std::vector<std::string> v;
+		std::istringstream l(line);
+		std::string field;
+		while(std::getline(l, field, '\t')) v.push_back(field);
+		if(v.size() < 9) continue;
+		v.resize(10);
+
+		GGUFInfo info;
+		info.file_size = strtoull(v[1].c_str(), NULL, 10);
+		info.mtime = strtoll(v[2].c_str(), NULL, 10);
+		info.arch = v[3];
+		info.name = v[4];
+		info.size_label = v[5];
+		info.file_type = v[6];
+		info.n_params = strtoull(v[7].c_str(), NULL, 10);
+		info.n_ctx_train = strtoul(v[8].c_str(), NULL, 10);
+		info.error = v[9];
+		if(!info.error.empty()) continue; // written by versions that kept these; read them again
+		cache[v[0]] = info;
+	}
+}
+
+void ModelScanner::save_cache()
+{
+	// the copy is taken under mtx, so the dialog is not held up by the disk; save_mtx keeps two scans
+	// from writing the file at once, and the later copy from being overwritten by the earlier one
+	std::lock_guard<std::mutex> save_lock(save_mtx);
+	std::map<std::string, GGUFInfo> copy;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if(!cache_dirty) return;
+		cache_dirty = false;
+		copy = cache;
+	}
+
+	auto clean = [](std::string s) {
+		std::replace(s.begin(), s.end(), '\t', ' ');
+		std::replace(s.begin(), s.end(), '\n', ' ');
+		return s;
+	};
+	std::ofstream f(MODELS_FILE, std::ios::trunc);
+	for(auto &c : copy) {
+		const GGUFInfo &i = c.second;
+		f << clean(c.first) << "\t" << i.file_size << "\t" << i.mtime << "\t" << clean(i.arch) << "\t" << clean(i.name) << "\t"
+		  << clean(i.size_label) << "\t" << clean(i.file_type) << "\t" << i.n_params << "\t" << i.n_ctx_train << "\t" << clean(i.error) << "\n";
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef MODELSCAN_H
+#define MODELSCAN_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+#define MODELS_FILE "autopen-models.txt"
+
+/* what a GGUF file says about itself in its header, read without touching the tensor data */
+struct GGUFInfo {
+	std::string arch, name, size_label, file_type;
+	uint64_t n_params = 0;
+	uint32_t n_ctx_train = 0;
+	uint64_t file_size = 0;
+	long long mtime = 0;
+	std::string error; // empty if the header was read fine
+};
+
+bool gguf_info(const std::string &path, GGUFInfo &out);
+
+/* Lists a directory on a background thread and reads the header of every .gguf in it. Headers are
+ * cached by path, size and date, in memory and in MODELS_FILE, so going back to a directory or
+ * starting the program again does not touch the files. Headers that could not be read are not
+ * cached, and are read again on the next scan. */
+struct ModelScanner {
+	struct Entry {
+		std::string name, path;
+		bool is_dir;
+		bool have_info;
+		GGUFInfo info;
+	};
+
+	std::function<void(void)> notify; // called from the scan thread whenever entries change
+
+	void scan(const std::string &dir);
+	std::string dir();
+	bool scanning();
+	std::vector<Entry> entries(); // copy of what has been found so far
+
+	ModelScanner();
+	~ModelScanner();
+	
+	std::mutex mtx; // guards everything below
+	std::string cur_dir;
+	std::vector<Entry> cur_entries;
+	bool busy = false;
+	std::map<std::string, GGUFInfo> cache;
+	bool cache_dirty = false;
+	std::vector<int> finished; // scans whose threads are done and can be joined
+
+	std::map<int, std::thread*> threads; // by generation; only touched by the thread calling scan()
+	std::atomic<int> generation{0}; // of the current scan; the others stop as soon as they notice
+	void run(std::string dir, int gen);
+	void load_cache();
+	std::mutex save_mtx; // held while MODELS_FILE is written; taken before mtx, never inside it
+	void save_cache(); // without mtx held
+};
+
+#endif
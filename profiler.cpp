@@ -0,0 +1,62 @@
+#include "profiler.h"
+#include <algorithm>
+#include <math.h>
+
+std::atomic<int64_t> snapshot_bytes{0};
+std::atomic<int> snapshot_count{0};
+
+void Profiler::add(const WorkRecord &r)
+{
+	log.push_back(r);
+	while(log.size() > capacity) log.pop_front();
+}
+
+float Profiler::tokens_per_s(int64_t now, float seconds)
+{
+	int64_t from = now - (int64_t)(seconds * 1e6f);
+	int64_t n = 0;
+	for(auto i = log.rbegin(); i != log.rend() && i->t_end >= from; ++i) n += i->n_tokens;
+	return n / seconds;
+}
+
+std::vector<float> Profiler::tokens_per_s_history(int64_t now, int n, float step)
+{
+	std::vector<float> ret(n, 0.0f);
+	int64_t step_us = (int64_t)(step * 1e6f);
+	for(auto i = log.rbegin(); i != log.rend(); ++i) {
+		int64_t k = (now - i->t_end) / step_us;
+		if(k >= n) break;
+		if(k >= 0) ret[n-1-k] += i->n_tokens / step;
+	}
+	return ret;
+}
+
+static float stage_of(const WorkRecord &r, float WorkRecord::*stage)
+{
+	return stage ? r.*stage : r.total_ms();
+}
+
+float Profiler::quantile(int type, float WorkRecord::*stage, float q)
+{
+	std::vector<float> v;
+	for(const WorkRecord &r : log)
+		if(type < 0 || r.type == type) v.push_back(stage_of(r, stage));
+	if(!v.size()) return 0.0f;
+	size_t k = std::min(v.size()-1, (size_t)(q * v.size()));
+	std::nth_element(v.begin(), v.begin()+k, v.end());
+	return v[k];
+}
+
+/* latencies span orders of magnitude, so the buckets grow geometrically */
+std::vector<float> Profiler::histogram(int type, float WorkRecord::*stage, int n_buckets, float max_ms)
+{
+	std::vector<float> ret(n_buckets, 0.0f);
+	float lo = logf(0.1f), hi = logf(max_ms);
+	for(const WorkRecord &r : log) {
+		if(type >= 0 && r.type != type) continue;
+		float ms = std::max(0.1f, stage_of(r, stage));
+		int k = (int)((logf(ms) - lo) / (hi - lo) * n_buckets);
+		ret[std::min(std::max(k, 0), n_buckets-1)] += 1.0f;
+	}
+	return ret;
+}
@@ -0,0 +1,46 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where the time of each decode the work queue ran went, from the moment its workload was queued to
+ * the moment its results were in the tree. */
+struct WorkRecord {
+	int type; // workload_type
+	int64_t t_end; // ggml_time_us() when it was done
+	int n_tokens; // in the batch
+	int catchup; // of those, how many were there only to get from a snapshot back to the target
+	bool failed;
+	float wait_ms; // in the queue, behind other work
+	float prepare_ms; // finding a state to start from and building the batch
+	float restore_ms; // loading that state into the context (and shifting it)
+	float decode_ms;
+	float pickup_ms; // until the UI thread came round to the result
+	float capture_ms; // taking a snapshot afterwards
+	float post_ms; // putting the logits into the tree, less the above
+	float total_ms() const { return wait_ms + prepare_ms + restore_ms + decode_ms + pickup_ms + capture_ms + post_ms; }
+};
+
+/* The last few thousand of them, and what can be told from them for the profiler window */
+struct Profiler {
+	std::deque<WorkRecord> log;
+	size_t capacity = 4096;
+	void add(const WorkRecord &r);
+	void clear() { log.clear(); }
+
+	float tokens_per_s(int64_t now, float seconds); // decoded over the last seconds
+	std::vector<float> tokens_per_s_history(int64_t now, int n, float step); // n values, one per step seconds, oldest first
+	/* the q-quantile of stage (one of the member pointers above, or NULL for the total) over workloads of a type, or all if type<0 */
+	float quantile(int type, float WorkRecord::*stage, float q);
+	std::vector<float> histogram(int type, float WorkRecord::*stage, int n_buckets, float max_ms); // counts of log-spaced buckets from 0.1ms to max_ms
+};
+
+/* snapshots allocated by any buffer that are still alive; those mapped from files do not count */
+extern std::atomic<int64_t> snapshot_bytes;
+extern std::atomic<int> snapshot_count;
+
+#endif
@@ -0,0 +1,314 @@
+/* autopen-replay: plays a recorded trace (see trace.h) back into an LLMBuffer and measures how long the
+ * editor would have kept its user waiting.
+ *
+ *   autopen-replay [-m model.gguf|mock] [-s speed] [--snapshot-freq n] [--predict-main n] [--predict-alt n]
+ *                  [--window n] [--mock-latency us,us] [-f tsv|jsonl] [-o out] [-v] trace
+ *
+ * The model is the one the trace was recorded with unless -m says otherwise; the settings are the
+ * buffer's defaults unless given. The document the trace starts from is scored first, then every call is
+ * made at the time it was recorded (or -s times as fast; with -s 0, each as soon as the previous one is
+ * done). For each call there are two times:
+ *
+ *   call   how long the call itself took, i.e. how long the editor's frame was held up
+ *   ready  until what it was waiting for was on screen: for inserts and erases, the score of the token
+ *          they changed; for cursor moves and alt_next/alt_prev, the next alternative and the predictions
+ *          of the selected one; alt_commit and alt_back wait for nothing
+ *
+ * Calls whose result never came, because the work for it was purged by a later edit, count as unfinished.
+ * Writes a line per kind of call with how often it was made and percentiles of both times in ms.
+ *
+ * "-m mock" plays the trace against a MockBackend, whose decodes take the --mock-latency given in us per
+ * batch and per token (20000,1000 by default). */
+
+#include "tokentree.h"
+#include "trace.h"
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define fdopen _fdopen
+#define NULL_DEVICE "NUL"
+#else
+#include <unistd.h>
+#define NULL_DEVICE "/dev/null"
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+static double since_ms(Clock::time_point t)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+}
+
+/* a call that is still waiting for its result */
+struct Pending {
+	trace_op op;
+	int pos; // of what it waits for; moved along by later edits
+	Clock::time_point t;
+	double call_ms;
+};
+
+struct OpStats {
+	std::vector<double> call_ms, ready_ms;
+	int unfinished = 0;
+};
+
+/* true once the token containing the byte before pos has its score */
+static bool scored_before(LLMBuffer &llm, int pos)
+{
+	pos = std::min(pos, (int)llm.doc.size());
+	if(pos <= 0) return true;
+	int i = llm.live_find(pos) - 1;
+	if(i <= 0 || i >= (int)llm.live.size()) return true;
+	return !llm.live[i]->is_accepted || llm.live[i]->has_logit;
+}
+
+/* true once the editor would show everything around pos: the alternative after the selected one,
+ * and the selected one predicted as deep as it goes */
+static bool alts_ready(LLMBuffer &llm, int pos)
+{
+	TTE *cur = llm.pos2ent(pos);
+	if(cur->children.size() <= cur->sel+1) return false;
+	TTE *t = cur->children[cur->sel];
+	for(int n=1; n<llm.predict_main; ++n) {
+		if(!t->children.size()) return false;
+		t = t->children[t->sel];
+	}
+	return true;
+}
+
+static double percentile(std::vector<double> &v, double q)
+{
+	if(!v.size()) return 0;
+	return v[std::min(v.size()-1, (size_t)(q * v.size()))];
+}
+
+static void put_stats(FILE *out, bool json, const char *op, OpStats &s)
+{
+	std::sort(s.call_ms.begin(), s.call_ms.end());
+	std::sort(s.ready_ms.begin(), s.ready_ms.end());
+	auto &c = s.call_ms, &r = s.ready_ms;
+	if(json) {
+		fprintf(out, "{\"op\":\"%s\",\"n\":%zu,\"unfinished\":%d,"
+			"\"call_p50\":%.3f,\"call_p90\":%.3f,\"call_p99\":%.3f,\"call_max\":%.3f,"
+			"\"ready_p50\":%.3f,\"ready_p90\":%.3f,\"ready_p99\":%.3f,\"ready_max\":%.3f}\n",
+			op, c.size(), s.unfinished,
+			percentile(c, 0.5), percentile(c, 0.9), percentile(c, 0.99), c.size() ? c.back() : 0,
+			percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99), r.size() ? r.back() : 0);
+	} else {
+		fprintf(out, "%s\t%zu\t%d\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\n",
+			op, c.size(), s.unfinished,
+			percentile(c, 0.5), percentile(c, 0.9), percentile(c, 0.99), c.size() ? c.back() : 0,
+			percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99), r.size() ? r.back() : 0);
+	}
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: autopen-replay [-m model.gguf|mock] [-s speed] [--snapshot-freq n] [--predict-main n] [--predict-alt n]\n"
+	                "                      [--window n] [--mock-latency us,us] [-f tsv|jsonl] [-o out] [-v] trace\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::string model_fn, format = "tsv", out_fn, trace_fn;
+	double speed = 1.0;
+	int snapshot_freq = -1, predict_main = -1, predict_alt = -1, window = -1;
+	int64_t mock_us_decode = 20000, mock_us_token = 1000;
+	bool verbose = false;
+	for(int i=1; i<argc; ++i) {
+		std::string a = argv[i];
+		bool has_val = i+1 < argc;
+		if((a == "-m" || a == "--model") && has_val) model_fn = argv[++i];
+		else if((a == "-s" || a == "--speed") && has_val) speed = std::max(0.0, atof(argv[++i]));
+		else if(a == "--snapshot-freq" && has_val) snapshot_freq = std::max(1, atoi(argv[++i]));
+		else if(a == "--predict-main" && has_val) predict_main = std::max(1, atoi(argv[++i]));
+		else if(a == "--predict-alt" && has_val) predict_alt = std::max(1, atoi(argv[++i]));
+		else if(a == "--window" && has_val) window = std::max(0, atoi(argv[++i]));
+		else if(a == "--mock-latency" && has_val) {
+			long long d = 0, t = 0;
+			sscanf(argv[++i], "%lld,%lld", &d, &t);
+			mock_us_decode = d;
+			mock_us_token = t;
+		}
+		else if((a == "-f" || a == "--format") && has_val) format = argv[++i];
+		else if((a == "-o" || a == "--output") && has_val) out_fn = argv[++i];
+		else if(a == "-v" || a == "--verbose") verbose = true;
+		else if(a == "-h" || a == "--help") { usage(); return 0; }
+		else if(a.size() > 1 && a[0] == '-') { usage(); return 1; }
+		else trace_fn = a;
+	}
+	if(trace_fn.empty() || (format != "tsv" && format != "jsonl")) {
+		usage();
+		return 1;
+	}
+
+	std::string recorded_model, doc, error;
+	std::vector<TraceEvent> events;
+	if(!read_trace(trace_fn, recorded_model, doc, events, error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	if(model_fn.empty()) model_fn = recorded_model;
+	if(model_fn.empty()) {
+		fprintf(stderr, "%s does not say which model it was recorded with; pass -m\n", trace_fn.c_str());
+		return 1;
+	}
+
+	// the buffer reports on what it is doing on stdout, so the results get their own stream
+	FILE *out = out_fn.size() ? fopen(out_fn.c_str(), "wb") : fdopen(dup(fileno(stdout)), "wb");
+	if(!out) {
+		fprintf(stderr, "cannot open %s\n", out_fn.size() ? out_fn.c_str() : "stdout");
+		return 1;
+	}
+	if(verbose) dup2(fileno(stderr), fileno(stdout));
+	else if(!freopen(NULL_DEVICE, "w", stdout)) return 1;
+
+	LLMBuffer llm;
+	llm.init();
+	if(!verbose) llama_log_set([](ggml_log_level, const char *, void *) {}, NULL);
+	if(snapshot_freq > 0) llm.snapshot_freq = snapshot_freq;
+	if(predict_main > 0) llm.predict_main = predict_main;
+	if(predict_alt > 0) llm.predict_alt = predict_alt;
+	if(window >= 0) llm.window = window;
+
+	// the worker and the loader wake us up like they would wake up the editor's main loop
+	std::mutex m;
+	std::condition_variable cv;
+	bool woken = false;
+	llm.notify_work_done_async = [&]() {
+		{
+			std::lock_guard<std::mutex> l(m);
+			woken = true;
+		}
+		cv.notify_one();
+	};
+	// waits for the worker, or until the given time if there is one, and lets the buffer catch up
+	auto pump = [&](const Clock::time_point *until) {
+		bool w;
+		{
+			std::unique_lock<std::mutex> l(m);
+			if(until) cv.wait_until(l, *until, [&]() { return woken; });
+			else cv.wait(l, [&]() { return woken; });
+			w = woken;
+			woken = false;
+		}
+		if(w) llm.CheckWork();
+	};
+	auto idle = [&]() { return !llm.is_working && !llm.wq.size(); };
+
+	if(model_fn == "mock") {
+		MockBackend *mock = new MockBackend();
+		mock->us_per_decode = mock_us_decode;
+		mock->us_per_token = mock_us_token;
+		llm.set_backend(mock, vocab_fingerprint(mock));
+	} else {
+		llm.load_model_async(model_fn.c_str());
+		while(llm.is_loading()) pump(NULL);
+	}
+	if(!llm.backend) {
+		fprintf(stderr, "%s: %s\n", model_fn.c_str(), llm.load_error.c_str());
+		return 1;
+	}
+
+	// start from where the recording did, with the document scored
+	Clock::time_point t0 = Clock::now();
+	llm.insert(0, doc);
+	while(!idle()) pump(NULL);
+	fprintf(stderr, "scored the initial %zu bytes in %.0fms\n", doc.size(), since_ms(t0));
+
+	OpStats stats[TR_COUNT];
+	std::vector<Pending> pending;
+	auto check = [&]() {
+		for(size_t i=0; i<pending.size(); ) {
+			Pending &p = pending[i];
+			bool ready;
+			switch(p.op) {
+			case TR_INSERT:
+			case TR_ERASE: ready = scored_before(llm, p.pos); break;
+			case TR_CURSOR:
+			case TR_ALT_NEXT:
+			case TR_ALT_PREV: ready = alts_ready(llm, p.pos); break;
+			default: ready = true;
+			}
+			if(ready) {
+				stats[p.op].ready_ms.push_back(since_ms(p.t));
+				pending.erase(pending.begin() + i);
+			} else ++i;
+		}
+	};
+	// what earlier calls wait for moves with the text
+	auto shift = [&](int from, int removed, int inserted) {
+		for(Pending &p : pending) {
+			if(p.pos > from) p.pos = std::max(from, p.pos - removed) + inserted;
+		}
+	};
+	auto issue = [&](const TraceEvent &e) {
+		Pending p { e.op, e.a, Clock::now(), 0 };
+		switch(e.op) {
+		case TR_INSERT:
+			shift(e.a, 0, e.text.size());
+			llm.insert(e.a, e.text);
+			p.pos = e.a + e.text.size();
+			break;
+		case TR_ERASE:
+			shift(e.a, e.b - e.a, 0);
+			llm.erase(e.a, e.b);
+			p.pos = e.a + 1;
+			break;
+		case TR_CURSOR: llm.req_alts_at_pos(e.a); break;
+		case TR_ALT_NEXT: llm.alt_next(e.a); break;
+		case TR_ALT_PREV: llm.alt_prev(e.a); break;
+		case TR_ALT_COMMIT: llm.alt_commit(e.a); break;
+		case TR_ALT_BACK: llm.alt_back(e.a); break;
+		default: break;
+		}
+		p.call_ms = since_ms(p.t);
+		stats[e.op].call_ms.push_back(p.call_ms);
+		pending.push_back(p);
+	};
+
+	t0 = Clock::now();
+	size_t next = 0;
+	while(next < events.size() || pending.size()) {
+		if(next < events.size()) {
+			Clock::time_point due = t0 + std::chrono::microseconds((int64_t)(speed > 0 ? events[next].t_us / speed : 0));
+			if(speed > 0 ? Clock::now() >= due : !pending.size()) {
+				issue(events[next++]);
+				check();
+				continue;
+			}
+			if(idle()) {
+				// nothing is coming for what is still waiting
+				for(Pending &p : pending) ++stats[p.op].unfinished;
+				pending.clear();
+				if(speed > 0) std::this_thread::sleep_until(due);
+				continue;
+			}
+			pump(speed > 0 ? &due : NULL);
+		} else {
+			if(idle()) {
+				for(Pending &p : pending) ++stats[p.op].unfinished;
+				pending.clear();
+				break;
+			}
+			pump(NULL);
+		}
+		check();
+	}
+	fprintf(stderr, "replayed %zu calls in %.0fms (recorded over %.0fms)\n", events.size(), since_ms(t0),
+		events.size() ? events.back().t_us / 1000.0 : 0.0);
+
+	bool json = (format == "jsonl");
+	if(!json) fprintf(out, "op\tn\tunfinished\tcall_p50\tcall_p90\tcall_p99\tcall_max\tready_p50\tready_p90\tready_p99\tready_max\n");
+	for(int op=0; op<TR_COUNT; ++op)
+		if(stats[op].call_ms.size()) put_stats(out, json, trace_op_names[op], stats[op]);
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,403 @@
+/* autopen-score: per-token surprisal of text files, without the editor.
+ *
+ *   autopen-score -m model.gguf [-f tsv|jsonl] [-o out] [-b batch] [--numa strategy] [-v] [file ...]
+ *
+ * Reads each file (or stdin, if there are none or for "-") into an LLMBuffer, lets its scoring pass run
+ * to the end, and writes a line per token as soon as that token is scored: file, byte offset, token text,
+ * log-probability and entropy in nats, and the rank of the token among all of the model's choices (1 is
+ * the most likely one).
+ *
+ * "-m mock" scores with a MockBackend instead of a model file.
+ *
+ * With --check-tokenize, nothing is scored: each file is tokenized in parallel chunks, as large pastes
+ * and loads are, and in one call, and any difference between the two is reported.
+ *
+ * With --corpus, each file (or with --lines, each line) is a document, and documents are scored -p at a
+ * time in a CorpusScorer, each in up to -c positions; they are written out as they finish. */
+
+#include "tokentree.h"
+#include "tuning.h"
+#include "corpus.h"
+#include <condition_variable>
+#include <algorithm>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define fdopen _fdopen
+#define NULL_DEVICE "NUL"
+#else
+#include <unistd.h>
+#define NULL_DEVICE "/dev/null"
+#endif
+
+struct TokenStats {
+	float logprob;
+	float entropy;
+	int rank;
+};
+
+/* the distribution at a position, and where tok falls in it */
+static TokenStats token_stats(const float *logits, int n_vocab, llama_token tok)
+{
+	float mx = *std::max_element(logits, logits+n_vocab);
+	double z = 0, ez = 0;
+	int above = 0;
+	for(int i=0; i<n_vocab; ++i) {
+		double e = exp(logits[i] - mx);
+		z += e;
+		ez += e * (logits[i] - mx);
+		if(logits[i] > logits[tok]) ++above;
+	}
+	TokenStats s;
+	s.logprob = logits[tok] - mx - log(z);
+	s.entropy = log(z) - ez/z;
+	s.rank = above + 1;
+	return s;
+}
+
+static void put_tsv(FILE *out, const std::string &s)
+{
+	for(char c : s) {
+		switch(c) {
+		case '\t': fputs("\\t", out); break;
+		case '\n': fputs("\\n", out); break;
+		case '\r': fputs("\\r", out); break;
+		case '\\': fputs("\\\\", out); break;
+		default: fputc(c, out);
+		}
+	}
+}
+
+/* tokens can end in the middle of a character, and JSON has to be valid UTF-8; such bytes become U+FFFD,
+ * and the offset still says where the token is in the file */
+static void put_json(FILE *out, const std::string &s)
+{
+	fputc('"', out);
+	for(size_t i=0; i<s.size(); ) {
+		unsigned char c = s[i];
+		int n = (c < 0x80) ? 0 : ((c & 0xE0) == 0xC0) ? 1 : ((c & 0xF0) == 0xE0) ? 2 : ((c & 0xF8) == 0xF0) ? 3 : -1;
+		bool ok = n >= 0 && i+n < s.size();
+		for(int k=1; ok && k<=n; ++k) ok = ((unsigned char)s[i+k] & 0xC0) == 0x80;
+		if(!ok) {
+			fputs("\xEF\xBF\xBD", out);
+			++i;
+		} else if(n) {
+			fwrite(s.data()+i, 1, n+1, out);
+			i += n+1;
+		} else {
+			if(c == '"' || c == '\\') fprintf(out, "\\%c", c);
+			else if(c == '\n') fputs("\\n", out);
+			else if(c == '\t') fputs("\\t", out);
+			else if(c < 0x20) fprintf(out, "\\u%04x", c);
+			else fputc(c, out);
+			++i;
+		}
+	}
+	fputc('"', out);
+}
+
+/* one line of output; s is NULL for tokens that did not get scored */
+static void put_token(FILE *out, bool json, const std::string &fn, int offset, const std::string &tok, const TokenStats *s)
+{
+	if(!json) {
+		put_tsv(out, fn);
+		fprintf(out, "\t%d\t", offset);
+		put_tsv(out, tok);
+		if(s) fprintf(out, "\t%.4f\t%d\t%.4f\n", s->logprob, s->rank, s->entropy);
+		else fprintf(out, "\t\t\t\n");
+	} else {
+		fprintf(out, "{\"file\":");
+		put_json(out, fn);
+		fprintf(out, ",\"offset\":%d,\"token\":", offset);
+		put_json(out, tok);
+		if(s) fprintf(out, ",\"logprob\":%.4f,\"rank\":%d,\"entropy\":%.4f}\n", s->logprob, s->rank, s->entropy);
+		else fprintf(out, ",\"logprob\":null,\"rank\":null,\"entropy\":null}\n");
+	}
+}
+
+static std::string token_piece(LLMBackend *vocab, llama_token t, bool special)
+{
+	char buf[128];
+	int n = vocab->token_to_piece(t, buf, sizeof(buf), special);
+	return std::string(buf, std::max(n, 0));
+}
+
+static bool read_input(const std::string &fn, std::string &text)
+{
+	std::stringstream ss;
+	if(fn == "-") ss << std::cin.rdbuf();
+	else {
+		std::ifstream f(fn, std::ios::binary);
+		if(!f) {
+			fprintf(stderr, "cannot read %s\n", fn.c_str());
+			return false;
+		}
+		ss << f.rdbuf();
+	}
+	text = ss.str();
+	return true;
+}
+
+/* corpus mode: documents go through a CorpusScorer many at a time rather than through the buffer one by one */
+static int score_corpus(LLMBuffer &llm, CorpusScorer &cs, const std::vector<std::string> &inputs, bool lines, bool json, FILE *out)
+{
+	int ret = 0;
+	std::vector<std::string> names;
+	std::vector<std::vector<llama_token>> docs;
+	auto add = [&](const std::string &name, const std::string &text) {
+		names.push_back(name);
+		docs.push_back(llm.tokenize(text, true));
+		std::vector<llama_token> &d = docs.back();
+		if(!d.size() || d[0] != llm.backend->bos()) d.insert(d.begin(), llm.backend->bos());
+	};
+	for(const std::string &fn : inputs) {
+		std::string text;
+		if(!read_input(fn, text)) {
+			ret = 1;
+			continue;
+		}
+		if(!lines) {
+			add(fn, text);
+			continue;
+		}
+		// every non-empty line is a document of its own, named after where it was found
+		std::stringstream ss(text);
+		std::string line;
+		for(int n=1; std::getline(ss, line); ++n)
+			if(line.size()) add(fn + ":" + std::to_string(n), line);
+	}
+
+	// documents finish out of order, so each one's scores are kept until it is written out whole
+	std::vector<std::vector<TokenStats>> stats(docs.size());
+	std::vector<std::vector<bool>> scored(docs.size());
+	cs.on_logits = [&](int d, int i, const float *logits) {
+		if(!stats[d].size()) {
+			stats[d].resize(docs[d].size());
+			scored[d].resize(docs[d].size());
+		}
+		stats[d][i] = token_stats(logits, llm.n_vocab, docs[d][i]);
+		scored[d][i] = true;
+	};
+	cs.on_done = [&](int d) {
+		int offset = 0;
+		for(int i=1; i<(int)docs[d].size(); ++i) {
+			std::string tok = token_piece(llm.backend, docs[d][i], true);
+			put_token(out, json, names[d], offset, tok, (stats[d].size() && scored[d][i]) ? &stats[d][i] : NULL);
+			offset += tok.size();
+		}
+		fflush(out);
+		std::vector<TokenStats>().swap(stats[d]);
+		std::vector<bool>().swap(scored[d]);
+	};
+
+	if(!cs.run(docs)) ret = 1;
+	fprintf(stderr, "%d documents, %lld tokens in %.2fs: %.1f tokens/s, %.2f documents/s\n",
+		cs.n_docs, (long long)cs.n_tokens, cs.seconds, cs.tokens_per_s(), cs.docs_per_s());
+	return ret;
+}
+
+/* tokenize_par() against one llama_tokenize call, with chunks small enough for every file to have several */
+static int check_tokenize(LLMBuffer &llm, const std::vector<std::string> &inputs)
+{
+	int ret = 0;
+	int chunk = llm.tokenize_chunk;
+	for(const std::string &fn : inputs) {
+		std::string text;
+		if(!read_input(fn, text)) {
+			ret = 1;
+			continue;
+		}
+		llm.tokenize_chunk = std::max(1024, std::min(chunk, (int)text.size()/8));
+		std::vector<llama_token> par = llm.tokenize_par(text, true);
+		std::vector<llama_token> one(text.size() + 2);
+		int n = llm.backend->tokenize(text.data(), text.size(), one.data(), one.size(), true);
+		if(n < 0) {
+			one.resize(-n);
+			n = llm.backend->tokenize(text.data(), text.size(), one.data(), one.size(), true);
+		}
+		one.resize(n);
+
+		size_t i = std::mismatch(par.begin(), par.end(), one.begin(), one.end()).first - par.begin();
+		if(i == par.size() && i == one.size()) {
+			fprintf(stderr, "%s: %zu tokens in chunks of %d bytes, the same as in one call%s\n", fn.c_str(), one.size(), llm.tokenize_chunk,
+				llm.tokenize_chunked ? "" : " (the vocabulary does not tokenize in pieces, so the editor does not use chunks)");
+		} else {
+			int offset = 0;
+			for(size_t k=(one.size() && one[0]==llm.backend->bos()); k<i; ++k) offset += token_piece(llm.backend, one[k], true).size();
+			fprintf(stderr, "%s: chunks differ from one call at token %zu, byte %d (%zu vs %zu tokens)\n", fn.c_str(), i, offset, par.size(), one.size());
+			ret = 1;
+		}
+	}
+	llm.tokenize_chunk = chunk;
+	return ret;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: autopen-score -m model.gguf [-f tsv|jsonl] [-o out] [-b batch] [--numa strategy] [-v] [file ...]\n"
+	                "       autopen-score -m model.gguf --corpus [--lines] [-p parallel] [-c ctx] [-f tsv|jsonl] [-o out] [file ...]\n"
+	                "       autopen-score -m model.gguf --check-tokenize [file ...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::string model_fn, format = "tsv", out_fn;
+	std::vector<std::string> inputs;
+	int batch = 256;
+	bool verbose = false, corpus = false, lines = false, check_tok = false;
+	CorpusScorer cs;
+	ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
+	for(int i=1; i<argc; ++i) {
+		std::string a = argv[i];
+		bool has_val = i+1 < argc;
+		if((a == "-m" || a == "--model") && has_val) model_fn = argv[++i];
+		else if((a == "-f" || a == "--format") && has_val) format = argv[++i];
+		else if((a == "-o" || a == "--output") && has_val) out_fn = argv[++i];
+		else if((a == "-b" || a == "--batch") && has_val) batch = std::max(1, atoi(argv[++i]));
+		else if(a == "--numa" && has_val) numa = numa_strategy(argv[++i]);
+		else if((a == "-p" || a == "--parallel") && has_val) cs.n_seq = std::max(1, atoi(argv[++i]));
+		else if((a == "-c" || a == "--ctx") && has_val) cs.n_ctx_seq = std::max(2, atoi(argv[++i]));
+		else if(a == "--corpus") corpus = true;
+		else if(a == "--lines") corpus = lines = true;
+		else if(a == "--check-tokenize") check_tok = true;
+		else if(a == "-v" || a == "--verbose") verbose = true;
+		else if(a == "-h" || a == "--help") { usage(); return 0; }
+		else if(a.size() > 1 && a[0] == '-') { usage(); return 1; }
+		else inputs.push_back(a);
+	}
+	if(model_fn.empty() || (format != "tsv" && format != "jsonl")) {
+		usage();
+		return 1;
+	}
+	if(inputs.empty()) inputs.push_back("-");
+
+	// the buffer reports on what it is doing on stdout, so the results get their own stream
+	FILE *out = out_fn.size() ? fopen(out_fn.c_str(), "wb") : fdopen(dup(fileno(stdout)), "wb");
+	if(!out) {
+		fprintf(stderr, "cannot open %s\n", out_fn.size() ? out_fn.c_str() : "stdout");
+		return 1;
+	}
+	if(verbose) dup2(fileno(stderr), fileno(stdout));
+	else if(!freopen(NULL_DEVICE, "w", stdout)) return 1;
+
+	LLMBuffer llm;
+	llm.numa = numa;
+	llm.init();
+	if(!verbose) llama_log_set([](ggml_log_level, const char *, void *) {}, NULL);
+	llm.score_batch = batch;
+	llm.reuse_scores = false; // memoized scores come without the rest of their distribution
+
+	// the worker and the loader wake us up like they would wake up the editor's main loop
+	std::mutex m;
+	std::condition_variable cv;
+	bool woken = false;
+	llm.notify_work_done_async = [&]() {
+		{
+			std::lock_guard<std::mutex> l(m);
+			woken = true;
+		}
+		cv.notify_one();
+	};
+	auto pump = [&]() {
+		{
+			std::unique_lock<std::mutex> l(m);
+			cv.wait(l, [&]() { return woken; });
+			woken = false;
+		}
+		llm.CheckWork();
+	};
+
+	std::unordered_map<TTE*, TokenStats> stats;
+	llm.notify_logits = [&](TTE *t, const float *logits) {
+		if(!t->children.size()) return;
+		TTE *c = t->children[t->sel];
+		if(c->is_accepted && !c->foreign) stats[c] = token_stats(logits, llm.n_vocab, c->tok);
+	};
+
+	if(model_fn == "mock") {
+		// made-up scores, for trying out the pipeline without a model file
+		MockBackend *mock = new MockBackend();
+		llm.set_backend(mock, vocab_fingerprint(mock));
+	} else {
+		llm.load_model_async(model_fn.c_str());
+		while(llm.is_loading()) pump();
+	}
+	if(!llm.backend) {
+		fprintf(stderr, "%s: %s\n", model_fn.c_str(), llm.load_error.c_str());
+		return 1;
+	}
+
+	if(check_tok) {
+		int ret = check_tokenize(llm, inputs);
+		fclose(out);
+		return ret;
+	}
+
+	if(format == "tsv") fprintf(out, "file\toffset\ttoken\tlogprob\trank\tentropy\n");
+	
+	if(corpus) {
+		if(!llm.llama) {
+			fprintf(stderr, "corpus mode needs a llama.cpp model\n");
+			return 1;
+		}
+		if(!cs.init(llm.llama->model, llm.llama->params)) return 1;
+		int ret = score_corpus(llm, cs, inputs, lines, format == "jsonl", out);
+		fclose(out);
+		return ret;
+	}
+
+	int ret = 0;
+	for(const std::string &fn : inputs) {
+		std::string text;
+		if(!read_input(fn, text)) {
+			ret = 1;
+			continue;
+		}
+
+		if(llm.doc.size()) llm.erase(0, llm.doc.size());
+		stats.clear();
+		llm.insert(0, text);
+
+		// write tokens out in order as their scores arrive; whatever is left unscored at the end goes out without
+		TTE *at = &llm.root;
+		int n_tok = 0;
+		int64_t t0 = ggml_time_us();
+		auto emit = [&](bool flush) {
+			while(at->children.size()) {
+				TTE *c = at->children[at->sel];
+				if(!c->is_accepted) break;
+				auto s = stats.find(c);
+				if(s == stats.end() && !flush) break;
+				put_token(out, format == "jsonl", fn, c->base_pos, c->str, s != stats.end() ? &s->second : NULL);
+				at = c;
+				++n_tok;
+			}
+			fflush(out);
+		};
+
+		emit(false);
+		while(llm.is_working) {
+			pump();
+			emit(false);
+		}
+		emit(true);
+
+		if(llm.work_error.size()) {
+			fprintf(stderr, "%s: %s\n", fn.c_str(), llm.work_error.c_str());
+			ret = 1;
+		}
+		fprintf(stderr, "%s: %d tokens in %.2fs\n", fn.c_str(), n_tok, (ggml_time_us() - t0) / 1e6);
+	}
+
+	fclose(out);
+	return ret;
+}
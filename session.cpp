@@ -0,0 +1,409 @@
+#include "session.h"
+#include "tokentree.h"
+#include "diskcache.h"
+#include <filesystem>
+#include <map>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+
+#define SESSION_VERSION 1
+#define NO_SNAPSHOT 0xffffffffu
+
+enum { N_ACCEPTED = 1, N_HAS_LOGIT = 2, N_STALE = 4, N_FOREIGN = 8, N_SNAPSHOT = 16 };
+
+/* bounds-checked reads from the mapping; a short or damaged file just reads as not ok */
+struct SessionReader {
+	const uint8_t *p;
+	size_t len, at;
+	bool ok = true;
+
+	template<class T> T get() {
+		T v = T();
+		if(at + sizeof(T) > len) ok = false;
+		if(ok) memcpy(&v, p + at, sizeof(T));
+		at += sizeof(T);
+		return v;
+	}
+	std::string str(uint64_t n) {
+		if(at + n > len) ok = false;
+		std::string s = ok ? std::string((const char*)p + at, n) : std::string();
+		at += n;
+		return s;
+	}
+};
+
+struct SessionNode {
+	llama_token tok;
+	uint8_t flags;
+	uint32_t sel, n_children;
+	float logit, max_logit;
+	uint64_t end; // offset just past this node's subtree
+	std::string str; // foreign tokens only
+	uint32_t snap;
+};
+
+static bool read_node(SessionReader &r, SessionNode &n)
+{
+	n.tok = r.get<int32_t>();
+	n.flags = r.get<uint8_t>();
+	n.sel = r.get<uint32_t>();
+	n.n_children = r.get<uint32_t>();
+	n.logit = r.get<float>();
+	n.max_logit = r.get<float>();
+	n.end = r.get<uint64_t>();
+	n.str = (n.flags & N_FOREIGN) ? r.str(r.get<uint32_t>()) : "";
+	n.snap = (n.flags & N_SNAPSHOT) ? r.get<uint32_t>() : NO_SNAPSHOT;
+	return r.ok && n.end >= r.at && n.end <= r.len;
+}
+
+/* streaming writes that keep track of the offset, so forward references can be patched in afterwards */
+struct SessionWriter {
+	FILE *f;
+	uint64_t pos = 0;
+	bool ok = true;
+
+	void raw(const void *d, size_t n) {
+		if(ok && n) ok = fwrite(d, 1, n, f) == n;
+		pos += n;
+	}
+	template<class T> void put(T v) { raw(&v, sizeof(T)); }
+	void patch(uint64_t at, uint64_t v) {
+#ifdef _WIN32
+		ok = ok && !_fseeki64(f, at, SEEK_SET) && fwrite(&v, sizeof(v), 1, f) == 1 && !_fseeki64(f, pos, SEEK_SET);
+#else
+		ok = ok && !fseeko(f, at, SEEK_SET) && fwrite(&v, sizeof(v), 1, f) == 1 && !fseeko(f, pos, SEEK_SET);
+#endif
+	}
+};
+
+bool SessionFile::open(const std::string &fn)
+{
+	this->fn = fn;
+	p = map_file(fn, len, handle);
+	return p != NULL;
+}
+
+SessionFile::~SessionFile()
+{
+	if(p) unmap_file(p, len, handle);
+}
+
+bool LLMBuffer::save_session(const std::string &fn, bool with_snapshots)
+{
+	session_error = "";
+	// everything still in the old file has to come out, as it may be the one we are replacing
+	if(backend) expand_all(&root);
+
+	std::string tmp = fn + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if(!f) {
+		session_error = "Could not write " + fn + ".";
+		return false;
+	}
+	SessionWriter w = { f };
+
+	std::string text = doc.str();
+	std::string key = backend ? disk_cache.key : "";
+	w.raw("APSN", 4);
+	w.put<uint32_t>(SESSION_VERSION);
+	w.put<uint64_t>(backend ? vocab_hash : 0);
+	w.put<uint32_t>(key.size());
+	w.raw(key.data(), key.size());
+	w.put<uint64_t>(text.size());
+	w.raw(text.data(), text.size());
+	uint64_t table_at = w.pos;
+	w.put<uint64_t>(0);
+
+	// snapshots are only known to be complete, and how large, if the prefix cache has them
+	struct Snap {
+		std::shared_ptr<uint8_t[]> state;
+		size_t size;
+		int off;
+	};
+	std::vector<Snap> snaps;
+	std::map<const uint8_t*, uint32_t> snap_idx;
+	std::vector<llama_token> path;
+
+	auto node = [&](TTE *t) {
+		path.resize(t->depth+1);
+		path[t->depth] = t->tok;
+
+		uint32_t snap = NO_SNAPSHOT;
+		if(with_snapshots && backend && t != &root && t->ctx_snapshot) {
+			auto i = snap_idx.find(t->ctx_snapshot.get());
+			std::shared_ptr<uint8_t[]> st;
+			int off;
+			size_t size;
+			if(i != snap_idx.end()) snap = i->second;
+			else if(kv_cache && kv_cache->find(kv_key, path.data(), t->depth, t->depth-1, INT_MAX, st, off, &size) == t->depth && st == t->ctx_snapshot) {
+				snap = snap_idx[st.get()] = snaps.size();
+				snaps.push_back({ st, size, off });
+			}
+		}
+
+		bool children = backend && t->children.size();
+		w.put<int32_t>(t->tok);
+		w.put<uint8_t>((t->is_accepted ? N_ACCEPTED : 0) | (t->has_logit ? N_HAS_LOGIT : 0) | (t->stale ? N_STALE : 0)
+		             | (t->foreign ? N_FOREIGN : 0) | (snap != NO_SNAPSHOT ? N_SNAPSHOT : 0));
+		w.put<uint32_t>(children ? t->sel : 0);
+		w.put<uint32_t>(children ? t->children.size() : 0);
+		w.put<float>(t->logit);
+		w.put<float>(t->max_logit);
+		uint64_t end_at = w.pos;
+		w.put<uint64_t>(0);
+		if(t->foreign) {
+			w.put<uint32_t>(t->str.size());
+			w.raw(t->str.data(), t->str.size());
+		}
+		if(snap != NO_SNAPSHOT) w.put<uint32_t>(snap);
+		return end_at;
+	};
+
+	// preorder, without recursing as deep as the document is long
+	struct Frame {
+		TTE *t;
+		size_t next;
+		uint64_t end_at;
+	};
+	std::vector<Frame> stack;
+	stack.push_back({ &root, 0, node(&root) });
+	while(stack.size() && w.ok) {
+		Frame &fr = stack.back();
+		if(backend && fr.next < fr.t->children.size()) {
+			TTE *c = fr.t->children[fr.next++];
+			stack.push_back({ c, 0, node(c) });
+		} else {
+			w.patch(fr.end_at, w.pos);
+			stack.pop_back();
+		}
+	}
+
+	std::vector<uint64_t> offs;
+	for(auto &s : snaps) {
+		offs.push_back(w.pos);
+		w.raw(s.state.get(), s.size);
+	}
+	if(snaps.size()) {
+		w.patch(table_at, w.pos);
+		w.put<uint32_t>(snaps.size());
+		for(size_t i=0; i<snaps.size(); ++i) {
+			w.put<uint64_t>(offs[i]);
+			w.put<uint64_t>(snaps[i].size);
+			w.put<int32_t>(snaps[i].off);
+		}
+	}
+
+	bool ok = !fclose(f) && w.ok;
+	std::error_code ec;
+	// saving over the session we loaded from: everything from it has been written out, and the mapping
+	// has to go before the file can be replaced
+	std::error_code eq_ec;
+	if(ok && session && std::filesystem::equivalent(fn, session->fn, eq_ec)) release_session();
+	if(ok) std::filesystem::rename(tmp, fn, ec);
+	if(!ok || ec) {
+		std::filesystem::remove(tmp, ec);
+		session_error = "Could not write " + fn + ".";
+		return false;
+	}
+	printf("session: saved %zu bytes of text, %zu snapshots to %s\n", text.size(), snaps.size(), fn.c_str());
+	return true;
+}
+
+void LLMBuffer::open_session(const std::string &fn)
+{
+	// the tree is about to be replaced, so the worker has to be done with it; let it finish, but start nothing new
+	session_pending = fn;
+	if(is_working) purgeWork(0);
+	else CheckWork();
+}
+
+bool LLMBuffer::load_session(const std::string &fn)
+{
+	session_error = "";
+	std::shared_ptr<SessionFile> s = std::make_shared<SessionFile>();
+	if(!s->open(fn)) {
+		session_error = "Could not read " + fn + ".";
+		return false;
+	}
+
+	SessionReader r = { s->p, s->len, 0 };
+	std::string magic = r.str(4);
+	uint32_t version = r.get<uint32_t>();
+	uint64_t file_vocab = r.get<uint64_t>();
+	std::string key = r.str(r.get<uint32_t>());
+	std::string text = r.str(r.get<uint64_t>());
+	s->snap_table = r.get<uint64_t>();
+	size_t root_at = r.at;
+	SessionNode rn;
+	if(!r.ok || magic != "APSN" || version != SESSION_VERSION || !read_node(r, rn)) {
+		session_error = fn + " is not an Autopen session, or from another version.";
+		return false;
+	}
+	if(s->snap_table) {
+		SessionReader t = { s->p, s->len, s->snap_table };
+		s->n_snaps = t.get<uint32_t>();
+		if(!t.ok) s->snap_table = s->n_snaps = 0;
+	}
+
+	int old_len = doc.size();
+	doc.assign(text.data(), text.size());
+	notify_edit(0, old_len, text.size());
+
+	wq.clear();
+	wq_head_invalid = false;
+	ctx_state = NULL;
+	root.clear_children();
+	root.lazy = -1;
+	live_stale = 0;
+	session = NULL;
+	notify_model_loaded(); // anything that pointed into the old tree has to let go
+	if(!backend) return true; // plain-text mode; the tree is built from the text when a model arrives
+
+	if(file_vocab != vocab_hash) {
+		// token ids mean something else to this model, so only the text carries over
+		printf("session: %s is from another vocabulary, retokenizing\n", fn.c_str());
+		rebuild(&root, doc.size());
+		try_start_working();
+		return true;
+	}
+
+	s->stale = (key != disk_cache.key);
+	s->snapshots = !s->stale && s->n_snaps;
+	session = s;
+	root.sel = rn.sel;
+	root.lazy = rn.n_children ? root_at : -1;
+	for(TTE *t = &root; t; t = (t->children.size() && t->sel < t->children.size()) ? t->children[t->sel] : NULL)
+		expand(t);
+
+	if(!renders_as_doc(&root)) {
+		// should not happen, but the text is what the user cares about
+		printf("session: tree and text of %s disagree, retokenizing\n", fn.c_str());
+		root.clear_children();
+		root.lazy = -1;
+		session = NULL;
+		rebuild(&root, doc.size());
+		try_start_working();
+		return true;
+	}
+
+	notify_invalidate(0, doc.size());
+	index_live();
+	for(TTE *t : live)
+		if(t->is_accepted && t->has_logit) notify_new_logit(t->base_pos, t->base_pos+t->str_size, t->logit - t->max_logit);
+	notify_new_predictions();
+
+	// whatever was not scored when it was saved, or was scored by another model, is done now
+	if(s->stale) rescore();
+	else enqueueWork(WL_SCORE, &root);
+	try_start_working();
+	printf("session: loaded %s%s\n", fn.c_str(), s->stale ? " (made with another model, rescoring)" : "");
+	return true;
+}
+
+/* build the children of t that are still in the session file; their own children stay there */
+void LLMBuffer::expand(TTE *t)
+{
+	if(t->lazy < 0) return;
+	SessionReader r = { session ? session->p : NULL, session ? session->len : 0, (size_t)t->lazy };
+	t->lazy = -1;
+	SessionNode n;
+	if(!session || !read_node(r, n)) return;
+
+	for(uint32_t i=0; i<n.n_children; ++i) {
+		size_t at = r.at;
+		SessionNode c;
+		if(!read_node(r, c)) break;
+
+		TTE *x = new TTE(this);
+		x->parent = t;
+		x->depth = t->depth + 1;
+		x->base_pos = t->base_pos + t->str_size;
+		x->is_accepted = c.flags & N_ACCEPTED;
+		x->sel = c.sel;
+		if(c.flags & N_FOREIGN) {
+			x->foreign = true;
+			x->tok = LLAMA_TOKEN_NULL;
+			x->str = c.str;
+			x->str_size = c.str.size();
+			x->update_hash();
+		} else {
+			x->set_tok(c.tok);
+		}
+		x->logit = c.logit;
+		x->max_logit = c.max_logit;
+		x->has_logit = (c.flags & N_HAS_LOGIT) && !session->stale;
+		x->stale = (c.flags & N_STALE) || ((c.flags & N_HAS_LOGIT) && session->stale);
+
+		if(session->snapshots && c.snap < session->n_snaps) {
+			SessionReader e = { session->p, session->len, session->snap_table + 4 + c.snap*20 };
+			uint64_t offset = e.get<uint64_t>(), size = e.get<uint64_t>();
+			int off = e.get<int32_t>();
+			if(e.ok && offset + size <= session->len) {
+				// straight from the mapping, which stays around for as long as any snapshot from it does
+				x->ctx_snapshot = std::shared_ptr<uint8_t[]>(session, (uint8_t*)session->p + offset);
+				x->snapshot_off = off;
+				std::vector<llama_token> path;
+				if(kv_cache && path_tokens(t, path)) kv_cache->put(kv_key, path.data(), path.size(), x->ctx_snapshot, size, off);
+			}
+		}
+
+		x->lazy = c.n_children ? (int64_t)at : -1;
+		t->children.push_back(x);
+		r.at = c.end;
+	}
+	if(t->sel >= t->children.size()) t->sel = 0;
+	live_changed(t);
+}
+
+void LLMBuffer::expand_all(TTE *t)
+{
+	std::vector<TTE*> todo(1, t);
+	while(todo.size()) {
+		TTE *x = todo.back();
+		todo.pop_back();
+		expand(x);
+		for(TTE *c : x->children) todo.push_back(c);
+	}
+}
+
+void LLMBuffer::release_session()
+{
+	if(!session) return;
+	expand_all(&root);
+	std::shared_ptr<SessionFile> s = session;
+	session = NULL;
+
+	// sizes of the snapshots in the file, by where they are mapped
+	std::map<const uint8_t*, size_t> sizes;
+	SessionReader e = { s->p, s->len, s->snap_table + 4 };
+	for(uint32_t i=0; i<s->n_snaps && e.ok; ++i) {
+		uint64_t offset = e.get<uint64_t>(), size = e.get<uint64_t>();
+		e.get<int32_t>();
+		if(e.ok && offset + size <= s->len) sizes[s->p + offset] = size;
+	}
+
+	// the prefix cache holds on to them too; the copies go back in for the nodes that still have them
+	if(kv_cache) kv_cache->drop(s->p, s->p + s->len);
+	std::map<const uint8_t*, std::shared_ptr<uint8_t[]> > copies;
+	std::vector<TTE*> todo(1, &root);
+	int n = 0;
+	while(todo.size()) {
+		TTE *t = todo.back();
+		todo.pop_back();
+		for(TTE *c : t->children) todo.push_back(c);
+
+		const uint8_t *p = t->ctx_snapshot.get();
+		if(!p || p < s->p || p >= s->p + s->len) continue;
+		auto sz = sizes.find(p);
+		auto &copy = copies[p];
+		if(!copy && sz != sizes.end() && (copy = alloc_snapshot(sz->second))) {
+			memcpy(copy.get(), p, sz->second);
+			++n;
+		}
+		t->ctx_snapshot = copy; // or none, if there was no memory for it
+		std::vector<llama_token> path;
+		if(copy && kv_cache && t->parent && path_tokens(t->parent, path)) kv_cache->put(kv_key, path.data(), path.size(), copy, sz->second, t->snapshot_off);
+	}
+	printf("session: copied %d snapshots out of %s\n", n, s->fn.c_str());
+}
@@ -0,0 +1,34 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+#include <stdint.h>
+
+#define SESSION_EXT ".apsn"
+
+/* Session files hold the document, the whole token tree with its scores, and optionally the context
+ * snapshots hanging off it:
+ *
+ *   header   "APSN", version, vocabulary fingerprint, model key, document text, offset of the snapshot table
+ *   nodes    the tree in preorder, each node followed by its subtree and knowing where that ends
+ *   snapshots blobs, then a table of (offset, size, window start) the nodes refer to by index
+ *
+ * Files are written in one pass and mapped when loaded. Only the live path is built right away;
+ * everything else stays in the file until someone looks at it (see LLMBuffer::expand), so large
+ * sessions open with their highlighting in place and without rescoring. */
+struct SessionFile {
+	std::string fn;
+	const uint8_t *p = NULL;
+	size_t len = 0;
+	void *handle = NULL;
+	bool stale = false; // made with another model: its scores are shown, but redone
+	bool snapshots = false; // its snapshots fit our context
+
+	size_t snap_table = 0;
+	uint32_t n_snaps = 0;
+
+	bool open(const std::string &fn);
+	~SessionFile();
+};
+
+#endif
@@ -0,0 +1,319 @@
+/* autopen-test: regression checks of the token tree and work queue, on a mock model.
+ *
+ *   autopen-test [-v]
+ *
+ * Drives an LLMBuffer the way the editor does: types a document into it, edits it at random offsets,
+ * and asks for and cycles through alternatives, letting the worker run dry after each step. After
+ * every step it checks that the accepted path of the tree renders to the document, and that every
+ * token on it was scored, with the score a single decode of the whole path from an empty context
+ * gives it. As the buffer gets there by restoring snapshots and catching up from them, that checks
+ * those too. Edits retokenize only the text around them, which has to come out as tokenizing the whole
+ * document would. Everything runs with the prefix cache and without it. A context that can't be grown
+ * for want of memory has to stop the work that needs it, and be grown by later work once it can. Large inputs tokenized in parallel
+ * chunks have to come out as one call would tokenize them.
+ *
+ * Prints the checks that failed, and exits with 1 if there were any. */
+
+#include "tokentree.h"
+#include <condition_variable>
+#include <algorithm>
+#include <climits>
+#include <random>
+#include <stdio.h>
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+static int n_checks = 0, n_failed = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static bool check(bool ok, const char *what, int line)
+{
+	++n_checks;
+	if(!ok) {
+		fprintf(stderr, "test.cpp:%d: failed: %s\n", line, what);
+		++n_failed;
+	}
+	return ok;
+}
+
+/* the mock, counting how often a state is restored into it */
+struct TestBackend : MockBackend {
+	std::atomic<int> n_restores{0};
+	void set_state(const uint8_t *src) { ++n_restores; MockBackend::set_state(src); }
+};
+
+/* a mock without the memory for contexts over max_ctx positions, which loses the one it had if lose */
+struct SmallMemoryBackend : TestBackend {
+	int max_ctx = 1024;
+	bool lose = false;
+	bool resize(int n)
+	{
+		if(n <= max_ctx) return TestBackend::resize(n);
+		if(lose) {
+			ctx_size = 0;
+			clear();
+		}
+		return false;
+	}
+};
+
+/* a vocabulary that puts a space in front of its input, like SentencePiece's add_space_prefix */
+struct SpacePrefixBackend : MockBackend {
+	int tokenize(const char *text, int len, llama_token *out, int n_max, bool add_special)
+	{
+		std::string s = " " + std::string(text, len);
+		return MockBackend::tokenize(s.data(), s.size(), out, n_max, add_special);
+	}
+};
+
+/* a buffer on a TestBackend, with the worker waking us up as it would the editor's main loop */
+struct Harness {
+	LLMBuffer llm;
+	TestBackend *mock;
+	std::mutex m;
+	std::condition_variable cv;
+	bool woken = false;
+
+	Harness(bool prefix_cache, TestBackend *backend = NULL)
+	{
+		llm.init();
+		llm.snapshot_freq = 8;
+		if(!prefix_cache) llm.kv_cache = NULL;
+		llm.notify_work_done_async = [this]() {
+			{
+				std::lock_guard<std::mutex> l(m);
+				woken = true;
+			}
+			cv.notify_one();
+		};
+		mock = backend ? backend : new TestBackend();
+		llm.set_backend(mock, vocab_fingerprint(mock));
+		settle();
+	}
+
+	/* let the worker finish everything that is queued */
+	void settle()
+	{
+		while(llm.is_working) {
+			{
+				std::unique_lock<std::mutex> l(m);
+				cv.wait(l, [&]() { return woken; });
+				woken = false;
+			}
+			llm.CheckWork();
+		}
+	}
+};
+
+/* text of about n tokens of the mock's vocabulary, with a line break every so often */
+static std::string make_text(MockBackend *mock, int n, std::mt19937 &rng)
+{
+	std::string text;
+	std::uniform_int_distribution<int> word(257, mock->vocab_size-1);
+	for(int i=0; i<n; ++i) {
+		if(rng() % 16 == 0) text += '\n';
+		else text += mock->pieces[word(rng)];
+	}
+	return text;
+}
+
+/* the tree agrees with the document, and its accepted tokens have the scores they should */
+static void check_tree(Harness &h, const char *after)
+{
+	LLMBuffer &llm = h.llm;
+	int failed = n_failed;
+	CHECK(llm.wq.empty());
+	CHECK(llm.render(&llm.root, INT_MAX) == llm.doc.str());
+
+	llm.index_live();
+	std::vector<llama_token> toks;
+	for(TTE *t : llm.live) {
+		if(!t->is_accepted) break;
+		toks.push_back(t->tok);
+	}
+
+	// the same tokens decoded in one go, on a mock of its own
+	MockBackend ref;
+	ref.resize(ref.n_ctx_train());
+	llama_batch b = llama_batch_init(toks.size(), 0, 1);
+	for(size_t i=0; i<toks.size(); ++i) common_batch_add(b, toks[i], i, { 0 }, true);
+	CHECK(ref.decode(b) == 0);
+	int unscored = 0, wrong = 0;
+	for(size_t i=1; i<toks.size(); ++i) {
+		TTE *t = llm.live[i];
+		const float *logits = ref.logits(i-1);
+		if(!t->has_logit || t->stale) ++unscored;
+		else if(t->logit != logits[t->tok] || t->max_logit != *std::max_element(logits, logits+ref.n_vocab())) ++wrong;
+	}
+	llama_batch_free(b);
+	CHECK(unscored == 0);
+	CHECK(wrong == 0);
+	if(n_failed > failed) fprintf(stderr, "  after %s, at %zu tokens\n", after, toks.size());
+}
+
+/* the mock itself: only entries that asked for logits have them */
+static void test_mock()
+{
+	MockBackend mock;
+	llama_batch b = llama_batch_init(4, 0, 1);
+	for(int i=0; i<4; ++i) common_batch_add(b, 300+i, i, { 0 }, i == 3);
+	CHECK(mock.decode(b) == 0);
+	CHECK(mock.logits(0) == NULL);
+	CHECK(mock.logits(3) != NULL);
+	CHECK(mock.logits(4) == NULL);
+	llama_batch_free(b);
+}
+
+/* tokenize_par() against one call over the same text, on inputs of many chunks */
+static void test_tokenize(MockBackend *mock, bool chunked)
+{
+	LLMBuffer llm;
+	llm.init();
+	llm.kv_cache = NULL;
+	llm.set_backend(mock, vocab_fingerprint(mock));
+	CHECK(llm.tokenize_chunked == chunked);
+	llm.tokenize_chunk = 4096;
+
+	std::mt19937 rng(5);
+	std::string texts[] = { make_text(mock, 20000, rng), make_text(mock, 20000, rng), std::string(50000, 'x') };
+	for(size_t i=0; i<texts[1].size(); i += 1 + rng()%2000) texts[1].replace(i, 1, (rng()%2) ? "\r\n" : "\n\n\n");
+	for(std::string &text : texts) {
+		std::vector<llama_token> one(text.size() + 2);
+		one.resize(mock->tokenize(text.data(), text.size(), one.data(), one.size(), true));
+		CHECK(llm.tokenize_par(text, true) == one);
+	}
+}
+
+static void test_edits(bool prefix_cache)
+{
+	Harness h(prefix_cache);
+	LLMBuffer &llm = h.llm;
+	std::mt19937 rng(prefix_cache ? 1 : 2);
+
+	llm.insert(0, make_text(h.mock, 400, rng));
+	h.settle();
+	check_tree(h, "typing the document");
+
+	int snapshots = 0;
+	for(TTE *t : llm.live) snapshots += (t->ctx_snapshot != NULL);
+	CHECK(snapshots >= (int)llm.live.size() / llm.snapshot_freq / 2);
+
+	// an edit further up has the scoring pass go back there: it restores a state from before the edit
+	// and catches up from it, rather than appending to where it left off
+	for(int k=0; k<40; ++k) {
+		int restores = h.mock->n_restores;
+		int pos = std::uniform_int_distribution<int>(0, llm.doc.size())(rng);
+		if(k%3 == 2 && pos < llm.doc.size()) {
+			llm.erase(pos, std::min(llm.doc.size(), pos + 1 + (int)(rng()%20)));
+		} else {
+			llm.insert(pos, make_text(h.mock, 1 + rng()%4, rng));
+		}
+		if(k%5 == 3) continue; // the next keystroke comes before the worker is done with this one
+		h.settle();
+		check_tree(h, k%3 == 2 ? "an erase" : "an insert");
+		// retokenizing only around the edit comes out as tokenizing the whole document would
+		std::vector<llama_token> toks, whole = llm.tokenize_par(llm.doc.str(), true);
+		for(TTE *t : llm.live) if(t->is_accepted) toks.push_back(t->tok);
+		CHECK(toks == whole);
+		// past the first snapshot, there is one to go back to
+		if(pos > 256 && pos < llm.doc.size()/2) CHECK(h.mock->n_restores > restores);
+	}
+	bool caught_up = false;
+	for(const WorkRecord &r : llm.prof.log) caught_up = caught_up || r.catchup > 0;
+	CHECK(caught_up);
+}
+
+static void test_alternatives(bool prefix_cache)
+{
+	Harness h(prefix_cache);
+	LLMBuffer &llm = h.llm;
+	std::mt19937 rng(prefix_cache ? 3 : 4);
+
+	llm.insert(0, make_text(h.mock, 300, rng));
+	h.settle();
+	check_tree(h, "typing the document");
+
+	for(int k=0; k<6; ++k) {
+		int pos = std::uniform_int_distribution<int>(1, llm.doc.size()-1)(rng);
+		llm.req_alts_at_pos(pos);
+		h.settle();
+		TTE *cur = llm.pos2ent(pos);
+		CHECK(cur->children.size() >= 2);
+
+		// down through the alternatives and back up again: the text after cur follows the selection
+		int n = cur->children.size();
+		for(int i=0; i<n+1; ++i) {
+			llm.alt_next(pos);
+			h.settle();
+			check_tree(h, "switching to the next alternative");
+			cur = llm.pos2ent(pos);
+		}
+		for(int i=0; i<64 && cur->sel > 0; ++i) {
+			llm.alt_prev(pos);
+			h.settle();
+			check_tree(h, "switching to the previous alternative");
+			cur = llm.pos2ent(pos);
+		}
+		CHECK(cur->sel == 0);
+
+		// taking one makes it part of the document, which is scored on from there
+		if(k%2) {
+			llm.alt_next(pos);
+			h.settle();
+		}
+		int end = llm.alt_commit(pos);
+		h.settle();
+		check_tree(h, "taking an alternative");
+		CHECK(end > pos && end <= llm.doc.size());
+	}
+}
+
+/* a context that can't be grown stops the work that needs it, and is grown once there is memory again */
+static void test_grow_failure(bool lose)
+{
+	SmallMemoryBackend *small = new SmallMemoryBackend();
+	small->lose = lose;
+	Harness h(false, small);
+	LLMBuffer &llm = h.llm;
+	std::mt19937 rng(lose ? 6 : 7);
+
+	llm.insert(0, make_text(small, 1500, rng));
+	h.settle();
+	CHECK(!llm.work_error.empty());
+	CHECK(llm.wq.empty());
+	CHECK(small->n_ctx() == (lose ? 0 : 1024));
+
+	small->max_ctx = INT_MAX;
+	llm.insert(llm.doc.size(), make_text(small, 2, rng));
+	h.settle();
+	check_tree(h, lose ? "losing the context" : "failing to grow the context");
+	CHECK(llm.work_error.empty());
+	CHECK(small->n_ctx() > 1024);
+}
+
+int main(int argc, char *argv[])
+{
+	bool verbose = argc > 1 && std::string(argv[1]) == "-v";
+
+	// the buffer reports on everything it does on stdout
+	if(!verbose && !freopen(NULL_DEVICE, "w", stdout)) return 1;
+	llama_log_set([](ggml_log_level, const char *, void *) {}, NULL);
+
+	test_mock();
+	test_tokenize(new MockBackend(), true);
+	test_tokenize(new SpacePrefixBackend(), false);
+	for(bool prefix_cache : { true, false }) {
+		test_edits(prefix_cache);
+		test_alternatives(prefix_cache);
+	}
+	test_grow_failure(false);
+	test_grow_failure(true);
+
+	fprintf(stderr, "%d of %d checks failed\n", n_failed, n_checks);
+	return n_failed ? 1 : 0;
+}
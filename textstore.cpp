@@ -0,0 +1,361 @@
+#include "textstore.h"
+#include <algorithm>
+#include <string.h>
+
+#define TS_CHUNK_MAX 1024 // chunks are grown in place up to this size
+#define TS_CHUNK_FILL 512 // size of chunks laid out for new text, leaving room to type into
+
+struct TextStore::Node {
+	Node *l, *r, *p;
+	unsigned prio;
+	std::string s;
+	int nl;     // newlines in s
+	int sum;    // bytes in subtree
+	int sum_nl; // newlines in subtree
+};
+
+typedef TextStore::Node TSNode;
+
+static inline int sum(const TSNode *t) { return t?t->sum:0; }
+static inline int sum_nl(const TSNode *t) { return t?t->sum_nl:0; }
+
+static void update(TSNode *t)
+{
+	t->sum = sum(t->l) + t->s.size() + sum(t->r);
+	t->sum_nl = sum_nl(t->l) + t->nl + sum_nl(t->r);
+	if(t->l) t->l->p = t;
+	if(t->r) t->r->p = t;
+}
+
+/* split t into the first pos bytes (a) and the rest (b), cutting a chunk in two if need be */
+static void split(TSNode *t, int pos, TSNode *&a, TSNode *&b)
+{
+	if(!t) {
+		a = b = NULL;
+		return;
+	}
+
+	int ls = sum(t->l);
+	int own = t->s.size();
+	if(pos <= ls) {
+		split(t->l, pos, a, t->l);
+		b = t;
+	} else if(pos >= ls + own) {
+		split(t->r, pos - ls - own, t->r, b);
+		a = t;
+	} else {
+		// the right half of the chunk becomes a new node that takes over the right subtree
+		int k = pos - ls;
+		TSNode *n = new TSNode();
+		n->l = NULL;
+		n->r = t->r;
+		n->p = NULL;
+		n->prio = t->prio;
+		n->s = t->s.substr(k);
+		n->nl = std::count(n->s.begin(), n->s.end(), '\n');
+		t->s.resize(k);
+		t->nl -= n->nl;
+		t->r = NULL;
+		update(n);
+		a = t;
+		b = n;
+	}
+	update(t);
+}
+
+static TSNode *merge(TSNode *a, TSNode *b)
+{
+	if(!a) return b;
+	if(!b) return a;
+
+	if(a->prio > b->prio) {
+		a->r = merge(a->r, b);
+		update(a);
+		return a;
+	} else {
+		b->l = merge(a, b->l);
+		update(b);
+		return b;
+	}
+}
+
+static void destroy(TSNode *t)
+{
+	if(!t) return;
+	destroy(t->l);
+	destroy(t->r);
+	delete t;
+}
+
+TextStore::TextStore() : root(NULL), rng(0x9E3779B9u) {}
+
+TextStore::~TextStore()
+{
+	destroy(root);
+}
+
+TSNode *TextStore::make_node(const char *text, int len)
+{
+	// xorshift32 for the treap priorities
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+
+	TSNode *n = new TSNode();
+	n->l = n->r = n->p = NULL;
+	n->prio = rng;
+	n->s.assign(text, len);
+	n->nl = std::count(text, text+len, '\n');
+	update(n);
+	return n;
+}
+
+/* lay out text as a treap of fresh chunks */
+TSNode *TextStore::build(const char *text, int len)
+{
+	TSNode *t = NULL;
+	for(int i=0; i<len; i+=TS_CHUNK_FILL)
+		t = merge(t, make_node(text+i, std::min(TS_CHUNK_FILL, len-i)));
+	return t;
+}
+
+/* find the chunk containing byte pos, and turn pos into an offset into that chunk */
+TSNode *TextStore::locate(int &pos) const
+{
+	TSNode *t = root;
+	while(t) {
+		int ls = sum(t->l);
+		if(pos < ls) {
+			t = t->l;
+		} else if(pos < ls + (int)t->s.size()) {
+			pos -= ls;
+			return t;
+		} else {
+			pos -= ls + t->s.size();
+			t = t->r;
+		}
+	}
+	return NULL;
+}
+
+int TextStore::size() const
+{
+	return sum(root);
+}
+
+int TextStore::line_count() const
+{
+	return sum_nl(root) + 1;
+}
+
+char TextStore::at(int pos) const
+{
+	TSNode *t = locate(pos);
+	return t ? t->s[pos] : 0;
+}
+
+TextStore::Reader TextStore::reader(int pos) const
+{
+	Reader r;
+	r.offs = pos;
+	r.node = locate(r.offs);
+	if(!r.node) r.offs = 0;
+	return r;
+}
+
+void TextStore::copy(int pos, int len, char *out) const
+{
+	Reader r = reader(pos);
+	while(len > 0 && !r.done()) {
+		int k = std::min(len, (int)r.node->s.size() - r.offs);
+		memcpy(out, r.node->s.data() + r.offs, k);
+		out += k;
+		len -= k;
+		r.advance(k);
+	}
+}
+
+std::string TextStore::substr(int pos, int len) const
+{
+	len = std::max(0, std::min(len, size()-pos));
+	std::string ret(len, 0);
+	copy(pos, len, &ret[0]);
+	return ret;
+}
+
+std::string TextStore::str() const
+{
+	return substr(0, size());
+}
+
+void TextStore::insert(int pos, const char *text, int len)
+{
+	if(len <= 0) return;
+
+	// cheap path: grow the chunk around (or ending at) the insertion point
+	int offs;
+	TSNode *t;
+	if(pos > 0) {
+		offs = pos-1;
+		t = locate(offs);
+		++offs;
+	} else {
+		offs = 0;
+		t = locate(offs);
+	}
+	if(t && (int)t->s.size() + len <= TS_CHUNK_MAX) {
+		int nl = std::count(text, text+len, '\n');
+		t->s.insert(offs, text, len);
+		t->nl += nl;
+		for(TSNode *u = t; u; u = u->p) {
+			u->sum += len;
+			u->sum_nl += nl;
+		}
+		return;
+	}
+
+	TSNode *a, *b;
+	split(root, pos, a, b);
+	root = merge(merge(a, build(text, len)), b);
+	root->p = NULL;
+}
+
+void TextStore::erase(int pos, int len)
+{
+	len = std::min(len, size()-pos);
+	if(len <= 0) return;
+
+	// cheap path: the range lies within one chunk and does not empty it
+	int offs = pos;
+	TSNode *t = locate(offs);
+	if(t && offs + len <= (int)t->s.size() && len < (int)t->s.size()) {
+		int nl = std::count(t->s.begin()+offs, t->s.begin()+offs+len, '\n');
+		t->s.erase(offs, len);
+		t->nl -= nl;
+		for(TSNode *u = t; u; u = u->p) {
+			u->sum -= len;
+			u->sum_nl -= nl;
+		}
+		return;
+	}
+
+	TSNode *a, *b, *c;
+	split(root, pos, a, b);
+	split(b, len, b, c);
+	destroy(b);
+	root = merge(a, c);
+	if(root) root->p = NULL;
+}
+
+void TextStore::replace(int pos, int len, const char *text, int text_len)
+{
+	erase(pos, len);
+	insert(pos, text, text_len);
+}
+
+void TextStore::clear()
+{
+	destroy(root);
+	root = NULL;
+}
+
+int TextStore::line_of(int pos) const
+{
+	int line = 0;
+	TSNode *t = root;
+	while(t) {
+		int ls = sum(t->l);
+		if(pos < ls) {
+			t = t->l;
+			continue;
+		}
+		line += sum_nl(t->l);
+		pos -= ls;
+		if(pos < (int)t->s.size())
+			return line + std::count(t->s.begin(), t->s.begin()+pos, '\n');
+		line += t->nl;
+		pos -= t->s.size();
+		t = t->r;
+	}
+	return line;
+}
+
+int TextStore::line_start(int line) const
+{
+	if(line <= 0) return 0;
+
+	// find the line-th newline
+	int k = line, base = 0;
+	TSNode *t = root;
+	while(t) {
+		int lnl = sum_nl(t->l);
+		if(k <= lnl) {
+			t = t->l;
+			continue;
+		}
+		k -= lnl;
+		base += sum(t->l);
+		if(k <= t->nl) {
+			size_t i = std::string::npos;
+			while(k--) i = t->s.find('\n', i+1);
+			return base + i + 1;
+		}
+		k -= t->nl;
+		base += t->s.size();
+		t = t->r;
+	}
+	return size();
+}
+
+int TextStore::line_end(int line) const
+{
+	if(line+1 < line_count()) return line_start(line+1) - 1;
+	return size();
+}
+
+char TextStore::Reader::get() const
+{
+	return node ? node->s[offs] : 0;
+}
+
+void TextStore::Reader::next()
+{
+	if(!node) return;
+	if(++offs < (int)node->s.size()) return;
+
+	// step to the in-order successor
+	offs = 0;
+	const TSNode *n = node;
+	if(n->r) {
+		n = n->r;
+		while(n->l) n = n->l;
+	} else {
+		while(n->p && n == n->p->r) n = n->p;
+		n = n->p;
+	}
+	node = n;
+}
+
+void TextStore::Reader::advance(int n)
+{
+	while(n > 0 && node) {
+		int k = std::min(n, (int)node->s.size() - offs - 1);
+		offs += k;
+		n -= k;
+		if(n > 0) {
+			next();
+			--n;
+		}
+	}
+}
+
+int TextStore::Reader::peek(char *out, int max) const
+{
+	Reader r = *this;
+	int n = 0;
+	while(n < max && !r.done()) {
+		out[n++] = r.get();
+		r.next();
+	}
+	return n;
+}
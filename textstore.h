@@ -0,0 +1,58 @@
+#ifndef TEXTSTORE_H
+#define TEXTSTORE_H
+
+#include <string>
+
+/* Rope holding the document text. Text is kept in chunks of at most TS_CHUNK_MAX bytes, arranged in a
+ * treap ordered by position. Every node tracks the byte and newline counts of its subtree, so inserts,
+ * erases and offset <-> line conversions are O(log n) and there is no cap on the document size. */
+struct TextStore {
+	struct Node;
+
+	/* sequential reader over the text; stepping is O(1) amortised */
+	struct Reader {
+		const Node *node;
+		int offs; // offset inside node's chunk
+
+		bool done() const { return node==NULL; }
+		char get() const;
+		void next();
+		void advance(int n);
+		int peek(char *out, int max) const; // copy up to max bytes from here on without advancing
+	};
+
+	TextStore();
+	~TextStore();
+	TextStore(const TextStore&) = delete;
+	TextStore &operator=(const TextStore&) = delete;
+
+	int size() const;
+	int line_count() const;          // newlines + 1
+
+	char at(int pos) const;
+	void copy(int pos, int len, char *out) const;
+	std::string substr(int pos, int len) const;
+	std::string str() const;
+	Reader reader(int pos) const;
+
+	void insert(int pos, const char *text, int len);
+	void erase(int pos, int len);
+	void replace(int pos, int len, const char *text, int text_len);
+	void replace_tail(int pos, const char *text, int len) { replace(pos, size()-pos, text, len); }
+	void assign(const char *text, int len) { replace(0, size(), text, len); }
+	void clear();
+
+	int line_of(int pos) const;      // line containing byte offset pos
+	int line_start(int line) const;  // offset of the first byte of line
+	int line_end(int line) const;    // offset of the newline terminating line, or size()
+
+private:
+	Node *root;
+	unsigned rng;
+
+	Node *make_node(const char *text, int len);
+	Node *build(const char *text, int len);
+	Node *locate(int &pos) const;
+};
+
+#endif
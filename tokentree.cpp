@@ -1,7 +1,12 @@
 #include "tokentree.h"
+#include "tuning.h"
+#include "ggml-cpu.h"
 #include <set>
 #include <algorithm>
 #include <string.h>
+#include <atomic>
+#include <new>
+#include <condition_variable>
 
 void LLMBuffer::init()
 {
@@ -9,19 +14,16 @@ void LLMBuffer::init()
 	notify_invalidate = [](int,int) {};
 	notify_new_logit = [](int,int,float) {};
 	notify_new_predictions = []() {};
-	notify_change_tail = [](int, std::string) {};
+	notify_edit = [](int,int,int) {};
+	notify_work_done_async = []() {};
+	notify_model_loaded = []() {};
+	notify_logits = [](TTE*,const float*) {};
 	
 	/* init llama.cpp */
 	common_init();
 	
-	common_params params;
-	
-	params.n_gpu_layers = 99;
-
-	ggml_numa_strategy st;
-	
 	llama_backend_init();
-    llama_numa_init(params.numa);
+    llama_numa_init(numa);
 	
 	// prepare work thread
 	work_batch = llama_batch_init(512, 0, 1);
@@ -30,108 +32,647 @@ void LLMBuffer::init()
 	wq_head_invalid = false;
 	//work_done.connect(sigc::mem_fun(this,&LLMBuffer::on_work_done));
 	work_done_flag = false;
+	work_us = 0;
+	work_restore_us = work_end_us = work_capture_us = 0;
+	work_catchup = 0;
 
-	load_model("Qwen2.5-3B.Q4_K_M.gguf");
-	//load_model("Phi-3.5-mini-instruct-Q4_K_M.gguf");
+	// no model yet: the buffer works as a plain text store until load_model_async() delivers one
 }
 
-void LLMBuffer::load_model(const char *fn)
+/* load a model and create its context on a background thread, reporting progress in load_progress.
+ * CheckLoad() swaps them in on the UI thread once they are ready. */
+void LLMBuffer::load_model_async(const char *fn)
 {
-	llama_model_params model_params = llama_model_default_params();
+	if(load_thread) return; // one at a time
+
+	load_fn = fn;
+	load_error = "";
+	load_progress = 0.0f;
+	load_stage = "Loading";
+	load_done = false;
+	new_backend = NULL;
+	load_thread = new std::thread(
+	  [this]
+	  {
+		llama_model_params model_params = llama_model_default_params();
+
+		model_params.n_gpu_layers = llama_supports_gpu_offload() ? 99 : 0; // offload all layers to the GPU, if there is one
+		model_params.progress_callback = [](float progress, void *user_data) {
+			LLMBuffer *b = (LLMBuffer*)user_data;
+			// only wake the UI up when the progress bar visibly moves
+			if((int)(progress*100) != (int)(b->load_progress*100)) {
+				b->load_progress = progress;
+				b->notify_work_done_async();
+			}
+			return true;
+		};
+		model_params.progress_callback_user_data = this;
+		llama_model *new_model = llama_load_model_from_file(load_fn.c_str(), model_params);
 
-	model_params.n_gpu_layers = 99; // offload all layers to the GPU
-	llama_model *new_model = llama_load_model_from_file(fn, model_params);
+		if (new_model == NULL) {
+			fprintf(stderr , "%s: error: unable to load model\n" , __func__);
+			load_error = "Unable to load model.";
+		} else {
+			// initialize the context
+			llama_context_params new_ctx_params = llama_context_default_params();
 
-	if (new_model == NULL) {
-		fprintf(stderr , "%s: error: unable to load model\n" , __func__);
-		return;
+			// start small; grow_ctx() makes room as the document gets longer
+			new_ctx_params.n_ctx = std::min(ctx_min, llama_model_n_ctx_train(new_model));
+			new_ctx_params.n_batch = new_ctx_params.n_ctx;
+			
+			// thread counts and ubatch size as found fastest for this model on this machine, measuring them if need be
+			LLMTuning tuning;
+			std::string key = tuning_key(load_fn, model_params.n_gpu_layers);
+			if(!tuning_load(key, tuning)) {
+				load_stage = "Tuning";
+				load_progress = 0.0f;
+				tuning = tuning_probe(new_model, new_ctx_params, [this](float progress) {
+					load_progress = progress;
+					notify_work_done_async();
+				});
+				tuning_save(key, tuning);
+			}
+			tuning.apply(new_ctx_params);
+
+			llama_context *new_ctx = llama_new_context_with_model(new_model, new_ctx_params);
+
+			if (new_ctx == NULL) {
+				fprintf(stderr , "%s: error: failed to create the llama_context\n" , __func__);
+				load_error = "Failed to create the llama context.";
+				llama_model_free(new_model);
+			} else {
+				// get first-use costs out of the way before the user starts typing
+				load_stage = "Warming up";
+				notify_work_done_async();
+				warm_up(new_ctx);
+				new_backend = new LlamaBackend(new_model, new_ctx, new_ctx_params);
+				new_vocab_hash = vocab_fingerprint(new_backend);
+				new_disk_key = DiskKVCache::model_key(load_fn, new_ctx_params);
+			}
+		}
+		load_done = true;
+		notify_work_done_async();
+	  });
+}
+
+/* change thread counts and pinning. Takes effect before the next decode, as the worker may be busy now */
+void LLMBuffer::set_threads(int n_threads, int n_threads_batch, bool pin)
+{
+	this->n_threads = std::max(1, n_threads);
+	this->n_threads_batch = std::max(1, n_threads_batch);
+	pin_threads = pin;
+	threads_by_user = true;
+	threads_dirty = true;
+	apply_threads();
+}
+
+void LLMBuffer::apply_threads()
+{
+	if(!threads_dirty || !llama || is_working) return;
+	threads_dirty = false;
+	
+	free_threadpools();
+	if(!llama->ctx) return; // lost in a failed grow_ctx(); the next one to succeed comes back here
+	if(pin_threads) {
+		pool = threadpool_pinned(n_threads, ui_core);
+		pool_batch = threadpool_pinned(n_threads_batch, ui_core);
+		llama_attach_threadpool(llama->ctx, pool, pool_batch);
 	}
+	llama_set_n_threads(llama->ctx, n_threads, n_threads_batch);
+	pin_this_thread(pin_threads ? ui_core : -1); // we are on the render thread
+	printf("threads: %d single, %d batch%s\n", n_threads, n_threads_batch, pin_threads ? ", pinned" : "");
+}
+
+/* recreate the context with room for at least need positions, doubling the size so this stays rare.
+ * If that is more than there is memory for, gives up what degrade() can and tries again; failing
+ * that, sets work_error and returns false, possibly with no context left, which the next work to
+ * come along tries to get back by calling here again. */
+bool LLMBuffer::grow_ctx(int need)
+{
+	int n_train = backend->n_ctx_train();
+	int n_old = backend->n_ctx();
+	if(need > n_train) return false;
+	
+	int n = std::max(n_old, std::min(ctx_min, n_train));
+	while(n < need) n *= 2;
+	n = std::min(n, n_train);
+	
+	free_threadpools();
+	bool ok;
+	while(!(ok = backend->resize(n)) && degrade("Out of memory growing the context.")) {}
+	if(backend->n_ctx()) resize_batch();
+	printf("context: %d -> %d of %d trained positions\n", n_old, backend->n_ctx(), n_train);
+	ctx_state = NULL; // whatever happened, the context is a new, empty one, or none
+	threads_dirty = true;
+	apply_threads();
+	return ok && backend->n_ctx() >= need;
+}
+
+/* a catchup can span the whole window, so the work batch is as large as the context */
+void LLMBuffer::resize_batch()
+{
+	llama_batch_free(work_batch);
+	work_batch = llama_batch_init(backend->n_ctx(), 0, 1);
+}
 
-	std::string text;
+/* the window is shifted by whole strides, so every token sees at least window - stride tokens of left context */
+int LLMBuffer::window_size()
+{
+	int n_train = backend->n_ctx_train();
+	return (window > 0) ? std::min(window, n_train) : n_train;
+}
+
+int LLMBuffer::window_start(int depth)
+{
+	int w = window_size();
+	if(depth < w || !backend->can_shift()) return 0;
+	int stride = std::max(1, std::min(window_stride, w-1));
+	return ((depth - w) / stride + 1) * stride;
+}
 
-	// load succeeded, replace our model
-	if(model) {
-		// save text
-		text = render(&root);
+void LLMBuffer::free_threadpools()
+{
+	if(llama && llama->ctx) llama_detach_threadpool(llama->ctx);
+	if(pool) ggml_threadpool_free(pool);
+	if(pool_batch) ggml_threadpool_free(pool_batch);
+	pool = pool_batch = NULL;
+}
+
+bool LLMBuffer::is_loading()
+{
+	return load_thread != NULL;
+}
 
-		llama_model_free(model);
+/* if a background load has finished and the worker is idle, replace our model and context with the new ones */
+void LLMBuffer::CheckLoad()
+{
+	if(!load_thread || !load_done || is_working) return;
+
+	load_thread->join();
+	delete load_thread;
+	load_thread = NULL;
+
+	if(!new_backend) return; // load failed, load_error says why
+	LlamaBackend *l = new_backend;
+	new_backend = NULL;
+	
+	// tuned thread counts are per model; ones the user picked stay
+	if(!threads_by_user) {
+		n_threads = l->params.n_threads;
+		n_threads_batch = l->params.n_threads_batch;
 	}
-	model = new_model;
 
 	// gather basic metadata
-	model_fn = fn;
-	for(int i=0; i<llama_model_meta_count(model); i++) {
+	model_fn = load_fn;
+	model_arch = model_size = "";
+	for(int i=0; i<llama_model_meta_count(l->model); i++) {
 		char k_buf[256], v_buf[256];
-		llama_model_meta_key_by_index(model, i, k_buf, 256);
+		llama_model_meta_key_by_index(l->model, i, k_buf, 256);
 		if(!strcmp(k_buf, "general.architecture")) {
-			llama_model_meta_val_str_by_index(model, i, v_buf, 256);
+			llama_model_meta_val_str_by_index(l->model, i, v_buf, 256);
 			model_arch = v_buf;
 		} else if(!strcmp(k_buf, "general.size_label")) {
-			llama_model_meta_val_str_by_index(model, i, v_buf, 256);
+			llama_model_meta_val_str_by_index(l->model, i, v_buf, 256);
 			model_size = v_buf;
 		}
 	}
-	
 
-	vocab = llama_model_get_vocab(model);
-
-	// initialize the context
-	ctx_params = llama_context_default_params();
-
-	ctx_params.n_ctx = 2048;
+	set_backend(l, new_vocab_hash, new_disk_key);
+}
 
-	if(ctx) llama_free(ctx); //free old context?
-	ctx = llama_new_context_with_model(model, ctx_params);
+static bool tokenizes_in_pieces(LLMBackend *vocab); // see tokenize_par()
 
-	if (ctx == NULL) {
-		fprintf(stderr , "%s: error: failed to create the llama_context\n" , __func__);
-		exit(1);
-	}
+/* make b what the tree is scored with from now on, in place of whatever was before */
+void LLMBuffer::set_backend(LLMBackend *b, uint64_t new_vocab_hash, const std::string &disk_key)
+{
+	// nothing is running on the old context, so drop all work meant for it
+	wq.clear();
+	wq_head_invalid = false;
 
-	n_vocab = llama_vocab_n_tokens(vocab);
+	bool had_model = (backend != NULL);
+	free_threadpools();
+	delete backend;
+	backend = b;
+	llama = dynamic_cast<LlamaBackend*>(b);
+	threads_dirty = true;
+	apply_threads();
+
+	n_vocab = backend->n_vocab();
+	tokenize_chunked = tokenizes_in_pieces(backend);
+
+	// the old tree stays, as does everything explored in it; it only needs to be brought up to date
+	bool same_vocab = had_model && vocab_hash == new_vocab_hash;
+	vocab_hash = new_vocab_hash;
+	memo.clear(); // what the old model said is no use any more
+	if(kv_cache) kv_cache->clear(kv_key); // nor are the states it made, though other models' stay
+	static std::atomic<int> n_unnamed{0};
+	kv_key = disk_key.size() ? disk_key : "unnamed-" + std::to_string(++n_unnamed); // without a file to tell it by, it shares with nothing
+	disk_cache.open(disk_key);
+	disk_depth = 0;
+	retire(!same_vocab);
 
 	/* init root token */
-	root.clear_children();
 	root.base_pos=0;
 	root.depth=0;
 	root.is_accepted=true;
-	root.set_tok(llama_vocab_bos(vocab));
+	root.set_tok(backend->bos());
 	root.str="";
 	root.parent=NULL;
 	root.sel=0;
 	root.has_logit=false;
-	root.ctx_snapshot = std::shared_ptr<uint8_t[]>(new uint8_t[llama_get_state_size(ctx)]);
-	llama_copy_state_data(ctx,root.ctx_snapshot.get());
+	snapshot_size = backend->state_size();
+	root.ctx_snapshot = alloc_snapshot(); // without one, catchups from the root start from an empty context
+	if(root.ctx_snapshot) backend->get_state(root.ctx_snapshot.get());
+	root.snapshot_off = 0;
 	ctx_state=NULL;
+	resize_batch();
+
+	notify_model_loaded();
 
-	rebuild(&root, text, text.size());
+	if(!root.children.size()) {
+		// first model: the text store carries over whatever was typed in plain-text mode
+		rebuild(&root, doc.size());
+		return;
+	}
+	
+	// the live path is needed right away, so it can't wait to be naturalized
+	if(!same_vocab) naturalize(root.children[root.sel]);
+	live_stale = 0;
+	notify_invalidate(0, doc.size());
+	rescore();
+}
+
+/* a new model takes over the tree: its logits become stale and its snapshots useless, and predictions
+ * nobody is looking at go. If the vocabulary changed too, the tokens turn foreign and keep only their text.
+ * Walks the tree iteratively, as the live path can be far deeper than the call stack. */
+void LLMBuffer::retire(bool foreign)
+{
+	expand_all(&root); // what is still in a session file would come out unretired later
+	session = NULL;
+	std::vector<TTE*> todo(1, &root);
+	while(todo.size()) {
+		TTE *t = todo.back();
+		todo.pop_back();
+		
+		if(t != &root) {
+			t->stale = t->stale || t->has_logit;
+			t->has_logit = false;
+			t->ctx_snapshot.reset();
+			if(foreign) {
+				t->foreign = true;
+				t->tok = LLAMA_TOKEN_NULL;
+				t->update_hash();
+			}
+		}
+		for(int i=0; i<t->children.size(); ++i) {
+			// a selected prediction ends the live path, so it has to stay
+			if(!t->children[i]->is_accepted && i != t->sel) {
+				delete t->children[i];
+				t->children.erase(t->children.begin()+i);
+				if(t->sel > i) --t->sel;
+				--i;
+			} else {
+				todo.push_back(t->children[i]);
+			}
+		}
+	}
+	ctx_state = NULL;
+}
+
+/* snapshots are the bulk of our memory use, so they are where running out shows first */
+std::shared_ptr<uint8_t[]> LLMBuffer::alloc_snapshot(size_t size)
+{
+	if(!size) size = snapshot_size;
+	uint8_t *p = new (std::nothrow) uint8_t[size];
+	// the tree may be in the middle of being worked on, so only snapshots can go here, not nodes
+	if(!p && drop_cold(false)) p = new (std::nothrow) uint8_t[size];
+	if(!p) return NULL; // carry on without; catchups just get longer
+	snapshot_bytes += size;
+	++snapshot_count;
+	return std::shared_ptr<uint8_t[]>(p, [size](uint8_t *p) {
+		delete[] p;
+		snapshot_bytes -= size;
+		--snapshot_count;
+	});
+}
+
+/* every disk_cache.stride tokens of the scoring pass, write the state after t along with the
+ * scores up to its selected child, which the next session resumes from */
+void LLMBuffer::disk_store(TTE *t, std::shared_ptr<uint8_t[]> snap)
+{
+	if(abs(t->depth - disk_depth) < disk_cache.stride || !t->children.size()) return;
+	TTE *x = t->children[t->sel];
+	if(!x->is_accepted) return;
+	
+	std::vector<llama_token> toks;
+	if(!path_tokens(x, toks)) return;
+	std::vector<float> scores(2*toks.size(), 0.0f);
+	for(TTE *p = x; p != &root; p = p->parent) {
+		if(!p->has_logit || p->stale) return; // only whole stretches of scored text
+		scores[2*p->depth] = p->logit;
+		scores[2*p->depth+1] = p->max_logit;
+	}
+	
+	disk_depth = t->depth;
+	disk_cache.store(x->prefix_hash, toks, scores, snap, snapshot_size, ctx_off);
+}
+
+/* if the text below t was scored in an earlier session, take the scores of the deepest checkpoint
+ * along it, and its state for the prefix cache to pick up */
+void LLMBuffer::disk_restore(TTE *t)
+{
+	if(!reuse_scores) return;
+	TTE *best = NULL;
+	for(TTE *x = t; x->children.size(); ) {
+		x = x->children[x->sel];
+		if(!x->is_accepted || x->foreign) break;
+		if(disk_cache.has(x->prefix_hash)) best = x;
+	}
+	if(!best) return;
+	
+	std::vector<llama_token> toks;
+	std::vector<float> scores;
+	size_t size;
+	int off;
+	if(!path_tokens(best, toks)) return;
+	std::shared_ptr<uint8_t[]> state = disk_cache.load(best->prefix_hash, toks, scores, size, off);
+	if(!state) return;
+	printf("disk cache: resuming at %d\n", best->depth);
+	
+	for(TTE *x = best; x != t; x = x->parent) {
+		if(x->has_logit && !x->stale) continue;
+		x->logit = scores[2*x->depth];
+		x->max_logit = scores[2*x->depth+1];
+		x->has_logit = true;
+		x->stale = false;
+		notify_new_logit(x->base_pos, x->base_pos+x->str_size, x->logit - x->max_logit);
+	}
+	if(kv_cache) kv_cache->put(kv_key, toks.data(), toks.size()-1, state, size, off);
+	disk_depth = best->depth;
+}
+
+bool LLMBuffer::path_tokens(TTE *t, std::vector<llama_token> &out)
+{
+	out.resize(t->depth + 1);
+	for(; t; t = t->parent) {
+		if(t->foreign) return false;
+		out[t->depth] = t->tok;
+	}
+	return true;
+}
+
+void LLMBuffer::memo_put(TTE *t, const float *logits)
+{
+	notify_logits(t, logits); // every decode's logits come through here
+	if(t->foreign) return;
+	std::vector<llama_token> also;
+	for(TTE *c : t->children)
+		if(!c->foreign) also.push_back(c->tok);
+	memo.put(t->prefix_hash, logits, n_vocab, also);
+}
+
+/* give t its score from the memo if its prefix has been seen, as if it had just been decoded */
+bool LLMBuffer::memo_apply(TTE *t)
+{
+	if(!reuse_scores || t->foreign || !t->parent || !memo.get(t->parent->prefix_hash, t->tok, t->logit, t->max_logit)) return false;
+	t->has_logit = true;
+	t->stale = false;
+	if(t->is_accepted) notify_new_logit(t->base_pos, t->base_pos+t->str_size, t->logit - t->max_logit);
+	return true;
+}
+
+/* free what we can do without after a failed decode or allocation, cheapest loss first:
+ * snapshots and predictions away from the screen, then prediction depth. Returns false, and
+ * sets work_error, once there is nothing left to give up. */
+bool LLMBuffer::degrade(const char *why)
+{
+	int freed = drop_cold(true);
+	if(freed) {
+		printf("degrade: %s Dropped %d cold snapshots and predictions.\n", why, freed);
+		return true;
+	}
+	if(predict_main > 1 || predict_alt > 1) {
+		predict_main = std::max(1, predict_main/2);
+		predict_alt = std::max(1, predict_alt/2);
+		snapshot_freq *= 2;
+		printf("degrade: %s Now predicting %d/%d tokens, snapshots every %d.\n", why, predict_main, predict_alt, snapshot_freq);
+		return true;
+	}
+	work_error = why;
+	return false;
+}
+
+/* drop snapshots and, if prune, predictions that are not on screen. The root snapshot, the one closest
+ * above the screen on the live path and those on it are kept, so work near the cursor stays quick. */
+int LLMBuffer::drop_cold(bool prune)
+{
+	auto cold = [this](TTE *t) { return t->base_pos < view_from || t->base_pos > view_to; };
+	
+	std::set<TTE*> keep;
+	index_live();
+	TTE *above = NULL;
+	for(TTE *t : live) {
+		if(!t->ctx_snapshot) continue;
+		if(t->base_pos < view_from) above = t;
+		else if(!cold(t)) keep.insert(t);
+	}
+	if(above) keep.insert(above);
+	
+	int n = 0;
+	bool pruned = false;
+	std::vector<TTE*> todo(1, &root);
+	while(todo.size()) {
+		TTE *t = todo.back();
+		todo.pop_back();
+		
+		if(t != &root && t->ctx_snapshot && !keep.count(t)) {
+			t->ctx_snapshot.reset();
+			++n;
+		}
+		for(int i=0; i<t->children.size(); ++i) {
+			TTE *c = t->children[i];
+			if(prune && !c->is_accepted && i != t->sel && cold(c)) {
+				delete c;
+				t->children.erase(t->children.begin()+i);
+				if(t->sel > i) --t->sel;
+				--i;
+				++n;
+				pruned = true;
+			} else {
+				todo.push_back(c);
+			}
+		}
+	}
+	
+	if(kv_cache) n += kv_cache->evict(0);
+	
+	if(pruned) {
+		// prediction work may point into what was deleted; it will be asked for again where needed
+		for(auto i = wq.begin(); i != wq.end(); ) {
+			if(i->wl_type == WL_BRANCH || i->wl_type == WL_PREDICT) i = wq.erase(i);
+			else ++i;
+		}
+		ctx_state = NULL;
+	}
+	return n;
+}
+
+/* retokenize a foreign subtree with our vocabulary, now that it is about to become live.
+ * Only its selected path is converted; the alternatives branching off it are grafted back on
+ * where their text starts and stay foreign until they are selected themselves.
+ * Returns the node that replaced f in its parent. */
+TTE *LLMBuffer::naturalize(TTE *f)
+{
+	expand_all(f);
+	TTE *parent = f->parent;
+	int idx = std::find(parent->children.begin(), parent->children.end(), f) - parent->children.begin();
+	int base = f->base_pos;
+	
+	// take the selected path apart: accepted text, predicted text after it, and the alternatives along it
+	std::string text, pred;
+	std::vector<TTE*> path, alts;
+	for(TTE *t = f; t; ) {
+		TTE *next = t->children.size() ? t->children[t->sel] : NULL;
+		(t->is_accepted && !pred.size() ? text : pred) += t->str;
+		for(TTE *c : t->children) {
+			if(c == next) continue;
+			if(t->is_accepted) alts.push_back(c);
+			else delete c;
+		}
+		t->children.clear();
+		path.push_back(t);
+		t = next;
+	}
+	for(TTE *t : path) delete t; // children were taken out already, so this does not recurse
+	
+	printf("naturalize '%s' + '%s' at %d, %zu alternatives\n", text.c_str(), pred.c_str(), base, alts.size());
+	
+	// lay the new tokens down in place of f, hooking the alternatives back in as we pass them
+	std::vector<llama_token> toks = tokenize(text, false), pred_toks = tokenize(pred, false);
+	TTE *target = parent, *head = NULL;
+	size_t a = 0;
+	for(size_t i=0; i < toks.size()+pred_toks.size(); ++i) {
+		TTE *next = new TTE(this);
+		
+		if(target == parent) parent->children[idx] = next;
+		else {
+			target->children.push_back(next);
+			target->sel = 0;
+		}
+		
+		next->base_pos = target->base_pos + target->str_size;
+		next->depth = target->depth + 1;
+		next->parent = target;
+		next->is_accepted = (i < toks.size());
+		next->sel = 0;
+		next->has_logit = false;
+		next->set_tok(i < toks.size() ? toks[i] : pred_toks[i-toks.size()]);
+		if(!head) head = next;
+		
+		int end = next->base_pos + next->str_size;
+		for(; a < alts.size() && alts[a]->base_pos < end; ++a) {
+			int into = alts[a]->base_pos - next->base_pos;
+			graft(target, alts[a], text.substr(next->base_pos - base, into));
+		}
+		for(; a < alts.size() && alts[a]->base_pos == end; ++a)
+			graft(next, alts[a], "");
+		
+		target = next;
+	}
+	if(!head) {
+		// f had no text at all
+		parent->children.erase(parent->children.begin()+idx);
+		if(parent->sel > idx || parent->sel == parent->children.size()) --parent->sel;
+		if(parent->sel < 0) parent->sel = 0;
+	}
+	for(; a < alts.size(); ++a)
+		graft(target, alts[a], "");
+	
+	live_changed(parent);
+	return head;
+}
+
+/* hang the subtree sub off at as an unselected alternative. If sub starts partway into the
+ * text after at, the missing bit of text is bridged over with a foreign token. */
+void LLMBuffer::graft(TTE *at, TTE *sub, const std::string &bridge)
+{
+	live_changed(at); // if at had no children, sub becomes its selected one
+	if(bridge.size()) {
+		TTE *b = new TTE(this);
+		b->base_pos = at->base_pos + at->str_size;
+		b->depth = at->depth + 1;
+		b->parent = at;
+		b->is_accepted = true;
+		b->sel = 0;
+		b->has_logit = false;
+		b->foreign = true;
+		b->tok = LLAMA_TOKEN_NULL;
+		b->str = bridge;
+		b->str_size = bridge.size();
+		b->update_hash();
+		at->children.push_back(b);
+		at = b;
+		at->sel = 0;
+	}
+	at->children.push_back(sub);
+	sub->parent = at;
+	sub->reroot(at->depth + 1 - sub->depth, 0);
+}
+
+/* queue the tree for rescoring after a model swap: the live path first, since everything else
+ * hangs off it, then the explored alternatives along it, those on screen first */
+void LLMBuffer::rescore()
+{
+	enqueueWork(WL_SCORE, &root);
+	
+	index_live();
+	std::vector<TTE*> alts;
+	for(TTE *t : live) {
+		for(int i=0; i<t->children.size(); ++i) {
+			TTE *c = t->children[i];
+			// bare alternatives are scored along with the live token; only deeper branches need their own pass
+			if(i != t->sel && c->is_accepted && !c->foreign && c->children.size()) alts.push_back(c);
+		}
+	}
+	auto offscreen = [this](TTE *c) {
+		if(c->base_pos < view_from) return view_from - c->base_pos;
+		if(c->base_pos > view_to) return c->base_pos - view_to;
+		return 0;
+	};
+	std::stable_sort(alts.begin(), alts.end(), [&](TTE *a, TTE *b) { return offscreen(a) < offscreen(b); });
+	for(TTE *c : alts) enqueueWork(WL_SCORE, c);
 }
 
 void LLMBuffer::insert(int pos, std::string text)
 {
+	trace.put(TR_INSERT, pos, 0, text);
+	doc.insert(pos, text.data(), text.size());
+	if(!backend) return; // plain-text mode
+	
 	TTE *start = pos2wordent(pos);
-	std::string tail = render(start);
-	printf("pre-ins: '%s', '%s', %d\n", tail.c_str(), text.c_str(), pos - start->base_pos);
-	tail.insert(pos - start->base_pos, text);
-	printf("post-ins: '%s'\n", tail.c_str());
+	printf("ins: %zu bytes at %d, tail from %d\n", text.size(), pos, start->base_pos);
 	
-	rebuild(start, tail, pos+text.size(), text.size());
+	rebuild(start, pos+text.size(), text.size());
 }
 
 void LLMBuffer::erase(int from, int to)
 {
+	trace.put(TR_ERASE, from, to);
+	doc.erase(from, to - from);
+	if(!backend) return; // plain-text mode
+	
 	TTE *start = pos2wordent(from);
-	std::string tail = render(start);
-	tail.erase(from - start->base_pos, to - from);
 	
-	rebuild(start, tail, from, from - to);
+	rebuild(start, from, from - to);
 }
 
 /* given a buffer offset, get pointer to live token tree entry covering that offset */
 TTE *LLMBuffer::pos2ent(int pos)
 {
-	int offs=0;
-	TTE *cur = &root;
+	// the index takes us to the last token starting before pos; only past its end is there any walking
+	int i = std::max(live_find(pos) - 1, 0);
+	int offs=live_pos[i];
+	TTE *cur = live[i];
 	
 	while(cur == &root || offs<pos || !cur->str_size) {
 		offs+=cur->str_size;
@@ -147,8 +688,9 @@ TTE *LLMBuffer::pos2ent(int pos)
 /* given a buffer offset, get pointer to live token tree entry covering the first word before that offset */
 TTE *LLMBuffer::pos2wordent(int pos)
 {
-	int offs=0;
-	TTE *cur = &root;
+	int i = std::max(live_find(pos) - 1, 0);
+	int offs=live_pos[i];
+	TTE *cur = live[i];
 	
 	while(offs<pos) {
 		offs+=cur->str_size; 
@@ -169,48 +711,344 @@ pos2wordent_end:;
 	return cur;
 }
 
-/* convert live path from token tree entry to string */
-std::string LLMBuffer::render(TTE *tt, int max_tok, bool render_predictions)
+void LLMBuffer::live_changed(TTE *t)
+{
+	if(t->depth < std::min(live_stale, (int)live.size()) && live[t->depth] == t)
+		live_stale = t->depth + 1;
+}
+
+void LLMBuffer::live_cut(TTE *t)
+{
+	if(t->depth < std::min(live_stale, (int)live.size()) && live[t->depth] == t)
+		live_stale = t->depth;
+}
+
+/* bring the index up to date, walking on from the last entry that is known to be good */
+void LLMBuffer::index_live()
+{
+	if(live_stale == INT_MAX) return;
+	
+	int keep = std::min(live_stale, (int)live.size());
+	live.resize(keep);
+	live_pos.resize(keep);
+	live_stale = INT_MAX;
+	
+	int offs=0;
+	TTE *cur = &root;
+	if(keep) {
+		TTE *last = live.back();
+		if(!last->is_accepted || !last->children.size()) return;
+		offs = live_pos.back() + last->str_size;
+		cur = last->children[last->sel];
+	}
+	while(cur) {
+		expand(cur);
+		live.push_back(cur);
+		live_pos.push_back(offs);
+		if(!cur->is_accepted || !cur->children.size()) break;
+		offs+=cur->str_size;
+		cur=cur->children[cur->sel];
+	}
+}
+
+int LLMBuffer::live_find(int pos)
+{
+	index_live();
+	return std::lower_bound(live_pos.begin(), live_pos.end(), pos) - live_pos.begin();
+}
+
+/* hand the live path from tt on to f a token at a time, as far as render() would take it or until f
+ * returns false, without putting its text together */
+void LLMBuffer::render(TTE *tt, const std::function<bool(TTE*)> &f, int max_tok, bool render_predictions)
 {
-	std::string ret;
 	while(tt && max_tok && (render_predictions || tt->is_accepted)) {
-		ret += tt->str;
+		if(!f(tt)) return;
+		expand(tt);
 		tt = ((tt->children.size()>0)&&(tt->sel>=0))?(TTE*)tt->children[tt->sel]:NULL;
 		--max_tok;
 	}
+}
+
+/* convert live path from token tree entry to string */
+std::string LLMBuffer::render(TTE *tt, int max_tok, bool render_predictions)
+{
+	std::string ret;
+	render(tt, [&ret](TTE *t) { ret += t->str; return true; }, max_tok, render_predictions);
+	return ret;
+}
+
+/* whether the accepted path from tt on is what the document holds from tt's offset to its end */
+bool LLMBuffer::renders_as_doc(TTE *tt)
+{
+	TextStore::Reader r = doc.reader(tt->base_pos);
+	bool same = true;
+	render(tt, [&](TTE *t) {
+		for(char c : t->str) {
+			if(r.done() || r.get() != c) return same = false;
+			r.next();
+		}
+		return true;
+	}, INT_MAX);
+	return same && r.done();
+}
+
+static std::vector<llama_token> tokenize_raw(LLMBackend *vocab, const char *text, int len, bool add_special)
+{
+	std::vector<llama_token> toks(len + 2); // every token covers at least one byte, plus room for specials
+	int n = vocab->tokenize(text, len, toks.data(), toks.size(), add_special);
+	if(n < 0) {
+		toks.resize(-n);
+		n = vocab->tokenize(text, len, toks.data(), toks.size(), add_special);
+	}
+	toks.resize(n);
+	return toks;
+}
+
+static int piece_len(LLMBackend *vocab, llama_token t)
+{
+	char buf[128];
+	int n = vocab->token_to_piece(t, buf, sizeof(buf), true);
+	return n<0 ? -n : n;
+}
+
+/* whether text cut after a line break tokenizes the same in pieces as it does whole, on a few kinds of
+ * seams. Vocabularies that put a space in front of their input (SentencePiece with add_space_prefix)
+ * give every piece a token the whole text does not have, so no seam would ever check out and the
+ * parallel path would only be extra work; others that fail here would mostly fall back too. */
+static bool tokenizes_in_pieces(LLMBackend *vocab)
+{
+	static const char *probes[][2] = {
+		{ "\n", "A" },
+		{ "Hello world.\n", "The end." },
+		{ "One paragraph.\n\n", "Another one." },
+		{ "\tindented(x);\n", "    more(y);" },
+		{ "- item\n", "- item 2, \"quoted\"" },
+		{ "12.\r\n", "13." },
+		{ "caf\xc3\xa9\n\n\n", "\xc3\x9c" "ber" },
+	};
+	for(auto &p : probes) {
+		std::string a = p[0], b = p[1];
+		std::vector<llama_token> whole = tokenize_raw(vocab, (a+b).c_str(), a.size()+b.size(), false);
+		std::vector<llama_token> left = tokenize_raw(vocab, a.c_str(), a.size(), false);
+		std::vector<llama_token> right = tokenize_raw(vocab, b.c_str(), b.size(), false);
+		left.insert(left.end(), right.begin(), right.end());
+		if(left != whole) return false;
+	}
+	return true;
+}
+
+std::vector<llama_token> LLMBuffer::tokenize(const std::string &text, bool add_special)
+{
+	if((int)text.size() >= tokenize_par_min && tokenize_chunked)
+		return tokenize_par(text, add_special);
+	
+	return tokenize_raw(backend, text.c_str(), text.size(), add_special);
+}
+
+/* Threads that tokenize the chunks of large inputs, started on first use and then kept for the
+ * next one. Shared by all buffers, one input at a time. */
+struct ChunkPool {
+	std::vector<std::thread> threads;
+	std::mutex run_mtx, mtx;
+	std::condition_variable cv_work, cv_done;
+	std::function<void(int)> job;
+	int n_jobs = 0, next_job = 0, n_done = 0;
+	bool quit = false;
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> l(mtx);
+		for(;;) {
+			cv_work.wait(l, [&]() { return quit || next_job < n_jobs; });
+			if(quit) return;
+			int c = next_job++;
+			l.unlock();
+			job(c);
+			l.lock();
+			if(++n_done == n_jobs) cv_done.notify_all();
+		}
+	}
+
+	/* f(0) .. f(n-1), spread over the threads; returns when all are done */
+	void run(int n, std::function<void(int)> f)
+	{
+		std::lock_guard<std::mutex> r(run_mtx);
+		std::unique_lock<std::mutex> l(mtx);
+		if(threads.empty()) {
+			int n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+			for(int i=0; i<n_threads; ++i) threads.emplace_back(&ChunkPool::worker, this);
+		}
+		job = f;
+		n_jobs = n;
+		next_job = n_done = 0;
+		cv_work.notify_all();
+		cv_done.wait(l, [&]() { return n_done == n_jobs; });
+		n_jobs = next_job = 0;
+		job = nullptr;
+	}
+
+	~ChunkPool()
+	{
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			quit = true;
+		}
+		cv_work.notify_all();
+		for(auto &t : threads) t.join();
+	}
+};
+
+static ChunkPool chunk_pool;
+
+/* tokenize a large input by cutting it at line breaks, tokenizing the pieces on all cores and then
+ * stitching the seams back together. A seam is retokenized in a window of whole tokens around it, and
+ * the result is only taken if the window agrees with the pieces on TOKENIZE_SEAM_CHECK tokens at either
+ * end, so whatever the seam changed is inside it; otherwise the window is widened, and if that does
+ * not help either, the whole input is tokenized in one call. */
+#define TOKENIZE_SEAM_CHECK 4
+
+std::vector<llama_token> LLMBuffer::tokenize_par(const std::string &text, bool add_special)
+{
+	// cut near every tokenize_chunk bytes, preferring paragraph breaks over plain newlines
+	std::vector<size_t> cuts;
+	cuts.push_back(0);
+	size_t next = tokenize_chunk;
+	while(next < text.size()) {
+		size_t lim = std::min(text.size(), next + tokenize_chunk/2);
+		size_t p = text.find("\n\n", next);
+		if(p == std::string::npos || p >= lim) p = text.find('\n', next);
+		if(p == std::string::npos || p >= lim) {
+			// no break close by, just let this chunk grow
+			next = lim;
+			continue;
+		}
+		// cut after the entire run of line breaks, so it stays in one pretoken
+		while(p < text.size() && (text[p]=='\n' || text[p]=='\r')) ++p;
+		// and leave no stub of a last chunk, which might be too short to check its seam on
+		if(text.size() - p < (size_t)tokenize_chunk/2) break;
+		cuts.push_back(p);
+		next = p + tokenize_chunk;
+	}
+	cuts.push_back(text.size());
+	
+	int n_chunks = cuts.size()-1;
+	if(n_chunks < 2)
+		return tokenize_raw(backend, text.c_str(), text.size(), add_special);
+	
+	std::vector<std::vector<llama_token> > parts(n_chunks);
+	chunk_pool.run(n_chunks, [&](int c) {
+		parts[c] = tokenize_raw(backend, text.c_str()+cuts[c], cuts[c+1]-cuts[c], add_special && c==0);
+	});
+	
+	const int k = TOKENIZE_SEAM_CHECK;
+	std::vector<llama_token> ret = std::move(parts[0]);
+	int n_lead = (add_special && ret.size() && ret[0]==backend->bos()) ? 1 : 0;
+	for(int c=1; c<n_chunks; ++c) {
+		std::vector<llama_token> &right = parts[c];
+		size_t cut = cuts[c];
+		bool stitched = false;
+		for(int w=32; w<=4096 && !stitched; w*=4) {
+			// whole tokens covering at least w bytes, and twice the tokens checked, on either side
+			int nl=0, ll=0, nr=0, lr=0;
+			while((ll < w || nl < 2*k) && nl < (int)ret.size()-n_lead) ll += piece_len(backend, ret[ret.size()-1 - nl++]);
+			while((lr < w || nr < 2*k) && nr < (int)right.size()) lr += piece_len(backend, right[nr++]);
+			if(nl < 2*k || nr < 2*k) break; // too little to check against
+			
+			std::vector<llama_token> win = tokenize_raw(backend, text.c_str()+cut-ll, ll+lr, false);
+			if((int)win.size() < 2*k) continue;
+			bool agree = true;
+			for(int i=0; i<k && agree; ++i)
+				agree = win[i] == ret[ret.size()-nl+i] && win[win.size()-k+i] == right[nr-k+i];
+			if(agree) {
+				ret.resize(ret.size()-nl);
+				ret.insert(ret.end(), win.begin(), win.end());
+				ret.insert(ret.end(), right.begin()+nr, right.end());
+				stitched = true;
+			}
+		}
+		if(!stitched) {
+			printf("tokenize_par: seam at %zu did not check out, tokenizing in one go\n", cut);
+			return tokenize_raw(backend, text.c_str(), text.size(), add_special);
+		}
+	}
+	
 	return ret;
 }
 
-void LLMBuffer::rebuild(TTE *start, std::string text, int change_end, int reconcile_offset)
+/* the tokens rebuild() needs from start on: the document is tokenized from start's offset to a little
+ * past change_end, and further, twice as far each time, until the new tokens line up with the old
+ * ones again. That is found the way rebuild() goes about it, so the tokens end with the one it hooks
+ * the rest of the old tree in at; if they never line up, they go to the end of the document. Only
+ * tokens that end some way before the end of the text tokenized count, as the last few might come out
+ * differently with the text after them. */
+std::vector<llama_token> LLMBuffer::retokenize(TTE *start, int change_end, int reconcile_offset)
 {
-	const int n_tokens = -llama_tokenize(vocab, text.c_str(), text.size(), NULL, 0, start->tok==llama_vocab_bos(vocab), true);
-	std::vector<llama_token> tokens_list(n_tokens);
-	llama_tokenize(vocab, text.c_str(), text.size(), tokens_list.data(), tokens_list.size(), start->tok==llama_vocab_bos(vocab), true);
+	int from = start->base_pos;
+	bool special = start->tok==backend->bos();
+	auto next_old = [](TTE *t) -> TTE* {
+		if(!t->children.size()) return NULL;
+		t = t->children[t->sel];
+		return t->is_accepted ? t : NULL;
+	};
 	
-	if(start->tok==llama_vocab_bos(vocab) && (tokens_list.size()>=1 && tokens_list[0]!=llama_vocab_bos(vocab))) {
-		tokens_list.insert(tokens_list.begin(),llama_vocab_bos(vocab));
+	for(int len = std::max(change_end - from, 0) + retokenize_ahead; ; len *= 2) {
+		int end = (len >= doc.size() - from) ? doc.size() : from + len;
+		std::vector<llama_token> toks = tokenize(doc.substr(from, end - from), special);
+		if(special && (toks.size()>=1 && toks[0]!=backend->bos())) {
+			toks.insert(toks.begin(),backend->bos());
+		}
+		if(end == doc.size()) return toks;
+		
+		int n = toks.size();
+		for(int held = 0; n > 0 && held < retokenize_ahead/4; ) held += piece_len(backend, toks[--n]);
+		
+		// matching tokens at the beginning stay as they are
+		TTE *old = start;
+		int i = 0, offs = from;
+		while(i < n && old && toks[i] == old->tok) {
+			offs = old->base_pos + old->str_size;
+			old = next_old(old);
+			++i;
+		}
+		// after that, the old tree takes over again where a token and its offset agree
+		for(; i < n; ++i) {
+			if(old && old->tok == toks[i] && offs >= change_end && old->base_pos + reconcile_offset == offs) {
+				toks.resize(i+1);
+				return toks;
+			}
+			offs += piece_len(backend, toks[i]);
+			while(old && old->base_pos + reconcile_offset < offs) old = next_old(old);
+		}
 	}
+}
+
+void LLMBuffer::rebuild(TTE *start, int change_end, int reconcile_offset)
+{
+	std::vector<llama_token> tokens_list = retokenize(start, change_end, reconcile_offset);
 	
 	purgeWork(start->depth);
-	notify_invalidate(start->base_pos, start->base_pos + text.size());
+	notify_invalidate(start->base_pos, doc.size());
+	live_changed(start->parent ? start->parent : start);
 	
 	if(!tokens_list.size()) {
-		// complete deletion
+		// complete deletion: nothing is left after start's parent, so nothing accepted can hang off it
 		if(start->parent) {
-			for(auto i = start->parent->children.begin(); i!=start->parent->children.end(); ++i) {
-				if((*i)==start) {
-					start->parent->children.erase(i);
-					delete *i;
-					return;
+			TTE *p = start->parent;
+			for(int i=0; i<(int)p->children.size(); ++i) {
+				if(p->children[i] == start || p->children[i]->is_accepted) {
+					delete p->children[i];
+					p->children.erase(p->children.begin()+i);
+					--i;
 				}
 			}
+			p->sel = 0;
+			return;
 		}
 	}
 	
 	TTE *rebuild_root = start->parent?start->parent:start;
 	
-	printf("rebuild '%s'\n", text.c_str());
-
+	printf("rebuild %zu tokens from %d\n", tokens_list.size(), start->base_pos);
 
 	TTE *target_p=rebuild_root, *old_p=start;
 	size_t source_i=0;
@@ -264,6 +1102,7 @@ void LLMBuffer::rebuild(TTE *start, std::string text, int change_end, int reconc
 		next->sel = 0;
 		next->has_logit = false;
 		next->set_tok (tokens_list[source_i]);
+		memo_apply(next);
 		++source_i;
 		target_p = next;
 
@@ -299,60 +1138,118 @@ rebuild_linked:;
 	enqueueWork(WL_SCORE, rebuild_root);
 }
 
-bool validate_utf8(const char *str, int len) {
-    int n;
-    for (int i = 0; i < len; ++i) {
-        unsigned char c = (unsigned char) str[i];
-        if (0x00 <= c && c <= 0x7f) {
-            n=0; // 0bbbbbbb
-        } else if ((c & 0xE0) == 0xC0) {
-            n=1; // 110bbbbb
-        } else if ( c==0xed && i<(len-1) && ((unsigned char)str[i+1] & 0xa0)==0xa0) {
-            return false; //U+d800 to U+dfff
-        } else if ((c & 0xF0) == 0xE0) {
-            n=2; // 1110bbbb
-        } else if ((c & 0xF8) == 0xF0) {
-            n=3; // 11110bbb
-        } else {
-            return false;
-        }
-
-        for (int j = 0; j < n && i < len; ++j) { // n bytes matching 10bbbbbb?
-            if ((++i == len) || (( (unsigned char)str[i] & 0xC0) != 0x80)) {
-                return false;
-            }
-        }
-    }
-    return true;
-}
+/* incremental UTF-8 validator, so text can be checked one token at a time as it is appended */
+struct utf8_check {
+	int need = 0;        // continuation bytes still expected
+	bool after_ed = false; // lead byte was 0xED, so the next byte must not start a surrogate
+	bool bad = false;
+
+	void feed(const char *str, int len) {
+		for (int i = 0; i < len && !bad; ++i) {
+			unsigned char c = (unsigned char) str[i];
+			if (need) {
+				if ((c & 0xC0) != 0x80 || (after_ed && (c & 0xa0) == 0xa0)) {
+					bad = true; // not 10bbbbbb, or U+d800 to U+dfff
+				}
+				after_ed = false;
+				--need;
+			} else if (c <= 0x7f) {
+				// 0bbbbbbb
+			} else if ((c & 0xE0) == 0xC0) {
+				need=1; // 110bbbbb
+			} else if ((c & 0xF0) == 0xE0) {
+				need=2; // 1110bbbb
+				after_ed = (c == 0xed);
+			} else if ((c & 0xF8) == 0xF0) {
+				need=3; // 11110bbb
+			} else {
+				bad = true;
+			}
+		}
+	}
+	bool complete() const { return !bad && !need; }
+};
 
 void LLMBuffer::actualize(TTE *start)
 {
-	std::string txt = render(start);
+	/* walk the new live path from start, validating each token's bytes as they come in, and comparing them
+	 * with the document for as long as they agree. Only the part that differs is ever put together. */
+	int base = start->base_pos;
+	int old_len = doc.size() - base;
+	utf8_check utf8;
+	TTE *pos = NULL;
+	int len = 0, pre = 0;
+	TTE *diff = NULL; // token of the first byte that differs,
+	int diff_off = 0; // and where in it
+	TextStore::Reader r = doc.reader(base);
+	auto take = [&](TTE *t) {
+		utf8.feed(t->str.data(), t->str.size());
+		for(int i=0; i<(int)t->str.size() && !diff; ++i) {
+			if(r.done() || r.get() != t->str[i]) {
+				diff = t;
+				diff_off = i;
+			} else {
+				r.next();
+				++pre;
+			}
+		}
+		len += t->str.size();
+		pos = t;
+	};
+	for(TTE *t = start; t && t->is_accepted; t = ((t->children.size()>0)&&(t->sel>=0))?t->children[t->sel]:NULL) {
+		expand(t);
+		take(t);
+	}
 	/* leap over token to get valid UTF-8 */
-	if(!validate_utf8(txt.c_str(),txt.length())) {
+	if(!utf8.complete()) {
 		printf("utf-8 leap\n");
-		TTE *pos = start;
-		while(pos->children.size()>0 && pos->children[pos->sel]->is_accepted) pos=pos->children[pos->sel];
-		
-		auto extend = [&pos,&txt,&start,this](){ 
-			if(pos->children.size()>0 && !pos->children[pos->sel]->is_accepted) {
-				pos->children[pos->sel]->is_accepted=true;
-				pos=pos->children[pos->sel];
-				txt = render(start);
-				return true;
-			}
-			return false;
-		};
-			
-		while(extend() && !validate_utf8(txt.c_str(),txt.length()));
-		if(!validate_utf8(txt.c_str(),txt.length())) {
+		while(!utf8.bad && !utf8.complete() && pos->children.size()>0 && !pos->children[pos->sel]->is_accepted) {
+			TTE *next = pos->children[pos->sel];
+			expand(next);
+			next->is_accepted = true;
+			take(next);
+		}
+		if(!utf8.complete()) {
 			start->is_accepted=false;
-			txt="";
+			pos = diff = NULL;
+			len = pre = 0;
 		}
 	}
-	printf("actualize %lX, %d, '%s'\n", start, start->base_pos, txt.c_str());
-	notify_change_tail(start->base_pos, txt);
+
+	/* then from the back, reading the document a block at a time */
+	int common = std::min(old_len, len);
+	int suf = 0;
+	char blk[256];
+	int blk_from = base + old_len, blk_n = 0; // blk holds the document from blk_from on, its first blk_n bytes not compared yet
+	bool same = true;
+	for(TTE *t = pos; t && same && suf < common - pre; t = (t == start) ? NULL : t->parent) {
+		for(int i = (int)t->str.size()-1; i >= 0 && suf < common - pre; --i) {
+			if(!blk_n) {
+				blk_n = std::min((int)sizeof(blk), blk_from - base);
+				blk_from -= blk_n;
+				doc.copy(blk_from, blk_n, blk);
+			}
+			if(blk[--blk_n] != t->str[i]) {
+				same = false;
+				break;
+			}
+			++suf;
+		}
+	}
+	int removed = old_len - pre - suf;
+	int inserted = len - pre - suf;
+	std::string ins;
+	for(TTE *t = diff; t && (int)ins.size() < inserted; t = ((t->children.size()>0)&&(t->sel>=0))?t->children[t->sel]:NULL) {
+		ins.append(t->str, diff_off, inserted - ins.size());
+		diff_off = 0;
+	}
+
+	live_changed(start->parent ? start->parent : start);
+	printf("actualize %lX, %d: -%d +%d at %d\n", start, base, removed, inserted, base + pre);
+	if(removed || inserted) {
+		doc.replace(base + pre, removed, ins.data(), inserted);
+		notify_edit(base + pre, removed, inserted);
+	}
 	while(start && start->is_accepted)
 	{
 		if(start->has_logit)
@@ -366,8 +1263,9 @@ void LLMBuffer::actualize(TTE *start)
 /* add workload to be executed after everything else */
 void LLMBuffer::enqueueWork(workload_type t, TTE *target, int gen_extra)
 {
+	if(target->foreign) return; // tokens from another vocabulary can't be run until they are naturalized
 	printf("enqueue from '%s'@%d (+%d)\n", target->str.c_str(), target->depth, target->base_pos);
-	wq.push_back( TTWorkload { t, target->base_pos, target->base_pos + target->str_size, target->depth, target, gen_extra } );
+	wq.push_back( TTWorkload { t, target->base_pos, target->base_pos + target->str_size, target->depth, target, gen_extra, ggml_time_us() } );
 	
 	try_start_working();
 }
@@ -375,10 +1273,11 @@ void LLMBuffer::enqueueWork(workload_type t, TTE *target, int gen_extra)
 /* add workload to be executed ASAP */
 void LLMBuffer::injectWork(workload_type t, TTE *target, int gen_extra)
 {
+	if(target->foreign) return;
 	//printf("inject from '%s'\n", target->str.c_str());
 	
-	if(!is_working) wq.push_front( TTWorkload { t, target->base_pos, target->base_pos + target->str_size, target->depth, target, gen_extra } );
-	else wq.insert( ++wq.begin(), TTWorkload { t, target->base_pos, target->base_pos + target->str_size, target->depth, target, gen_extra } );
+	if(!is_working) wq.push_front( TTWorkload { t, target->base_pos, target->base_pos + target->str_size, target->depth, target, gen_extra, ggml_time_us() } );
+	else wq.insert( ++wq.begin(), TTWorkload { t, target->base_pos, target->base_pos + target->str_size, target->depth, target, gen_extra, ggml_time_us() } );
 	
 	try_start_working();
 }
@@ -424,20 +1323,89 @@ void LLMBuffer::CheckWork()
 {
 	if(work_done_flag) {
 		work_done_flag = false;
-		on_work_done();
+		// if a new model is about to replace this one, the result is of no use
+		if(load_done && new_backend) is_working = false;
+		else on_work_done();
 	}
+	if(session_pending.size() && !is_working) {
+		std::string fn = session_pending;
+		session_pending = "";
+		load_session(fn);
+	}
+	CheckLoad();
 }
 
+/* results of a decode are in: apply them, and note down where the time went */
 void LLMBuffer::on_work_done()
+{
+	if(!llm_state_changed) {
+		// nothing was decoded, the head of the queue was just skipped
+		apply_work();
+		return;
+	}
+	
+	// whatever gets started from in here has a record of its own, so take this one aside
+	WorkRecord rec = work_rec;
+	int64_t t0 = ggml_time_us(), nested = prof_nested_us;
+	rec.failed = (work_rc != 0);
+	rec.restore_ms = work_restore_us / 1e3f;
+	rec.decode_ms = work_us / 1e3f;
+	rec.pickup_ms = (t0 - work_end_us) / 1e3f;
+	work_capture_us = 0;
+	
+	apply_work();
+	
+	rec.t_end = ggml_time_us();
+	rec.capture_ms = work_capture_us / 1e3f;
+	rec.post_ms = (rec.t_end - t0 - (prof_nested_us - nested) - work_capture_us) / 1e3f;
+	prof.add(rec);
+}
+
+void LLMBuffer::apply_work()
 {
 	is_working=false;
 	
+	if(work_us > 0) {
+		float tps = work_batch.n_tokens * 1e6f / work_us;
+		float &avg = (work_batch.n_tokens == 1) ? tps_single : tps_batch;
+		avg = avg ? 0.8f*avg + 0.2f*tps : tps;
+		work_us = 0;
+	}
+	
+	if(llm_state_changed && work_rc) {
+		// 1: no room in the KV cache for the batch; <0: the backend failed, most likely allocating its buffers
+		fprintf(stderr, "%s: decode of %d tokens failed (%d)\n", __func__, work_batch.n_tokens, work_rc);
+		ctx_state = NULL; // whatever made it into the cache is not a state we know
+		// a full cache may just be fragmented, so the first time it is worth trying again from a snapshot
+		if((work_rc == 1 && !decode_failures++) || degrade(work_rc == 1 ? "Out of context space." : "Decoding failed, probably out of memory.")) {
+			// try the same work again with what was freed; the head may have been a pruned prediction
+			wq_head_invalid = false;
+		} else {
+			wq_head_invalid = true;
+		}
+		try_start_working();
+		return;
+	}
+	if(llm_state_changed) {
+		decode_failures = 0;
+		work_error = "";
+	}
+	
 	if(!wq_head_invalid) {
 		std::shared_ptr<uint8_t[]> snap;
 		if(llm_state_changed && ((work_base->depth%snapshot_freq)+work_batch.n_tokens)>=snapshot_freq)  {
-			snap = std::shared_ptr<uint8_t[]>(new uint8_t[llama_get_state_size(ctx)]);
-			size_t copied = llama_copy_state_data(ctx,snap.get());
-			printf("snap (%zu/%zu bytes), as work base is at %d and processed %d extra tokens.\n", copied, llama_get_state_size(ctx), work_base->depth, work_batch.n_tokens);
+			int64_t t0 = ggml_time_us();
+			snapshot_size = backend->state_size();
+			snap = alloc_snapshot();
+			if(snap) {
+				size_t copied = backend->get_state(snap.get());
+				printf("snap (%zu/%zu bytes), as work base is at %d and processed %d extra tokens.\n", copied, snapshot_size, work_base->depth, work_batch.n_tokens);
+				
+				std::vector<llama_token> path;
+				if(kv_cache && ctx_state && path_tokens(ctx_state, path))
+					kv_cache->put(kv_key, path.data(), path.size(), snap, snapshot_size, ctx_off);
+			}
+			work_capture_us = ggml_time_us() - t0;
 		}
 		
 		switch(wq.front().wl_type) {
@@ -461,8 +1429,9 @@ void LLMBuffer::on_work_done()
 				break;
 			}
 
-			float *logits = llama_get_logits_ith(ctx, work_batch.n_tokens - 1);
+			float *logits = backend->logits(work_batch.n_tokens - 1);
 			float max_logit = *std::max_element(logits, logits+n_vocab);
+			memo_put(t, logits);
 						
 			wq.pop_front();
 			wq_head_invalid=false;
@@ -474,11 +1443,13 @@ void LLMBuffer::on_work_done()
 			
 			for(int i=0;i<t->children.size();++i) {
 				auto &tt = *t->children[i];
-				if (!tt.has_logit) {
+				if (!tt.has_logit && !tt.foreign) {
 					tt.logit = logits[tt.tok];
 					tt.max_logit = max_logit;
 					tt.has_logit = true;
+					tt.stale = false;
 					tt.ctx_snapshot = snap;
+					tt.snapshot_off = ctx_off;
 			
 					printf("'%s' (%d) at %d get new logit %.2f\n", tt.str.c_str(), tt.tok, tt.depth, tt.logit);
 					fflush(stdout);
@@ -486,10 +1457,20 @@ void LLMBuffer::on_work_done()
 					if(t->sel == i && tt.is_accepted) {
 						notify_new_logit(tt.base_pos, tt.base_pos+tt.str_size, tt.logit - tt.max_logit);
 						
-						injectWork(WL_SCORE, &tt, gen_extra);
+						// take up to score_batch tokens of the accepted text in the next decode, as long as
+						// the window does not move in between, so they see what they would one at a time
+						TTE *next = &tt;
+						int off = window_start(tt.depth);
+						for(int k=1; k<score_batch && next->children.size(); ++k) {
+							TTE *c = next->children[next->sel];
+							if(!c->is_accepted || c->foreign || !c->children.size() || window_start(c->depth) != off) break;
+							next = c;
+						}
+						injectWork(WL_SCORE, next, gen_extra);
 					} 
 				}
 			}
+			if(snap) disk_store(t, snap);
 			break;
 			}
 		case WL_PREDICT: {
@@ -510,7 +1491,8 @@ void LLMBuffer::on_work_done()
 			// render any new logits we generated
 			renderLogitsFromBatch(work_base, work_batch.n_tokens-1, &work_batch);
 			
-			float *logits = llama_get_logits_ith(ctx, work_batch.n_tokens - 1);
+			float *logits = backend->logits(work_batch.n_tokens - 1);
+			memo_put(t, logits);
 			
 			float l_max=-999.9; int i_max=0;
 			for(int i=0;i<n_vocab;++i) {
@@ -522,6 +1504,7 @@ void LLMBuffer::on_work_done()
 			
 			t->children.push_back(new TTE(this));
 			t->sel=0;
+			live_changed(t);
 			TTE *next = t->children[0];
 			next->base_pos = t->base_pos + t->str_size;
 			next->depth = t->depth + 1;
@@ -533,6 +1516,7 @@ void LLMBuffer::on_work_done()
 			next->has_logit = true;
 			next->sel = 0;
 			next->ctx_snapshot = snap;
+			next->snapshot_off = ctx_off;
 			
 			printf("new pred: '%s' (%d) at %d with logit %.2f\n", next->str.c_str(), next->tok, next->depth, next->logit);
 			/* if(next->tok == 362) {
@@ -568,7 +1552,7 @@ void LLMBuffer::on_work_done()
 			// render any new logits we generated
 			renderLogitsFromBatch(work_base, work_batch.n_tokens-1, &work_batch);
 			
-			float *logits = llama_get_logits_ith(ctx, work_batch.n_tokens - 1);
+			float *logits = backend->logits(work_batch.n_tokens - 1);
 			float max_logit = *std::max_element(logits, logits+n_vocab);
 			
 			std::set<int> exclude;
@@ -585,6 +1569,7 @@ void LLMBuffer::on_work_done()
 				}
 				
 				t->children.push_back(new TTE(this));
+				live_changed(t);
 				TTE *next = t->children[t->children.size()-1];
 				next->base_pos = t->base_pos + t->str_size;
 				next->depth = t->depth + 1;
@@ -596,6 +1581,7 @@ void LLMBuffer::on_work_done()
 				next->has_logit = true;
 				next->sel = 0;
 				next->ctx_snapshot = snap;
+				next->snapshot_off = ctx_off;
 				
 				printf("new branch: '%s' (%d) at %d with logit %.2f\n", next->str.c_str(), next->tok, next->depth, next->logit);
 				/*if(next->tok == 3555) {
@@ -604,6 +1590,7 @@ void LLMBuffer::on_work_done()
 				
 				exclude.insert(i_max);
 			}
+			memo_put(t, logits);
 			
 			notify_new_predictions();
 			
@@ -629,7 +1616,7 @@ void LLMBuffer::on_work_done()
 
 void LLMBuffer::try_start_working()
 {
-	if(is_working) return;
+	if(is_working || session_pending.size()) return;
 	
 	llm_state_changed = false;
 	
@@ -641,6 +1628,10 @@ void LLMBuffer::try_start_working()
 	if(wq.size()) {
 		// may not need to rerun the LLM if we are in predict mode
 		auto &wl = wq.front();
+		expand(wl.target);
+		
+		// a catchup in the scoring pass may be spared by an earlier session's work
+		if(wl.wl_type == WL_SCORE && (!ctx_state || ctx_state != wl.target->parent)) disk_restore(wl.target);
 		
 		if(    ( wl.wl_type == WL_PREDICT && wl.target->children.size()>0 )
 			|| ( wl.wl_type == WL_BRANCH  && wl.target->children.size()>(wq.front().target->sel+1) )
@@ -650,8 +1641,35 @@ void LLMBuffer::try_start_working()
 			return;
 		}
 		
+		// positions are tree depths, less the window start, so the context has to reach that far
+		int need = wl.target->depth - window_start(wl.target->depth) + 1;
+		if(need > backend->n_ctx()) {
+			// what degrade() gives up in there may be the prediction this work was for, and the work with it
+			TTE *target = wl.target;
+			workload_type type = wl.wl_type;
+			bool grown = grow_ctx(need);
+			bool head_gone = wq.empty() || wq.front().target != target || wq.front().wl_type != type;
+			if(!grown && !head_gone) {
+				printf("'%s' at %d does not fit in the context, dropping\n", target->str.c_str(), target->depth);
+				wq.pop_front();
+			}
+			if(!grown || head_gone) {
+				try_start_working();
+				return;
+			}
+		}
+		
 		//printf("making batch for: type %d, target: '%s' (%d) at %d (+%d)\n", wl.wl_type, wl.target->str.c_str(), wl.target->tok, wl.target->depth, wl.target->base_pos);
+		int64_t t0 = ggml_time_us();
 		std::shared_ptr<uint8_t[]> p = prepareBatch(&wq.front());
+		int64_t t1 = ggml_time_us();
+		prof_nested_us += t1 - t0;
+		work_rec = WorkRecord();
+		work_rec.type = wl.wl_type;
+		work_rec.n_tokens = work_batch.n_tokens;
+		work_rec.catchup = work_catchup;
+		work_rec.wait_ms = (t0 - wl.t_queued) / 1e3f;
+		work_rec.prepare_ms = (t1 - t0) / 1e3f;
 
 		/*if(!work_batch.n_tokens) {
 			//empty batch??
@@ -660,15 +1678,27 @@ void LLMBuffer::try_start_working()
 			return;
 		}*/
 
+		apply_threads();
+		
 		is_working = true;
+		int shift = work_shift;
+		bool clear = work_clear;
 		wthread = new std::thread(
-		  [this,p]
+		  [this,p,shift,clear]
 		  {
-			if(p) llama_set_state_data(ctx,p.get());
-			llama_decode(ctx, work_batch);
+			int64_t t0 = ggml_time_us();
+			if(p) backend->set_state(p.get());
+			if(clear) backend->clear();
+			if(shift) backend->shift(shift);
+			int64_t t1 = ggml_time_us();
+			work_rc = backend->decode(work_batch);
+			work_end_us = ggml_time_us();
+			work_restore_us = t1 - t0;
+			work_us = work_end_us - t1;
 			llm_state_changed = true;
 			//work_done.emit();
 			work_done_flag = true;
+			notify_work_done_async(); // wake up the UI thread so it picks this up in CheckWork
 		  });
 	}
 }
@@ -680,12 +1710,14 @@ void LLMBuffer::renderLogitsFromBatch(TTE* t, int n, llama_batch *b)
 		if(t->children.size()) {
 			TTE *tt = t->children[t->sel];
 			if(b->logits[i]) {
-				float *logits = llama_get_logits_ith(ctx, i);
+				float *logits = backend->logits(i);
 				float max_logit = *std::max_element(logits, logits+n_vocab);
+				memo_put(t, logits);
 				
 				tt->logit = logits[tt->tok];
 				tt->max_logit = max_logit;
 				tt->has_logit = true;
+				tt->stale = false;
 				
 				if(tt->is_accepted) {
 					printf("'%s' (%d) len=%d at %d batch new logit %.2f\n", tt->str.c_str(), tt->tok, tt->str_size, tt->depth, tt->logit);
@@ -702,12 +1734,39 @@ void LLMBuffer::renderLogitsFromBatch(TTE* t, int n, llama_batch *b)
 std::shared_ptr<uint8_t[]> LLMBuffer::prepareBatch(TTWorkload *wl)
 {
 	common_batch_clear(work_batch);
-	if(ctx_state && ctx_state == wl->target->parent) {
-		common_batch_add(work_batch, wl->target->tok, wl->target->depth, { 0 }, false);
-		work_batch.logits[0]=true;
-		work_base = wl->target;
+	// positions are relative to the start of the attention window, which slides along long documents
+	int off = window_start(wl->target->depth);
+	work_shift = 0;
+	work_clear = false;
+	
+	// if the context is at an ancestor of the target already, the tokens in between only need to be appended
+	std::vector<TTE*> steps;
+	if(ctx_state && off >= ctx_off) {
+		TTE *p = wl->target;
+		while(p && p != ctx_state && p->depth > ctx_state->depth) {
+			steps.push_back(p);
+			p = p->parent;
+		}
+		if(p != ctx_state || !steps.size() || steps.back()->depth < off) steps.clear();
+		// logits are handed out along selected children, so that is the only way the batch can go
+		for(int i = 0; i+1 < (int)steps.size(); ++i)
+			if(steps[i]->parent->children[steps[i]->parent->sel] != steps[i]) {
+				steps.clear();
+				break;
+			}
+	}
+	
+	if(steps.size()) {
+		work_shift = off - ctx_off; // evict what fell out of the window, and move the rest down
+		ctx_off = off;
+		for(int i = steps.size()-1; i>=0; --i) {
+			common_batch_add(work_batch, steps[i]->tok, steps[i]->depth - off, { 0 }, false);
+			work_batch.logits[steps.size()-1-i] = !i || !steps[i-1]->has_logit;
+		}
+		work_base = steps.back();
+		work_catchup = 0;
 		ctx_state = wl->target;
-		printf("single step by '%s' (%d) at %d (+%d)\n", wl->target->str.c_str(), wl->target->tok, wl->target->depth, wl->target->base_pos);
+		printf("step by %d to '%s' (%d) at %d (+%d)\n", (int)steps.size(), wl->target->str.c_str(), wl->target->tok, wl->target->depth, wl->target->base_pos);
 
 		return nullptr;
 	} else {
@@ -716,8 +1775,9 @@ std::shared_ptr<uint8_t[]> LLMBuffer::prepareBatch(TTWorkload *wl)
 		std::vector<bool> need_logits;
 		need_logits.push_back(true);
 		
+		// no need to go further back than the window reaches
 		TTE *pos = wl->target;
-		while(!pos->ctx_snapshot){
+		while((!pos->ctx_snapshot || pos->snapshot_off > off) && pos->depth > off){
 			toks.push_back(pos->tok);
 			if(!pos->has_logit) need_logits.push_back(true);
 			else need_logits.push_back(false);
@@ -726,8 +1786,37 @@ std::shared_ptr<uint8_t[]> LLMBuffer::prepareBatch(TTWorkload *wl)
 		}
 		toks.push_back(pos->tok); // assume snapshot was made BEFORE this token
 		
+		// a snapshot from before the window start is no use, as all of it would be evicted; start from empty then
+		std::shared_ptr<uint8_t[]> snap;
+		if(pos->ctx_snapshot && pos->depth > off && pos->snapshot_off <= off) {
+			snap = pos->ctx_snapshot;
+			work_shift = off - pos->snapshot_off;
+		} else {
+			work_clear = true;
+		}
+		
+		// a state for more of these tokens may be cached, from a branch that was rebuilt since or from another buffer
+		std::vector<llama_token> path;
+		std::shared_ptr<uint8_t[]> cached;
+		int cached_off;
+		int l = 0;
+		if(kv_cache && wl->target->parent && path_tokens(wl->target->parent, path))
+			l = kv_cache->find(kv_key, path.data(), path.size(), pos->depth, off, cached, cached_off);
+		if(l) {
+			// the state is from after l tokens, so decoding starts at depth l
+			toks.resize(wl->target->depth - l + 1);
+			need_logits.resize(toks.size());
+			pos = wl->target;
+			while(pos->depth > l) pos = pos->parent;
+			snap = cached;
+			work_shift = off - cached_off;
+			work_clear = false;
+			printf("cached state for %d tokens\n", l);
+		}
+		ctx_off = off;
+		
 		// add tokens we saw in reverse order
-		int d = pos->depth;
+		int d = pos->depth - off;
 		for(int i = toks.size()-1; i>=0; --i) {
 			common_batch_add(work_batch, toks[i], d++, { 0 }, false);
 			work_batch.logits[toks.size()-1-i] = need_logits[i];
@@ -744,21 +1833,26 @@ std::shared_ptr<uint8_t[]> LLMBuffer::prepareBatch(TTWorkload *wl)
 		char txt[1024], *p=txt;
 		for(int i = toks.size()-1; i>=0; --i) {
 			//txt+=llama_token_to_piece(ctx,toks[i],false);
-			p += llama_token_to_piece(vocab, toks[i], p, 1024-(p-txt), 0, false);
+			int n = backend->token_to_piece(toks[i], p, 1023-(p-txt), false);
+			if(n < 0) break; // long catchups only get their beginning shown
+			p += n;
 			//printf("%d ",toks[i]);
 		}
 		*p = 0;
 		printf("reset to '%s' (%d) at %d (+%d), catchup '%s'\n", pos->str.c_str(), pos->tok, pos->depth, pos->base_pos, txt);
 		
 		work_base = pos;
+		work_catchup = toks.size() - 1; // all but the target were decoded before
 		ctx_state = wl->target;
 
-		return pos->ctx_snapshot;
+		return snap;
 	}
 }
 
 void LLMBuffer::req_alts_at_pos(int pos)
 {
+	trace.put(TR_CURSOR, pos);
+	if(!backend) return;
 	TTE *cur = pos2ent(pos);
 	printf("req alts from '%s' (%d) at %d (+%d)\n", cur->str.c_str(), cur->tok, cur->depth, cur->base_pos);
 	purgePredictionWork(); // get rid of old prediction tasks
@@ -786,11 +1880,14 @@ void LLMBuffer::get_alts_at_pos(int pos, std::string &above, std::string &select
 
 void LLMBuffer::alt_next(int pos)
 {
+	trace.put(TR_ALT_NEXT, pos);
 	TTE *cur = pos2ent(pos);
 	if(cur->children.size()>(cur->sel+1))
 		++cur->sel;
+	live_changed(cur);
 		
 	if(cur->children.size()) {
+		if(cur->children[cur->sel]->foreign) naturalize(cur->children[cur->sel]);
 		actualize(cur->children[cur->sel]);
 		enqueueWork(WL_SCORE, cur->children[cur->sel]); // previous changes might have left this branch unscored
 	}
@@ -801,11 +1898,14 @@ void LLMBuffer::alt_next(int pos)
 
 void LLMBuffer::alt_prev(int pos)
 {
+	trace.put(TR_ALT_PREV, pos);
 	TTE *cur = pos2ent(pos);
 	if(cur->sel>0)
 		--cur->sel;
+	live_changed(cur);
 	
 	if(cur->children.size()) {
+		if(cur->children[cur->sel]->foreign) naturalize(cur->children[cur->sel]);
 		actualize(cur->children[cur->sel]);
 		enqueueWork(WL_SCORE, cur->children[cur->sel]); // previous changes might have left this branch unscored
 	}
@@ -816,9 +1916,11 @@ void LLMBuffer::alt_prev(int pos)
 
 int LLMBuffer::alt_commit(int pos)
 {
+	trace.put(TR_ALT_COMMIT, pos);
 	TTE *cur = pos2ent(pos);
 	if(cur->children.size()) {
 		cur->children[cur->sel]->is_accepted = true;
+		live_changed(cur);
 		actualize(cur->children[cur->sel]);
 		// skip to not end in the middle of a UTF-8 codon
 		cur = cur->children[cur->sel];
@@ -836,6 +1938,7 @@ int LLMBuffer::alt_commit(int pos)
 
 int LLMBuffer::alt_back(int pos)
 {
+	trace.put(TR_ALT_BACK, pos);
 	TTE *cur = pos2ent(pos);
 	
 	if(cur->base_pos == pos) {
@@ -868,10 +1971,11 @@ void TTE::set_tok(llama_token t)
 	
 	tok = t;
 	char buf[128];
-	str_size = llama_token_to_piece(buffer->vocab, t, buf, 128, 0, depth>0);
+	str_size = buffer->backend->token_to_piece(t, buf, 128, depth>0);
 	//str_size = llama_detokenize(buffer->vocab, &t, 1, buf, 128, false, false);
 	buf[str_size]=0;
 	str = buf;
+	update_hash();
 
 	/*
 	if(str.validate()) str_size = str.size();
@@ -882,30 +1986,56 @@ void TTE::set_tok(llama_token t)
 	*/
 }
 
-void TTE::reroot(int delta_depth, int delta_pos)
+void TTE::update_hash()
 {
-	has_logit = false;
-	depth += delta_depth;
-	base_pos += delta_pos;
+	uint64_t h = parent ? parent->prefix_hash : LOGITMEMO_SEED;
+	// foreign tokens go by their text, so nothing after one can pass for a prefix of real tokens
+	if(foreign) prefix_hash = logitmemo_hash(h ^ 1, str.data(), str.size());
+	else prefix_hash = logitmemo_hash(h, &tok, sizeof(tok));
+}
 
-	for(int i=0; i<children.size(); ++i) {
-		if(!children[i]->is_accepted) {
-			delete children[i];
-			children.erase(children.begin()+i);
-			if(sel>=i) --sel; // TODO: this will behave weirdly if an empty prediction was selected
-			--i;
-		} else {
-			children[i]->reroot(delta_depth, delta_pos);
+/* move this subtree along. Iteratively, parents before their children, as it can be as deep as the
+ * document is long */
+void TTE::reroot(int delta_depth, int delta_pos)
+{
+	std::vector<TTE*> todo(1, this);
+	while(todo.size()) {
+		TTE *t = todo.back();
+		todo.pop_back();
+		
+		buffer->expand(t); // its subtree moves along, and loses its scores, like the rest
+		t->has_logit = false;
+		t->depth += delta_depth;
+		t->base_pos += delta_pos;
+		t->update_hash(); // the prefix before may have changed
+		buffer->memo_apply(t);
+
+		for(int i=0; i<t->children.size(); ++i) {
+			if(!t->children[i]->is_accepted) {
+				delete t->children[i];
+				t->children.erase(t->children.begin()+i);
+				if(t->sel>=i) --t->sel; // TODO: this will behave weirdly if an empty prediction was selected
+				--i;
+			} else {
+				todo.push_back(t->children[i]);
+			}
 		}
 	}
 }
 
+/* deleting a child would delete its children first, and so on all the way down, so the subtree is
+ * taken apart instead and every node is childless by the time it goes */
 void TTE::clear_children()
-{	
-	for(TTE *a : children) {
+{
+	std::vector<TTE*> todo;
+	todo.swap(children);
+	while(todo.size()) {
+		TTE *a = todo.back();
+		todo.pop_back();
+		todo.insert(todo.end(), a->children.begin(), a->children.end());
+		a->children.clear();
 		delete a;
 	}
-	children.clear();
 }
 
 
@@ -917,9 +2047,20 @@ TTE::~TTE()
 	if(buffer->ctx_state == this) {
 		buffer->ctx_state = NULL;
 	}
+	// and drop it from the live path index
+	buffer->live_cut(this);
+	--buffer->n_nodes;
 }
 
 TTE::TTE(LLMBuffer *b)
 {
 	buffer = b;
+	++buffer->n_nodes;
+	parent = NULL;
+	depth = 0;
+	lazy = -1;
+	prefix_hash = LOGITMEMO_SEED;
+	stale = false;
+	foreign = false;
+	snapshot_off = 0;
 }
@@ -5,7 +5,17 @@
 #include <thread>
 #include <mutex>
 #include <functional>
+#include <atomic>
+#include <climits>
 #include "common.h"
+#include "textstore.h"
+#include "logitmemo.h"
+#include "kvcache.h"
+#include "diskcache.h"
+#include "session.h"
+#include "backend.h"
+#include "trace.h"
+#include "profiler.h"
 
 struct LLMBuffer;
 
@@ -16,14 +26,20 @@ struct TTE {
 	int depth;
 	
 	std::shared_ptr<uint8_t[]> ctx_snapshot;
+	int snapshot_off; // window start the snapshot's positions are relative to
+	int64_t lazy; // while its children are still in the session file: offset of this node there, else -1
 	
 	llama_token tok;
 	std::string str;
 	int str_size;
 	void set_tok(llama_token t); // compute str and size
+	uint64_t prefix_hash; // of the tokens from the root up to and including this one
+	void update_hash();
 	float logit;
 	float max_logit;
 	bool has_logit;
+	bool stale; // logit came from a previous model; still shown, but due to be rescored
+	bool foreign; // carried over from a model with a different vocabulary: tok is meaningless, only str counts
 
 	std::vector<TTE* > children;
 	TTE *parent;
@@ -46,26 +62,64 @@ struct TTWorkload {
 	int depth;
 	TTE *target;
 	int gen_extra;
+	int64_t t_queued;
 };
 
 struct LLMBuffer {
+	int n_nodes = 0; // TTEs alive, kept up to date by TTE itself; comes before root, which is one
+	
+	/* index of the live path, so the editor can find tokens by offset without walking from root. Also
+	 * before root, as its nodes drop out of the index as they are deleted. Entries before live_stale are
+	 * known to be good; index_live() walks on from the last of them. */
+	std::vector<TTE*> live; // live path from root, up to and including the first token that is not accepted
+	std::vector<int> live_pos; // offset of each entry of live
+	int live_stale = 0; // first entry that may be out of date, INT_MAX if none; 0 to have it all redone
+	void live_changed(TTE *t); // t's children, selection or acceptance changed, so the path after it may have
+	void live_cut(TTE *t); // t is going away
+	void index_live();
+	int live_find(int pos); // index into live of the first token starting at or after pos
+	
 	TTE root;
+	TextStore doc; // text of the live path, shared with the editor widget
 	
-	llama_model *model;
-	llama_context_params ctx_params;
-	llama_context *ctx;
-	const llama_vocab *vocab;
+	LLMBackend *backend = NULL; // what the tree is scored with; without one, the buffer is plain text
+	LlamaBackend *llama = NULL; // the same, if it is a llama.cpp model
 	int n_vocab;
+	void set_backend(LLMBackend *b, uint64_t vocab_hash, const std::string &disk_key = ""); // takes ownership; see vocab_fingerprint()
+	uint64_t vocab_hash = 0; // tells whether token ids carry over when the model changes
 	
 	std::function<void(int,int)> notify_invalidate;
 	std::function<void(int,int,float)> notify_new_logit;
 	std::function<void(void)> notify_new_predictions;
-	std::function<void(int,std::string)> notify_change_tail;
+	std::function<void(int,int,int)> notify_edit; // offset, bytes removed, bytes inserted; already applied to doc
+	std::function<void(void)> notify_work_done_async; // called from background threads when they have something for the UI thread
+	std::function<void(void)> notify_model_loaded; // a new model was swapped in, or a session loaded; pointers into the tree may be gone
+	std::function<void(TTE*,const float*)> notify_logits; // all n_vocab logits at t's position, as they come out of a decode
 
 	/* config */
 	int snapshot_freq = 10;
 	int predict_main = 6;
 	int predict_alt = 4;
+	int tokenize_par_min = 256*1024; // inputs at least this long are tokenized in parallel chunks
+	int tokenize_chunk = 64*1024;
+	bool tokenize_chunked = false; // whether the vocabulary allows that, as found by set_backend()
+	int retokenize_ahead = 256; // bytes past an edit that are retokenized at first; more only if the tokens have not lined up with the old ones by then
+	int ctx_min = 1024; // context size a model starts with; grown on demand up to its trained length
+	int window = 0; // attention window for documents longer than that; 0 is the trained length
+	int window_stride = 256; // how far the window moves at a time
+	int score_batch = 1; // accepted tokens the scoring pass decodes at a time; one gets each highlighted as soon as possible
+	bool reuse_scores = true; // take scores from the memo and the disk cache; off when every token's logits must be seen
+	
+	/* threading; see set_threads() */
+	int n_threads = 0, n_threads_batch = 0; // for single tokens and for batches; as tuned for the model unless set by the user
+	bool threads_by_user = false;
+	bool pin_threads = false; // give each worker its own core, and keep ui_core for the render thread
+	int ui_core = 0;
+	ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED; // can only be picked before init()
+	void set_threads(int n_threads, int n_threads_batch, bool pin);
+	
+	/* measured decode throughput, tokens/s */
+	float tps_single = 0.0f, tps_batch = 0.0f;
 
 	/* model params */
 	std::string model_fn, model_arch, model_size;
@@ -86,23 +140,107 @@ struct LLMBuffer {
 	bool llm_state_changed;
 	//Glib::Dispatcher work_done;
 	bool work_done_flag;
+	int64_t work_us; // wall time of the last decode
+	int work_rc = 0; // what llama_decode returned for it
 	void CheckWork();
 	void on_work_done();
+	void apply_work();
 	void try_start_working();
 	std::shared_ptr<uint8_t[]> prepareBatch(TTWorkload *wl);
+	
+	bool threads_dirty = false;
+	ggml_threadpool *pool = NULL, *pool_batch = NULL;
+	void apply_threads();
+	void free_threadpools();
+	bool grow_ctx(int need);
+	void resize_batch();
+	int window_size();
+	int window_start(int depth); // first depth that is still in the window when decoding depth
+	int ctx_off = 0; // window start of the context's current state
+	int work_shift; // positions the worker evicts and shifts the context by before decoding
+	bool work_clear; // or whether it starts from an empty context
+	size_t snapshot_size = 0; // bytes per snapshot, last we took one
+	
+	/* where the time of each decode goes; see profiler.h */
+	Profiler prof;
+	WorkRecord work_rec; // of the decode in flight, as far as it is known
+	int work_catchup;
+	int64_t work_restore_us, work_end_us; // written by the worker
+	int64_t work_capture_us;
+	int64_t prof_nested_us = 0; // spent in prepareBatch so far, to tell it apart from the work done around it
+	
+	/* scores of prefixes seen before, so retyping or undoing does not need the model */
+	LogitMemo memo;
+	void memo_put(TTE *t, const float *logits); // logits of t's position, for t's children
+	bool memo_apply(TTE *t);
+	
+	/* context states by token prefix, shared with other buffers; prepareBatch restores from the longest one */
+	KVPrefixCache *kv_cache = &kvcache_shared();
+	std::string kv_key; // the model's in it: the disk cache key, which buffers on the same model have in common
+	bool path_tokens(TTE *t, std::vector<llama_token> &out); // root up to and including t; false if any are foreign
+	
+	/* states and scores of the accepted text, kept on disk for the next session */
+	DiskKVCache disk_cache;
+	int disk_depth = 0; // depth of the last checkpoint written
+	void disk_store(TTE *t, std::shared_ptr<uint8_t[]> snap);
+	void disk_restore(TTE *t);
+	
+	/* sessions; see session.h */
+	std::shared_ptr<SessionFile> session; // where nodes that were not built yet come from
+	std::string session_pending, session_error;
+	bool save_session(const std::string &fn, bool with_snapshots);
+	void open_session(const std::string &fn); // loads as soon as the worker is idle
+	bool load_session(const std::string &fn);
+	void expand(TTE *t); // build t's children from the session file, if they are still there
+	void expand_all(TTE *t);
+	void release_session(); // copy what still points into the session file out of it, and let the mapping go
+	
+	/* running out of memory or context: give things up gradually rather than crash */
+	int decode_failures = 0; // in a row
+	std::string work_error; // set once there is nothing left to give up; shown in the UI
+	std::shared_ptr<uint8_t[]> alloc_snapshot(size_t size = 0); // of snapshot_size bytes unless given
+	bool degrade(const char *why);
+	int drop_cold(bool prune);
 	void renderLogitsFromBatch(TTE* start, int n, llama_batch *b);
 	
 	void init();
-	void load_model(const char *fn);
+	
+	/* background model loading */
+	std::thread *load_thread = NULL;
+	std::string load_fn, load_error;
+	std::atomic<float> load_progress{0.0f};
+	std::atomic<const char*> load_stage{"Loading"}; // what load_progress is measuring
+	std::atomic<bool> load_done{false};
+	LlamaBackend *new_backend = NULL; // written by the load thread, swapped in by CheckLoad()
+	uint64_t new_vocab_hash = 0;
+	std::string new_disk_key;
+	void load_model_async(const char *fn);
+	bool is_loading();
+	void CheckLoad();
+	
+	/* model hot-swap: keep the tree, and bring it up to date with the new model lazily */
+	int view_from = 0, view_to = 0; // document range on screen, set by the editor, rescored first
+	void retire(bool foreign);
+	TTE *naturalize(TTE *f);
+	void graft(TTE *at, TTE *sub, const std::string &bridge);
+	void rescore();
 	
 	void insert(int pos, std::string text);
 	void erase(int from, int to);
 	
+	TraceRecorder trace; // calls from the editor below are written here while it is active; see trace.h
+	
 	TTE *pos2ent(int pos);
 	TTE *pos2wordent(int pos);
 	
+	std::vector<llama_token> tokenize(const std::string &text, bool add_special);
+	std::vector<llama_token> tokenize_par(const std::string &text, bool add_special);
+	
 	std::string render(TTE *tt, int max_tok=99999, bool render_predictions=false);
-	void rebuild(TTE *start, std::string text, int change_end=0, int reconcile_offset=0);
+	void render(TTE *tt, const std::function<bool(TTE*)> &f, int max_tok=99999, bool render_predictions=false);
+	bool renders_as_doc(TTE *tt);
+	std::vector<llama_token> retokenize(TTE *start, int change_end, int reconcile_offset);
+	void rebuild(TTE *start, int change_end, int reconcile_offset=0); // after the document changed, up to change_end, and shifted what came after by reconcile_offset
 	void actualize(TTE *start);
 	
 	void req_alts_at_pos(int pos);
@@ -0,0 +1,110 @@
+#include "trace.h"
+#include "ggml.h"
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+const char *trace_op_names[TR_COUNT] = { "insert", "erase", "cursor", "alt_next", "alt_prev", "alt_commit", "alt_back" };
+
+static void put_escaped(FILE *f, const std::string &s)
+{
+	for(char c : s) {
+		switch(c) {
+		case '\t': fputs("\\t", f); break;
+		case '\n': fputs("\\n", f); break;
+		case '\r': fputs("\\r", f); break;
+		case '\\': fputs("\\\\", f); break;
+		default: fputc(c, f);
+		}
+	}
+}
+
+static std::string unescape(const std::string &s)
+{
+	std::string ret;
+	for(size_t i=0; i<s.size(); ++i) {
+		if(s[i] != '\\' || i+1 == s.size()) {
+			ret += s[i];
+			continue;
+		}
+		switch(s[++i]) {
+		case 't': ret += '\t'; break;
+		case 'n': ret += '\n'; break;
+		case 'r': ret += '\r'; break;
+		default: ret += s[i];
+		}
+	}
+	return ret;
+}
+
+bool TraceRecorder::start(const std::string &fn, const std::string &model_fn, const std::string &doc)
+{
+	stop();
+	f = fopen(fn.c_str(), "wb");
+	if(!f) return false;
+	this->fn = fn;
+	t0 = ggml_time_us();
+	fprintf(f, "autopen-trace\t1\nmodel\t");
+	put_escaped(f, model_fn);
+	fprintf(f, "\ndoc\t");
+	put_escaped(f, doc);
+	fprintf(f, "\n");
+	return true;
+}
+
+void TraceRecorder::stop()
+{
+	if(f) fclose(f);
+	f = NULL;
+}
+
+void TraceRecorder::put(trace_op op, int a, int b, const std::string &text)
+{
+	if(!f) return;
+	fprintf(f, "%lld\t%s\t%d\t%d\t", (long long)(ggml_time_us() - t0), trace_op_names[op], a, b);
+	put_escaped(f, text);
+	fprintf(f, "\n");
+	fflush(f); // so a crash does not take the trace leading up to it along
+}
+
+bool read_trace(const std::string &fn, std::string &model_fn, std::string &doc, std::vector<TraceEvent> &events, std::string &error)
+{
+	std::ifstream in(fn, std::ios::binary);
+	if(!in) {
+		error = "cannot open " + fn;
+		return false;
+	}
+	std::string line;
+	if(!std::getline(in, line) || line != "autopen-trace\t1") {
+		error = fn + " is not a trace";
+		return false;
+	}
+	events.clear();
+	for(int n=2; std::getline(in, line); ++n) {
+		std::vector<std::string> f;
+		std::stringstream ss(line);
+		for(std::string x; std::getline(ss, x, '\t'); ) f.push_back(x);
+		if(line.size() && line.back() == '\t') f.push_back("");
+
+		if(f.size() == 2 && f[0] == "model") model_fn = unescape(f[1]);
+		else if(f.size() == 2 && f[0] == "doc") doc = unescape(f[1]);
+		else if(f.size() == 5) {
+			TraceEvent e;
+			e.t_us = atoll(f[0].c_str());
+			e.op = TR_COUNT;
+			for(int i=0; i<TR_COUNT; ++i) if(f[1] == trace_op_names[i]) e.op = (trace_op)i;
+			e.a = atoi(f[2].c_str());
+			e.b = atoi(f[3].c_str());
+			e.text = unescape(f[4]);
+			if(e.op == TR_COUNT) {
+				error = fn + ":" + std::to_string(n) + ": unknown call '" + f[1] + "'";
+				return false;
+			}
+			events.push_back(e);
+		} else if(line.size()) {
+			error = fn + ":" + std::to_string(n) + ": malformed line";
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+#define TRACE_EXT ".aptr"
+
+/* Traces are recordings of what the editor asked of its LLMBuffer, and when, so that an editing session
+ * can be played back headless (autopen-replay) against another model or other settings. A trace is text:
+ *
+ *   autopen-trace 1
+ *   model   file name of the model it was recorded with
+ *   doc     the document when recording started
+ *   then a line per call: microseconds since the start, the call, its offsets and text, if any
+ *
+ * separated by tabs, with tabs, line breaks and backslashes in text escaped as in C. */
+enum trace_op { TR_INSERT=0, TR_ERASE, TR_CURSOR, TR_ALT_NEXT, TR_ALT_PREV, TR_ALT_COMMIT, TR_ALT_BACK, TR_COUNT };
+extern const char *trace_op_names[TR_COUNT];
+
+struct TraceEvent {
+	int64_t t_us;
+	trace_op op;
+	int a, b; // insert: offset; erase: from, to; everything else: the cursor
+	std::string text; // insert only
+};
+
+struct TraceRecorder {
+	FILE *f = NULL;
+	std::string fn;
+	int64_t t0 = 0;
+
+	bool start(const std::string &fn, const std::string &model_fn, const std::string &doc);
+	void stop();
+	bool active() { return f != NULL; }
+	void put(trace_op op, int a, int b = 0, const std::string &text = "");
+};
+
+bool read_trace(const std::string &fn, std::string &model_fn, std::string &doc, std::vector<TraceEvent> &events, std::string &error);
+
+#endif
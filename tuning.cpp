@@ -0,0 +1,227 @@
+#include "tuning.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include "ggml-cpu.h"
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+void LLMTuning::apply(llama_context_params &p) const
+{
+	p.n_threads = n_threads;
+	p.n_threads_batch = n_threads_batch;
+	p.n_ubatch = std::min((uint32_t)n_ubatch, p.n_batch);
+}
+
+/* something that tells this CPU apart from others the tuning file may have been copied from */
+static std::string cpu_name()
+{
+	std::string name;
+#ifdef _WIN32
+	if(const char *id = getenv("PROCESSOR_IDENTIFIER")) name = id;
+#else
+	std::ifstream f("/proc/cpuinfo");
+	std::string line;
+	while(std::getline(f, line)) {
+		if(!line.compare(0, 10, "model name")) {
+			name = line.substr(line.find(':')+2);
+			break;
+		}
+	}
+#endif
+	if(!name.size()) name = "unknown cpu";
+	return name + " x" + std::to_string(std::thread::hardware_concurrency());
+}
+
+std::string tuning_key(const std::string &model_fn, int n_gpu_layers)
+{
+	// the same path may hold a different file next time, so size and date are part of the key
+	std::error_code ec;
+	std::filesystem::path p = std::filesystem::absolute(model_fn, ec);
+	uintmax_t size = std::filesystem::file_size(p, ec);
+	long long mtime = std::filesystem::last_write_time(p, ec).time_since_epoch().count();
+
+	std::string key = p.string() + "|" + std::to_string(size) + "|" + std::to_string(mtime) + "|" + cpu_name() + "|ngl " + std::to_string(n_gpu_layers);
+	std::replace(key.begin(), key.end(), '\t', ' ');
+	std::replace(key.begin(), key.end(), '\n', ' ');
+	return key;
+}
+
+/* the tuning file has one line per key: key, a tab, then n_threads n_threads_batch n_ubatch */
+bool tuning_load(const std::string &key, LLMTuning &out)
+{
+	std::ifstream f(TUNING_FILE);
+	std::string line;
+	while(std::getline(f, line)) {
+		size_t tab = line.find('\t');
+		if(tab == std::string::npos || line.compare(0, tab, key)) continue;
+
+		std::istringstream v(line.substr(tab+1));
+		LLMTuning t;
+		if(!(v >> t.n_threads >> t.n_threads_batch >> t.n_ubatch)) return false;
+		if(t.n_threads < 1 || t.n_threads_batch < 1 || t.n_ubatch < 1) return false;
+		out = t;
+		printf("tuning: reusing %d/%d threads, ubatch %d\n", t.n_threads, t.n_threads_batch, t.n_ubatch);
+		return true;
+	}
+	return false;
+}
+
+void tuning_save(const std::string &key, const LLMTuning &t)
+{
+	// keep everyone else's lines, replace ours
+	std::vector<std::string> lines;
+	{
+		std::ifstream f(TUNING_FILE);
+		std::string line;
+		while(std::getline(f, line)) {
+			size_t tab = line.find('\t');
+			if(tab != std::string::npos && !line.compare(0, tab, key)) continue;
+			lines.push_back(line);
+		}
+	}
+	std::ofstream f(TUNING_FILE, std::ios::trunc);
+	for(auto &l : lines) f << l << "\n";
+	f << key << "\t" << t.n_threads << " " << t.n_threads_batch << " " << t.n_ubatch << "\n";
+}
+
+void warm_up(llama_context *ctx)
+{
+	const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(ctx));
+	std::vector<llama_token> toks;
+	if(llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) toks.push_back(llama_vocab_bos(vocab));
+	if(llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) toks.push_back(llama_vocab_eos(vocab));
+	if(!toks.size()) toks.push_back(0);
+
+	llama_decode(ctx, llama_batch_get_one(toks.data(), toks.size()));
+	llama_synchronize(ctx);
+	llama_kv_cache_clear(ctx);
+}
+
+/* seconds per token for reps decodes of n tokens each, starting from an empty cache */
+static double time_decode(llama_context *ctx, llama_batch &batch, const std::vector<llama_token> &toks, int n, int reps)
+{
+	llama_kv_cache_clear(ctx);
+	int pos = 0;
+	int64_t t0 = ggml_time_us();
+	for(int r=0; r<reps; ++r) {
+		common_batch_clear(batch);
+		for(int i=0; i<n; ++i, ++pos)
+			common_batch_add(batch, toks[pos % toks.size()], pos, { 0 }, i==n-1);
+		if(llama_decode(ctx, batch)) return 1e30;
+		llama_synchronize(ctx);
+	}
+	int64_t t1 = ggml_time_us();
+	llama_kv_cache_clear(ctx);
+	return (t1-t0) * 1e-6 / (n*reps);
+}
+
+LLMTuning tuning_probe(llama_model *model, llama_context_params params, std::function<void(float)> progress)
+{
+	// a quarter, half, three quarters and all of the hardware threads
+	int hw = std::max(1, (int)std::thread::hardware_concurrency());
+	std::vector<int> threads;
+	for(int q=1; q<=4; ++q) {
+		int t = std::max(1, hw*q/4);
+		if(std::find(threads.begin(), threads.end(), t) == threads.end()) threads.push_back(t);
+	}
+	// past n_probe, larger ubatches behave the same in the probe, so only smaller ones are tried against the default
+	const int n_probe = 128;
+	const int ubatches[] = { (int)params.n_ubatch, n_probe/2, n_probe/4 };
+
+	const llama_vocab *vocab = llama_model_get_vocab(model);
+	std::vector<llama_token> toks(n_probe);
+	for(int i=0; i<n_probe; ++i) toks[i] = (100 + 7*i) % llama_vocab_n_tokens(vocab); // content does not matter for timing
+	llama_batch batch = llama_batch_init(n_probe, 0, 1);
+
+	LLMTuning best = { threads.back(), threads.back(), (int)params.n_ubatch };
+	double best_tg = 1e30, best_pp = 1e30;
+	int steps = 2*threads.size() + 2, step = 0;
+
+	// first find the best thread counts at the largest ubatch, then see if a smaller ubatch helps prompt processing
+	for(int ub : ubatches) {
+		params.n_ubatch = ub;
+		llama_context *ctx = llama_new_context_with_model(model, params);
+		if(!ctx) continue;
+		warm_up(ctx);
+
+		bool first = (ub == ubatches[0]);
+		for(int t : threads) {
+			if(!first && t != best.n_threads_batch) continue;
+			llama_set_n_threads(ctx, t, t);
+
+			if(first) {
+				double tg = time_decode(ctx, batch, toks, 1, 8);
+				printf("tuning: %d threads, single token: %.1f ms\n", t, tg*1e3);
+				if(tg < best_tg) {
+					best_tg = tg;
+					best.n_threads = t;
+				}
+				progress(++step / (float)steps);
+			}
+
+			double pp = time_decode(ctx, batch, toks, n_probe, 1);
+			printf("tuning: %d threads, ubatch %d, batch: %.2f ms/token\n", t, ub, pp*1e3);
+			if(pp < (first ? best_pp : 0.95*best_pp)) { // a smaller ubatch has to be clearly better, not just noise
+				best_pp = pp;
+				best.n_threads_batch = t;
+				best.n_ubatch = ub;
+			}
+			progress(++step / (float)steps);
+		}
+		llama_free(ctx);
+	}
+	llama_batch_free(batch);
+
+	printf("tuning: picked %d/%d threads, ubatch %d\n", best.n_threads, best.n_threads_batch, best.n_ubatch);
+	return best;
+}
+
+ggml_threadpool *threadpool_pinned(int n_threads, int skip_core)
+{
+	ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+	int hw = std::min((int)std::thread::hardware_concurrency(), GGML_MAX_N_THREADS);
+	for(int i=0; i<hw; ++i) tpp.cpumask[i] = (i != skip_core);
+	tpp.strict_cpu = true;
+	return ggml_threadpool_new(&tpp);
+}
+
+void pin_this_thread(int core)
+{
+#ifdef _WIN32
+	DWORD_PTR proc_mask, sys_mask;
+	GetProcessAffinityMask(GetCurrentProcess(), &proc_mask, &sys_mask);
+	SetThreadAffinityMask(GetCurrentThread(), core < 0 ? proc_mask : ((DWORD_PTR)1 << core));
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	int hw = std::thread::hardware_concurrency();
+	for(int i=0; i<hw; ++i)
+		if(core < 0 || i == core) CPU_SET(i, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)core; // no affinity control here, the scheduler decides
+#endif
+}
+
+static const char *numa_names[] = { "disabled", "distribute", "isolate", "numactl", "mirror" };
+
+ggml_numa_strategy numa_strategy(const char *name)
+{
+	for(int i=0; i<GGML_NUMA_STRATEGY_COUNT; ++i)
+		if(!strcmp(name, numa_names[i])) return (ggml_numa_strategy)i;
+	return GGML_NUMA_STRATEGY_DISABLED;
+}
+
+const char *numa_name(ggml_numa_strategy numa)
+{
+	return (numa >= 0 && numa < GGML_NUMA_STRATEGY_COUNT) ? numa_names[numa] : "?";
+}
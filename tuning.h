@@ -0,0 +1,37 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <string>
+#include <functional>
+#include "common.h"
+
+#define TUNING_FILE "autopen-tuning.txt"
+
+/* context parameters that are worth measuring rather than guessing. The fastest values depend on the
+ * model, the CPU and how much of the model sits on the GPU, so they are probed once and remembered in
+ * TUNING_FILE, keyed by model file and machine. */
+struct LLMTuning {
+	int n_threads;       // for decoding single tokens
+	int n_threads_batch; // for catching up on many tokens at once
+	int n_ubatch;
+
+	void apply(llama_context_params &p) const;
+};
+
+std::string tuning_key(const std::string &model_fn, int n_gpu_layers);
+bool tuning_load(const std::string &key, LLMTuning &out);
+void tuning_save(const std::string &key, const LLMTuning &t);
+
+/* try a few thread counts and ubatch sizes on throwaway contexts made from params, report the fastest */
+LLMTuning tuning_probe(llama_model *model, llama_context_params params, std::function<void(float)> progress);
+
+/* run a throwaway decode, so the first real one does not pay for faulting in weights and allocating the graph */
+void warm_up(llama_context *ctx);
+
+/* threading */
+ggml_threadpool *threadpool_pinned(int n_threads, int skip_core); // one worker per core, in order, leaving out skip_core
+void pin_this_thread(int core); // -1 lets the thread run anywhere again
+ggml_numa_strategy numa_strategy(const char *name); // as in llama.cpp's --numa
+const char *numa_name(ggml_numa_strategy numa);
+
+#endif